@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "graphics/graphics.h"
+
+/* Times every drawing primitive on a few surface sizes in each draw mode.
+ * Cases that don't draw in the current mode (fill, cls, flood, loading,
+ * saving, resize, rotate, string) are only timed in NORMAL.
+ *
+ *   bench [-t ms] [-f filter] [-d dir] [-j out.json] [-b baseline.json] [-r percent]
+ *
+ * -t  time spent on each case (default 100)
+ * -f  only run primitives whose name contains filter
+ * -d  directory for the files bmp, save_bmp and save_png use (default .)
+ * -j  write the results as JSON
+ * -b  compare against results saved with -j, exits with 1 if anything got
+ *     slower by more than -r percent (default 10) */
+
+#define MAX_RESULTS 512
+#define RUNS 3
+
+struct bench_t {
+  const char* name;
+  /* Do one operation, returns the number of pixels it touched */
+  long long(*fn)(struct surface_t*, int, int);
+  /* Draws in the current draw mode, otherwise it's only timed in NORMAL */
+  bool modal;
+  /* Optional, prepares the target surface before timing */
+  void(*setup)(struct surface_t*);
+};
+
+struct result_t {
+  char name[32], mode[8];
+  int size;
+  double ns_per_op, mpix_per_s;
+};
+
+static const char* mode_names[] = { "normal", "mask", "alpha" };
+static const int sizes[] = { 64, 256, 1024 };
+
+static struct surface_t src, src_half;
+static int mode, col, pts[1024][2];
+static char bmp_path[3][512], save_path[512], png_path[512];
+static const char* text = "The quick brown fox jumps over the lazy dog. 0123456789 !?";
+
+static void on_error(enum graphics_error type, const char* msg, const char* file, const char* func, int line) {
+  fprintf(stderr, "ERROR ENCOUNTERED: %s\nFrom %s, in %s() at %d\n", msg, file, func, line);
+  abort();
+}
+
+static long long bench_fill(struct surface_t* s, int n, int i) {
+  fill(s, col ^ (i & 0xFF));
+  return (long long)n * n;
+}
+
+static long long bench_cls(struct surface_t* s, int n, int i) {
+  cls(s);
+  return (long long)n * n;
+}
+
+static long long bench_pset(struct surface_t* s, int n, int i) {
+  for (int j = 0; j < 1024; ++j)
+    pset(s, pts[j][0] % n, pts[j][1] % n, col);
+  return 1024;
+}
+
+static long long bench_line(struct surface_t* s, int n, int i) {
+  int o = i % n;
+  line(s, 0, o, n - 1, n - 1 - o, col);
+  return n;
+}
+
+static long long bench_circle(struct surface_t* s, int n, int i) {
+  circle(s, n / 2, n / 2, n / 2 - 1, col, false);
+  return (long long)(6.2832 * (n / 2 - 1));
+}
+
+static long long bench_circle_fill(struct surface_t* s, int n, int i) {
+  circle(s, n / 2, n / 2, n / 2 - 1, col, true);
+  return (long long)(3.1416 * (n / 2 - 1) * (n / 2 - 1));
+}
+
+static long long bench_rect(struct surface_t* s, int n, int i) {
+  rect(s, n / 8, n / 8, n * 3 / 4, n * 3 / 4, col, false);
+  return 4LL * (n * 3 / 4);
+}
+
+static long long bench_rect_fill(struct surface_t* s, int n, int i) {
+  rect(s, n / 8, n / 8, n * 3 / 4, n * 3 / 4, col, true);
+  return (long long)(n * 3 / 4) * (n * 3 / 4);
+}
+
+static long long bench_tri(struct surface_t* s, int n, int i) {
+  tri(s, n / 2, 0, n - 1, n - 1, 0, n - 1, col, false);
+  return (long long)(3.24 * n);
+}
+
+static long long bench_tri_fill(struct surface_t* s, int n, int i) {
+  tri(s, n / 2, 0, n - 1, n - 1, 0, n - 1, col, true);
+  return (long long)n * n / 2;
+}
+
+/* flood needs a uniform surface to have anything to do */
+static void setup_flood(struct surface_t* s) {
+  fill(s, col);
+}
+
+static long long bench_flood(struct surface_t* s, int n, int i) {
+  /* Swap colours so every call refills the whole surface */
+  struct rect_t r;
+  flood_ex(s, 0, 0, s->buf[0] == col ? (col ^ 0x00FFFFFF) : col, 0, &r);
+  return (long long)r.w * r.h;
+}
+
+static long long bench_paste(struct surface_t* s, int n, int i) {
+  paste(s, &src_half, n / 4, n / 4);
+  return (long long)src_half.w * src_half.h;
+}
+
+static long long bench_clip_paste(struct surface_t* s, int n, int i) {
+  clip_paste(s, &src, n / 4, n / 4, n / 4, n / 4, n / 2, n / 2);
+  return (long long)(n / 2) * (n / 2);
+}
+
+static long long bench_resize(struct surface_t* s, int n, int i) {
+  struct surface_t b;
+  resize(&src, n * 2, n * 2, &b);
+  surface_destroy(&b);
+  return 4LL * n * n;
+}
+
+static long long bench_rotate(struct surface_t* s, int n, int i) {
+  struct surface_t b;
+  rotate(&src, 30.f, &b);
+  long long px = (long long)b.w * b.h;
+  surface_destroy(&b);
+  return px;
+}
+
+static long long bench_writeln(struct surface_t* s, int n, int i) {
+  writeln(s, 0, (i * 10) % n, col, -1, text);
+  return (long long)strlen(text) * 8 * 10;
+}
+
+static long long bench_string(struct surface_t* s, int n, int i) {
+  struct surface_t b;
+  string(&b, col, 0, text);
+  long long px = (long long)b.w * b.h;
+  surface_destroy(&b);
+  return px;
+}
+
+static long long bench_bmp(struct surface_t* s, int n, int i) {
+  struct surface_t b;
+  int j = n == sizes[0] ? 0 : n == sizes[1] ? 1 : 2;
+  bmp(&b, bmp_path[j]);
+  surface_destroy(&b);
+  return (long long)n * n;
+}
+
+static long long bench_save_bmp(struct surface_t* s, int n, int i) {
+  save_bmp(s, save_path);
+  return (long long)n * n;
+}
+
+static long long bench_save_png(struct surface_t* s, int n, int i) {
+  save_png(s, png_path);
+  return (long long)n * n;
+}
+
+static struct bench_t benches[] = {
+  { "fill", bench_fill, false },
+  { "cls", bench_cls, false },
+  { "pset", bench_pset, true },
+  { "line", bench_line, true },
+  { "circle", bench_circle, true },
+  { "circle_fill", bench_circle_fill, true },
+  { "rect", bench_rect, true },
+  { "rect_fill", bench_rect_fill, true },
+  { "tri", bench_tri, true },
+  { "tri_fill", bench_tri_fill, true },
+  { "flood", bench_flood, false, setup_flood },
+  { "paste", bench_paste, true },
+  { "clip_paste", bench_clip_paste, true },
+  { "resize", bench_resize, false },
+  { "rotate", bench_rotate, false },
+  { "writeln", bench_writeln, true },
+  { "string", bench_string, false },
+  { "bmp", bench_bmp, false },
+  { "save_bmp", bench_save_bmp, false },
+  { "save_png", bench_save_png, false }
+};
+
+/* Half the pixels opaque, half translucent, so mask and alpha both have work to do */
+static void checker(struct surface_t* s) {
+  for (int y = 0; y < s->h; ++y)
+    for (int x = 0; x < s->w; ++x)
+      s->buf[y * s->pitch + x] = (((x >> 2) ^ (y >> 2)) & 1) ? (int)0xFF3080C0 : (int)0x80C08030;
+}
+
+static void prepare(int n) {
+  surface_destroy(&src);
+  surface_destroy(&src_half);
+  graphics_draw_mode(NORMAL);
+  surface(&src, n, n);
+  surface(&src_half, n / 2, n / 2);
+  checker(&src);
+  checker(&src_half);
+}
+
+/* Best of a few runs, each about a third of the time budget */
+static double run(struct bench_t* b, struct surface_t* s, int n, unsigned long long budget, long long* px) {
+  unsigned long long start, elapsed = 0, target = budget / RUNS;
+  long long iters = 1, i;
+  double best = -1.;
+  for (;;) {
+    start = ticks();
+    for (i = 0; i < iters; ++i)
+      *px = b->fn(s, n, (int)i);
+    elapsed = ticks() - start;
+    if (elapsed >= target / 4 || iters >= (1LL << 30))
+      break;
+    iters = elapsed ? iters * target / elapsed + 1 : iters * 16;
+  }
+  for (int r = 0; r < RUNS; ++r) {
+    start = ticks();
+    for (i = 0; i < iters; ++i)
+      *px = b->fn(s, n, (int)i);
+    elapsed = ticks() - start;
+    double ns = (double)elapsed / iters;
+    if (best < 0. || ns < best)
+      best = ns;
+  }
+  return best;
+}
+
+static int load_baseline(const char* path, struct result_t* out) {
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "can't open baseline %s\n", path);
+    return -1;
+  }
+  char line[512];
+  int n = 0;
+  while (fgets(line, sizeof(line), fp) && n < MAX_RESULTS) {
+    struct result_t* r = &out[n];
+    if (sscanf(line, " { \"name\": \"%31[^\"]\", \"size\": %d, \"mode\": \"%7[^\"]\", \"ns_per_op\": %lf, \"mpix_per_s\": %lf",
+               r->name, &r->size, r->mode, &r->ns_per_op, &r->mpix_per_s) == 5)
+      n++;
+  }
+  fclose(fp);
+  return n;
+}
+
+static bool save_results(const char* path, struct result_t* results, int n) {
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    fprintf(stderr, "can't open %s\n", path);
+    return false;
+  }
+  fprintf(fp, "{\n  \"results\": [\n");
+  for (int i = 0; i < n; ++i)
+    fprintf(fp, "    { \"name\": \"%s\", \"size\": %d, \"mode\": \"%s\", \"ns_per_op\": %.2f, \"mpix_per_s\": %.2f }%s\n",
+            results[i].name, results[i].size, results[i].mode, results[i].ns_per_op, results[i].mpix_per_s, i + 1 < n ? "," : "");
+  fprintf(fp, "  ]\n}\n");
+  fclose(fp);
+  return true;
+}
+
+int main(int argc, const char* argv[]) {
+  const char *filter = NULL, *json = NULL, *baseline = NULL, *dir = ".";
+  double threshold = 10.;
+  unsigned long long budget = 100;
+  for (int i = 1; i < argc; ++i) {
+    if (i + 1 >= argc || argv[i][0] != '-' || strlen(argv[i]) != 2) {
+      fprintf(stderr, "usage: %s [-t ms] [-f filter] [-d dir] [-j out.json] [-b baseline.json] [-r percent]\n", argv[0]);
+      return 2;
+    }
+    const char* v = argv[++i];
+    switch (argv[i - 1][1]) {
+      case 't':
+        budget = strtoull(v, NULL, 10);
+        break;
+      case 'f':
+        filter = v;
+        break;
+      case 'd':
+        dir = v;
+        break;
+      case 'j':
+        json = v;
+        break;
+      case 'b':
+        baseline = v;
+        break;
+      case 'r':
+        threshold = atof(v);
+        break;
+      default:
+        fprintf(stderr, "unknown option %s\n", argv[i - 1]);
+        return 2;
+    }
+  }
+  budget *= 1000000ULL;
+  graphics_error_callback(on_error);
+
+  static struct result_t results[MAX_RESULTS], base[MAX_RESULTS];
+  int n_results = 0, n_base = 0, regressions = 0;
+  if (baseline && (n_base = load_baseline(baseline, base)) < 0)
+    return 2;
+
+  unsigned int seed = 1234567;
+  for (int i = 0; i < 1024; ++i) {
+    seed = seed * 1103515245 + 12345;
+    pts[i][0] = (seed >> 8) & 0xFFFF;
+    seed = seed * 1103515245 + 12345;
+    pts[i][1] = (seed >> 8) & 0xFFFF;
+  }
+  snprintf(save_path, sizeof(save_path), "%s/bench_save.bmp", dir);
+  snprintf(png_path, sizeof(png_path), "%s/bench_save.png", dir);
+  for (int i = 0; i < 3; ++i) {
+    snprintf(bmp_path[i], sizeof(bmp_path[i]), "%s/bench_%d.bmp", dir, sizes[i]);
+    prepare(sizes[i]);
+    if (!save_bmp(&src, bmp_path[i]))
+      return 2;
+  }
+
+  printf("%-12s %6s %-7s %14s %10s %9s\n", "name", "size", "mode", "ns/op", "Mpix/s", "change");
+  for (int b = 0; b < (int)(sizeof(benches) / sizeof(benches[0])); ++b) {
+    if (filter && !strstr(benches[b].name, filter))
+      continue;
+    for (int z = 0; z < 3; ++z) {
+      int n = sizes[z];
+      prepare(n);
+      struct surface_t s;
+      surface(&s, n, n);
+      checker(&s);
+      for (mode = NORMAL; mode <= (benches[b].modal ? ALPHA : NORMAL); ++mode) {
+        long long px = 0;
+        graphics_draw_mode((enum draw_mode)mode);
+        col = mode == ALPHA ? (int)0x80FF8040 : (int)0xFFFF8040;
+        if (benches[b].setup)
+          benches[b].setup(&s);
+        struct result_t* r = &results[n_results++];
+        snprintf(r->name, sizeof(r->name), "%s", benches[b].name);
+        snprintf(r->mode, sizeof(r->mode), "%s", mode_names[mode]);
+        r->size = n;
+        r->ns_per_op = run(&benches[b], &s, n, budget, &px);
+        r->mpix_per_s = r->ns_per_op > 0. ? px * 1000. / r->ns_per_op : 0.;
+
+        printf("%-12s %6d %-7s %14.1f %10.1f", r->name, r->size, r->mode, r->ns_per_op, r->mpix_per_s);
+        for (int i = 0; i < n_base; ++i) {
+          if (strcmp(base[i].name, r->name) || strcmp(base[i].mode, r->mode) || base[i].size != r->size)
+            continue;
+          double change = (r->ns_per_op / base[i].ns_per_op - 1.) * 100.;
+          printf(" %+8.1f%%", change);
+          if (change > threshold) {
+            printf(" REGRESSION");
+            regressions++;
+          }
+          break;
+        }
+        printf("\n");
+        fflush(stdout);
+      }
+      surface_destroy(&s);
+    }
+  }
+
+  graphics_draw_mode(NORMAL);
+  surface_destroy(&src);
+  surface_destroy(&src_half);
+  remove(save_path);
+  remove(png_path);
+  for (int i = 0; i < 3; ++i)
+    remove(bmp_path[i]);
+  release();
+
+  if (json && !save_results(json, results, n_results))
+    return 2;
+  if (baseline)
+    printf("%d regression%s over %.1f%%\n", regressions, regressions == 1 ? "" : "s", threshold);
+  return regressions ? 1 : 0;
+}
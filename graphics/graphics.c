@@ -25,6 +25,10 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* 64-bit file offsets for fseeko/ftello on 32-bit systems */
+#if !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS 64
+#endif
 #include "graphics.h"
 
 #include <stdio.h>
@@ -34,6 +38,8 @@
 #include <math.h>
 #include <time.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stddef.h>
 #if defined(GRAPHICS_WINDOWS)
 #define NOMINMAX
 #define WIN32_LEAN_AND_MEAN
@@ -46,6 +52,30 @@
 #define strdup _strdup
 #endif
 
+#if !defined(GRAPHICS_NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GRAPHICS_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define GRAPHICS_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(GRAPHICS_EMCC) && !defined(__EMSCRIPTEN_PTHREADS__) && !defined(GRAPHICS_NO_THREADS)
+#define GRAPHICS_NO_THREADS
+#endif
+#if !defined(GRAPHICS_NO_THREADS) && !defined(GRAPHICS_WINDOWS)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#if defined(_MSC_VER)
+#define GRAPHICS_THREAD_LOCAL __declspec(thread)
+#else
+#define GRAPHICS_THREAD_LOCAL __thread
+#endif
+
 #define __MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define __MAX(a, b) (((a) > (b)) ? (a) : (b))
 #define __CLAMP(x, low, high) (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
@@ -56,6 +86,9 @@
 #define __D2R(a) ((a) * M_PI / 180.0)
 #define __R2D(a) ((a) * 180.0 / M_PI)
 
+#define __ROW(s, y) ((s)->buf + (y) * (s)->pitch)
+#define __PIXEL(s, x, y) (__ROW(s, y)[(x)])
+
 #define LINKEDLIST(NAME, TYPE) \
 struct NAME##_node_t { \
   TYPE *data; \
@@ -141,6 +174,9 @@ int rgba_a(int c, unsigned char a) {
 bool surface(struct surface_t* s, unsigned int w, unsigned int h) {
   s->w = w;
   s->h = h;
+  s->pitch = w;
+  s->parent = NULL;
+  s->damage = NULL;
   size_t sz = w * h * sizeof(unsigned int) + 1;
   s->buf = GRAPHICS_MALLOC(sz);
   if (!s->buf) {
@@ -153,130 +189,727 @@ bool surface(struct surface_t* s, unsigned int w, unsigned int h) {
 }
 
 void surface_destroy(struct surface_t* s) {
-  GRAPHICS_SAFE_FREE(s->buf);
+  if (!s->parent) {
+    GRAPHICS_SAFE_FREE(s->buf);
+    GRAPHICS_SAFE_FREE(s->damage);
+  }
   memset(s, 0, sizeof(struct surface_t));
 }
 
-static enum draw_mode draw_mode = NORMAL;
+bool subsurface(struct surface_t* a, int x, int y, int w, int h, struct surface_t* b) {
+  if (x < 0) {
+    w += x;
+    x  = 0;
+  }
+  if (y < 0) {
+    h += y;
+    y  = 0;
+  }
+  if (x + w > a->w)
+    w = a->w - x;
+  if (y + h > a->h)
+    h = a->h - y;
+  if (w <= 0 || h <= 0) {
+    GRAPHICS_ERROR(INVALID_PARAMETERS, "subsurface() failed: region is outside of surface");
+    return false;
+  }
+
+  b->buf = &__PIXEL(a, x, y);
+  b->w = w;
+  b->h = h;
+  b->pitch = a->pitch;
+  b->parent = a;
+  b->damage = NULL;
+  return true;
+}
 
-void graphics_draw_mode(enum draw_mode m) {
-  draw_mode = m;
+static inline struct surface_t* surface_root(struct surface_t* s) {
+  while (s->parent)
+    s = s->parent;
+  return s;
 }
 
-void fill(struct surface_t* s, int col) {
-  for (int i = 0; i < s->w * s->h; ++i)
-    s->buf[i] = col;
+/* Presenting an area costs about as much as this many extra pixels, so two
+ * areas are merged when their union adds fewer pixels than that */
+#if !defined(GRAPHICS_DAMAGE_SLACK)
+#define GRAPHICS_DAMAGE_SLACK 4096
+#endif
+
+static void damage_add(struct damage_t* d, long long x0, long long y0, long long x1, long long y1) {
+  /* The last rect is the one most recently added or merged into, which is
+   * where runs of small draws (e.g. pset) usually land */
+  if (d->count) {
+    struct rect_t* r = &d->rects[d->count - 1];
+    if (x0 >= r->x && y0 >= r->y && x1 <= (long long)r->x + r->w && y1 <= (long long)r->y + r->h)
+      return;
+  }
+  for (;;) {
+    int best = -1;
+    long long best_cost = 0, area = (x1 - x0) * (y1 - y0);
+    for (int i = 0; i < d->count; ++i) {
+      struct rect_t* r = &d->rects[i];
+      long long ux0 = __MIN(x0, r->x), uy0 = __MIN(y0, r->y);
+      long long ux1 = __MAX(x1, (long long)r->x + r->w), uy1 = __MAX(y1, (long long)r->y + r->h);
+      if (ux0 == r->x && uy0 == r->y && ux1 == (long long)r->x + r->w && uy1 == (long long)r->y + r->h)
+        return;
+      long long cost = (ux1 - ux0) * (uy1 - uy0) - area - (long long)r->w * r->h;
+      if (best == -1 || cost < best_cost) {
+        best = i;
+        best_cost = cost;
+      }
+    }
+    if (best == -1 || (best_cost > GRAPHICS_DAMAGE_SLACK && d->count < GRAPHICS_DAMAGE_RECTS)) {
+      struct rect_t* r = &d->rects[d->count++];
+      r->x = (int)x0;
+      r->y = (int)y0;
+      r->w = (int)(x1 - x0);
+      r->h = (int)(y1 - y0);
+      return;
+    }
+    /* Take the cheapest merge out of the list and add the union back, it may
+     * now be worth merging with others */
+    struct rect_t r = d->rects[best];
+    d->rects[best] = d->rects[--d->count];
+    x0 = __MIN(x0, r.x);
+    y0 = __MIN(y0, r.y);
+    x1 = __MAX(x1, (long long)r.x + r.w);
+    y1 = __MAX(y1, (long long)r.y + r.h);
+  }
 }
 
-static inline void flood_fn(struct surface_t* s, int x, int y, int new, int old) {
-  if (new == old || pget(s, x, y) != old)
+/* Record [x0, x1) x [y0, y1) of s as drawn to, the caller has already
+ * clipped it to s. Views record on the surface they borrow from */
+static inline void __damage(struct surface_t* s, int x0, int y0, int x1, int y1) {
+  struct surface_t* r = surface_root(s);
+  if (!r->damage || x0 >= x1 || y0 >= y1)
     return;
-  
-  int x1 = x;
-  while (x1 < s->w && pget(s, x1, y) == old) {
-    pset(s, x1, y, new);
-    x1++;
+  long long off = s->buf - r->buf, ox = off % r->pitch, oy = off / r->pitch;
+  damage_add(r->damage, ox + x0, oy + y0, ox + x1, oy + y1);
+}
+
+bool surface_damage_track(struct surface_t* s, bool enable) {
+  s = surface_root(s);
+  if (!enable) {
+    GRAPHICS_SAFE_FREE(s->damage);
+    return true;
   }
-  
-  x1 = x - 1;
-  while (x1 >= 0 && pget(s, x1, y) == old) {
-    pset(s, x1, y, new);
-    x1--;
+  if (!s->damage && !(s->damage = GRAPHICS_MALLOC(sizeof(struct damage_t)))) {
+    GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+    return false;
   }
-  
-  x1 = x;
-  while (x1 < s->w && pget(s, x1, y) == new) {
-    if(y > 0 && pget(s, x1, y - 1) == old)
-      flood_fn(s, x1, y - 1, new, old);
-    x1++;
+  s->damage->count = 0;
+  damage_add(s->damage, 0, 0, s->w, s->h);
+  return true;
+}
+
+void surface_damage(struct surface_t* s, int x, int y, int w, int h) {
+  __damage(s, __MAX(x, 0), __MAX(y, 0), (int)__MIN((long long)x + w, s->w), (int)__MIN((long long)y + h, s->h));
+}
+
+void surface_damage_clear(struct surface_t* s) {
+  s = surface_root(s);
+  if (s->damage)
+    s->damage->count = 0;
+}
+
+/* Every thread draws with its own context unless another one is bound */
+static GRAPHICS_THREAD_LOCAL struct graphics_ctx_t thread_ctx;
+static GRAPHICS_THREAD_LOCAL struct graphics_ctx_t* bound_ctx = NULL;
+
+static inline struct graphics_ctx_t* __ctx(void) {
+  return bound_ctx ? bound_ctx : &thread_ctx;
+}
+
+void graphics_ctx(struct graphics_ctx_t* c) {
+  memset(c, 0, sizeof(struct graphics_ctx_t));
+  c->mode = NORMAL;
+}
+
+struct graphics_ctx_t* graphics_ctx_bind(struct graphics_ctx_t* c) {
+  struct graphics_ctx_t* prev = bound_ctx;
+  bound_ctx = c;
+  return prev;
+}
+
+struct graphics_ctx_t* graphics_ctx_current(void) {
+  return __ctx();
+}
+
+void graphics_draw_mode(enum draw_mode m) {
+  __ctx()->mode = m;
+}
+
+/* Narrow a context's clip rect to where it overlaps x, y, w, h */
+static inline void __clip_intersect(struct graphics_ctx_t* c, int x, int y, int w, int h) {
+  long long x0 = x, y0 = y, x1 = x0 + __MAX(w, 0), y1 = y0 + __MAX(h, 0);
+  if (c->clipping) {
+    x0 = __MAX(x0, c->clip.x);
+    y0 = __MAX(y0, c->clip.y);
+    x1 = __MIN(x1, (long long)c->clip.x + c->clip.w);
+    y1 = __MIN(y1, (long long)c->clip.y + c->clip.h);
   }
-  
-  x1 = x - 1;
-  while(x1 >= 0 && pget(s, x1, y) == new) {
-    if(y > 0 && pget(s, x1, y - 1) == old)
-      flood_fn(s, x1, y - 1, new, old);
-    x1--;
+  c->clip.x = (int)x0;
+  c->clip.y = (int)y0;
+  c->clip.w = (int)__MAX(x1 - x0, 0);
+  c->clip.h = (int)__MAX(y1 - y0, 0);
+  c->clipping = true;
+}
+
+bool graphics_clip_push(int x, int y, int w, int h) {
+  struct graphics_ctx_t* c = __ctx();
+  if (c->clip_depth >= GRAPHICS_CLIP_STACK_SIZE) {
+    GRAPHICS_ERROR(INVALID_PARAMETERS, "graphics_clip_push() failed: clip stack is full");
+    return false;
   }
-  
-  x1 = x;
-  while(x1 < s->w && pget(s, x1, y) == new) {
-    if(y < s->h - 1 && pget(s, x1, y + 1) == old)
-      flood_fn(s, x1, y + 1, new, old);
-    x1++;
+  c->clip_stack[c->clip_depth].clip = c->clip;
+  c->clip_stack[c->clip_depth].clipping = c->clipping;
+  c->clip_depth++;
+  __clip_intersect(c, x, y, w, h);
+  return true;
+}
+
+bool graphics_clip_pop(void) {
+  struct graphics_ctx_t* c = __ctx();
+  if (!c->clip_depth) {
+    GRAPHICS_ERROR(INVALID_PARAMETERS, "graphics_clip_pop() failed: clip stack is empty");
+    return false;
   }
-  
-  x1 = x - 1;
-  while(x1 >= 0 && pget(s, x1, y) == new) {
-    if(y < s->h - 1 && pget(s, x1, y + 1) == old)
-      flood_fn(s, x1, y + 1, new, old);
-    x1--;
+  c->clip_depth--;
+  c->clip = c->clip_stack[c->clip_depth].clip;
+  c->clipping = c->clip_stack[c->clip_depth].clipping;
+  return true;
+}
+
+/* Area of s that can be drawn to, [x0, x1) x [y0, y1), false when empty */
+static inline bool __clip_rect(struct surface_t* s, int* x0, int* y0, int* x1, int* y1) {
+  struct graphics_ctx_t* c = __ctx();
+  *x0 = 0;
+  *y0 = 0;
+  *x1 = s->w;
+  *y1 = s->h;
+  if (c->clipping) {
+    *x0 = __MAX(*x0, c->clip.x);
+    *y0 = __MAX(*y0, c->clip.y);
+    *x1 = __MIN(*x1, c->clip.x + c->clip.w);
+    *y1 = __MIN(*y1, c->clip.y + c->clip.h);
   }
+  return *x0 < *x1 && *y0 < *y1;
 }
 
-void flood(struct surface_t* s, int x, int y, int col) {
-  if (x < 0 || y < 0 || x >= s->w || y >= s->h)
+/* Run a call with c bound to the calling thread */
+#define GRAPHICS_WITH_CTX(c, call) \
+  do { \
+    struct graphics_ctx_t* __prev = graphics_ctx_bind(c); \
+    call; \
+    graphics_ctx_bind(__prev); \
+  } while (0)
+
+/* ALPHA draw mode blends source c (alpha a) over destination p (alpha b).
+ * The reference is the integer formula pset() used originally, each
+ * division truncating:
+ *
+ *   channel = c * a / 255 + p * b * (255 - a) / 65025
+ *   alpha   = a + b * (255 - a) / 255
+ *
+ * The divisions are replaced by __DIV255, which is exact (floor) for any
+ * x in [0, 65025], i.e. any product of two channels. The destination weight
+ * k = b * (255 - a) / 255 is rounded down before it is applied, so a channel
+ * can come out at most 1 below the reference, never above it, and alpha
+ * matches it exactly. (The original alpha divided by 256 instead.)
+ * tests/blend.c checks this for every combination of c, p, a and b, and
+ * that the SIMD kernels match __blend bit for bit. Fully opaque sources and
+ * fully transparent destinations return the source unchanged.
+ *
+ * Red and blue are blended together in one 32-bit word, green and alpha in
+ * another; neither lane can carry into the next because a product of two
+ * channels is at most 65025. */
+#define __DIV255(x) (((x) + 1 + ((x) >> 8)) >> 8)
+#define __DIV255_2X(x) ((((x) + 0x00010001 + (((x) >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF)
+
+static inline int __blend(int p, int c) {
+  unsigned int a = (unsigned int)c >> 24;
+  unsigned int b = (unsigned int)p >> 24;
+  if (a == 255 || !b)
+    return c;
+  unsigned int k = __DIV255(b * (255 - a));
+  unsigned int rb = __DIV255_2X((c & 0x00FF00FF) * a) + __DIV255_2X((p & 0x00FF00FF) * k);
+  unsigned int g = __DIV255_2X(((c >> 8) & 0xFF) * a) + __DIV255_2X(((p >> 8) & 0xFF) * k);
+  return (int)(((a + k) << 24) | (g << 8) | rb);
+}
+
+#if defined(GRAPHICS_SSE2)
+static inline __m128i __div255_epu16(__m128i x) {
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)), 8);
+}
+
+/* Two pixels unpacked to 16-bit channels, see __blend */
+static inline __m128i __blend2_epu16(__m128i p, __m128i c) {
+  const __m128i alpha = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+  __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+  __m128i b = _mm_shufflehi_epi16(_mm_shufflelo_epi16(p, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+  __m128i k = __div255_epu16(_mm_mullo_epi16(b, _mm_sub_epi16(_mm_set1_epi16(255), a)));
+  __m128i r = _mm_add_epi16(__div255_epu16(_mm_mullo_epi16(c, a)), __div255_epu16(_mm_mullo_epi16(p, k)));
+  return _mm_or_si128(_mm_andnot_si128(alpha, r), _mm_and_si128(alpha, _mm_add_epi16(a, k)));
+}
+
+static inline __m128i __blend4(__m128i p, __m128i c) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i lo = __blend2_epu16(_mm_unpacklo_epi8(p, zero), _mm_unpacklo_epi8(c, zero));
+  __m128i hi = __blend2_epu16(_mm_unpackhi_epi8(p, zero), _mm_unpackhi_epi8(c, zero));
+  __m128i r = _mm_packus_epi16(lo, hi);
+  __m128i m = _mm_or_si128(_mm_cmpeq_epi32(_mm_srli_epi32(c, 24), _mm_set1_epi32(255)),
+                           _mm_cmpeq_epi32(_mm_srli_epi32(p, 24), zero));
+  return _mm_or_si128(_mm_and_si128(m, c), _mm_andnot_si128(m, r));
+}
+#endif
+
+#if defined(GRAPHICS_AVX2)
+static inline __m256i __div255_epu16_x8(__m256i x) {
+  return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(x, _mm256_set1_epi16(1)), _mm256_srli_epi16(x, 8)), 8);
+}
+
+static inline __m256i __blend4_epu16(__m256i p, __m256i c) {
+  const __m256i alpha = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0);
+  __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+  __m256i b = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(p, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+  __m256i k = __div255_epu16_x8(_mm256_mullo_epi16(b, _mm256_sub_epi16(_mm256_set1_epi16(255), a)));
+  __m256i r = _mm256_add_epi16(__div255_epu16_x8(_mm256_mullo_epi16(c, a)), __div255_epu16_x8(_mm256_mullo_epi16(p, k)));
+  return _mm256_blendv_epi8(r, _mm256_add_epi16(a, k), alpha);
+}
+
+static inline __m256i __blend8(__m256i p, __m256i c) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i lo = __blend4_epu16(_mm256_unpacklo_epi8(p, zero), _mm256_unpacklo_epi8(c, zero));
+  __m256i hi = __blend4_epu16(_mm256_unpackhi_epi8(p, zero), _mm256_unpackhi_epi8(c, zero));
+  __m256i r = _mm256_packus_epi16(lo, hi);
+  __m256i m = _mm256_or_si256(_mm256_cmpeq_epi32(_mm256_srli_epi32(c, 24), _mm256_set1_epi32(255)),
+                              _mm256_cmpeq_epi32(_mm256_srli_epi32(p, 24), zero));
+  return _mm256_blendv_epi8(r, c, m);
+}
+#endif
+
+static inline void __span_blend(int* dst, int n, int col) {
+  int i = 0;
+#if defined(GRAPHICS_AVX2)
+  __m256i c8 = _mm256_set1_epi32(col);
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_si256((__m256i*)(dst + i), __blend8(_mm256_loadu_si256((const __m256i*)(dst + i)), c8));
+#endif
+#if defined(GRAPHICS_SSE2)
+  __m128i c4 = _mm_set1_epi32(col);
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_si128((__m128i*)(dst + i), __blend4(_mm_loadu_si128((const __m128i*)(dst + i)), c4));
+#endif
+  for (; i < n; ++i)
+    dst[i] = __blend(dst[i], col);
+}
+
+static inline void __span_fill(int* dst, int n, int col) {
+#if defined(GRAPHICS_AVX2)
+  __m256i v8 = _mm256_set1_epi32(col);
+  for (; n >= 16; n -= 16, dst += 16) {
+    _mm256_storeu_si256((__m256i*)dst, v8);
+    _mm256_storeu_si256((__m256i*)(dst + 8), v8);
+  }
+#endif
+#if defined(GRAPHICS_SSE2)
+  __m128i v4 = _mm_set1_epi32(col);
+  for (; n >= 4; n -= 4, dst += 4)
+    _mm_storeu_si128((__m128i*)dst, v4);
+#endif
+  while (n-- > 0)
+    *dst++ = col;
+}
+
+/* Write n pixels starting at x, y. Caller is responsible for clipping */
+static inline void __span(struct surface_t* s, int x, int y, int n, int col) {
+  int* p = &__PIXEL(s, x, y);
+  switch (__ctx()->mode) {
+    case MASK:
+      if (a_channel(col) < 255)
+        return;
+    default:
+    case NORMAL:
+      __span_fill(p, n, col);
+      break;
+    case ALPHA:
+      if (a_channel(col) == 255)
+        __span_fill(p, n, col);
+      else
+        __span_blend(p, n, col);
+      break;
+  }
+}
+
+/* Vertical version of __span, n pixels from x, y downwards */
+static inline void __vspan(struct surface_t* s, int x, int y, int n, int col) {
+  int* p = &__PIXEL(s, x, y);
+  switch (__ctx()->mode) {
+    case MASK:
+      if (a_channel(col) < 255)
+        return;
+    default:
+    case NORMAL:
+      for (int i = 0; i < n; ++i, p += s->pitch)
+        *p = col;
+      break;
+    case ALPHA:
+      for (int i = 0; i < n; ++i, p += s->pitch)
+        *p = __blend(*p, col);
+      break;
+  }
+}
+
+void fill(struct surface_t* s, int col) {
+  __damage(s, 0, 0, s->w, s->h);
+  if (s->pitch == s->w) {
+    __span_fill(s->buf, s->w * s->h, col);
     return;
-  flood_fn(s, x, y, col, pget(s, x, y));
+  }
+  for (int y = 0; y < s->h; ++y)
+    __span_fill(__ROW(s, y), s->w, col);
 }
 
-void cls(struct surface_t* s) {
-  memset(s->buf, 0, s->w * s->h * sizeof(int));
+struct flood_seg_t {
+  int y, xl, xr, dy;
+};
+
+struct flood_t {
+  struct surface_t* s;
+  int old, new, tolerance;
+  unsigned char* visited;
+  struct flood_seg_t* stack;
+  int sp, capacity;
+  int x0, y0, x1, y1;
+};
+
+static inline bool flood_near(int a, int b, int tolerance) {
+  return abs(r_channel(a) - r_channel(b)) <= tolerance &&
+         abs(g_channel(a) - g_channel(b)) <= tolerance &&
+         abs(b_channel(a) - b_channel(b)) <= tolerance &&
+         abs(a_channel(a) - a_channel(b)) <= tolerance;
 }
 
-#define BLEND(c0, c1, a0, a1) (c0 * a0 / 255) + (c1 * a1 * (255 - a0) / 65025)
+static inline bool flood_match(struct flood_t* f, int x, int y) {
+  int c = __PIXEL(f->s, x, y);
+  if (f->visited) {
+    size_t i = (size_t)y * f->s->w + x;
+    if (f->visited[i >> 3] & (1 << (i & 7)))
+      return false;
+  }
+  return f->tolerance ? flood_near(c, f->old, f->tolerance) : c == f->old;
+}
 
-void pset(struct surface_t* s, int x, int y, int c) {
+/* Fill [xl, xr] on row y and grow the bounding box */
+static inline void flood_run(struct flood_t* f, int y, int xl, int xr) {
+  if (xl > xr)
+    return;
+  __span_fill(&__PIXEL(f->s, xl, y), xr - xl + 1, f->new);
+  if (f->visited)
+    for (size_t i = (size_t)y * f->s->w + xl, j = i + (xr - xl); i <= j; ++i)
+      f->visited[i >> 3] |= 1 << (i & 7);
+  f->x0 = __MIN(f->x0, xl);
+  f->x1 = __MAX(f->x1, xr);
+  f->y0 = __MIN(f->y0, y);
+  f->y1 = __MAX(f->y1, y);
+}
+
+/* Queue row y + dy for scanning, [xl, xr] being a filled run on row y */
+static inline bool flood_push(struct flood_t* f, int y, int xl, int xr, int dy) {
+  if (y + dy < 0 || y + dy >= f->s->h)
+    return true;
+  if (f->sp == f->capacity) {
+    int capacity = f->capacity ? f->capacity * 2 : 64;
+    struct flood_seg_t* tmp = GRAPHICS_REALLOC(f->stack, capacity * sizeof(struct flood_seg_t));
+    if (!tmp) {
+      GRAPHICS_ERROR(OUT_OF_MEMEORY, "realloc() failed");
+      return false;
+    }
+    f->stack = tmp;
+    f->capacity = capacity;
+  }
+  struct flood_seg_t* seg = &f->stack[f->sp++];
+  seg->y = y;
+  seg->xl = xl;
+  seg->xr = xr;
+  seg->dy = dy;
+  return true;
+}
+
+/* Span seed fill, see Paul Heckbert, "A Seed Fill Algorithm", Graphics Gems (1990).
+ * The stack only holds the frontier of runs still to be scanned, not the fill history */
+static bool flood_fn(struct flood_t* f, int x, int y) {
+  int x1, x2, dy, l;
+  bool skip;
+  if (!flood_push(f, y, x, x, 1) || !flood_push(f, y + 1, x, x, -1))
+    return false;
+  while (f->sp) {
+    struct flood_seg_t* seg = &f->stack[--f->sp];
+    dy = seg->dy;
+    y  = seg->y + dy;
+    x1 = seg->xl;
+    x2 = seg->xr;
+
+    for (x = x1; x >= 0 && flood_match(f, x, y); --x);
+    skip = x >= x1;
+    if (!skip) {
+      flood_run(f, y, x + 1, x1);
+      l = x + 1;
+      if (l < x1 && !flood_push(f, y, l, x1 - 1, -dy))
+        return false;
+      x = x1 + 1;
+    }
+
+    do {
+      if (!skip) {
+        int start = x;
+        for (; x < f->s->w && flood_match(f, x, y); ++x);
+        flood_run(f, y, start, x - 1);
+        if (!flood_push(f, y, l, x - 1, dy))
+          return false;
+        if (x > x2 + 1 && !flood_push(f, y, x2 + 1, x - 1, -dy))
+          return false;
+      }
+      skip = false;
+      for (++x; x <= x2 && !flood_match(f, x, y); ++x);
+      l = x;
+    } while (x <= x2);
+  }
+  return true;
+}
+
+bool flood_ex(struct surface_t* s, int x, int y, int col, int tolerance, struct rect_t* bounds) {
+  if (bounds)
+    memset(bounds, 0, sizeof(struct rect_t));
   if (x < 0 || y < 0 || x >= s->w || y >= s->h)
+    return false;
+
+  int cx0, cy0, cx1, cy1;
+  if (!__clip_rect(s, &cx0, &cy0, &cx1, &cy1) || x < cx0 || y < cy0 || x >= cx1 || y >= cy1)
+    return true;
+  if (cx0 > 0 || cy0 > 0 || cx1 < s->w || cy1 < s->h) {
+    /* Fill a view of the clip rect so the fill can't leak out of it */
+    struct surface_t view;
+    struct graphics_ctx_t* c = __ctx();
+    bool clipping = c->clipping, ret;
+    c->clipping = false;
+    ret = subsurface(s, cx0, cy0, cx1 - cx0, cy1 - cy0, &view) && flood_ex(&view, x - cx0, y - cy0, col, tolerance, bounds);
+    c->clipping = clipping;
+    if (bounds && bounds->w) {
+      bounds->x += cx0;
+      bounds->y += cy0;
+    }
+    return ret;
+  }
+
+  struct flood_t f;
+  memset(&f, 0, sizeof(struct flood_t));
+  f.s = s;
+  f.old = __PIXEL(s, x, y);
+  f.new = col;
+  f.tolerance = __CLAMP(tolerance, 0, 255);
+  f.x0 = s->w;
+  f.y0 = s->h;
+  f.x1 = f.y1 = -1;
+  if (col == f.old)
+    return true;
+  if (f.tolerance && flood_near(col, f.old, f.tolerance)) {
+    /* Filled pixels would still match, so they have to be tracked separately */
+    size_t sz = ((size_t)s->w * s->h + 7) / 8;
+    if (!(f.visited = GRAPHICS_MALLOC(sz))) {
+      GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+      return false;
+    }
+    memset(f.visited, 0, sz);
+  }
+
+  bool ret = flood_fn(&f, x, y);
+  GRAPHICS_SAFE_FREE(f.stack);
+  GRAPHICS_SAFE_FREE(f.visited);
+  if (f.x1 >= f.x0)
+    __damage(s, f.x0, f.y0, f.x1 + 1, f.y1 + 1);
+  if (bounds && f.x1 >= f.x0) {
+    bounds->x = f.x0;
+    bounds->y = f.y0;
+    bounds->w = f.x1 - f.x0 + 1;
+    bounds->h = f.y1 - f.y0 + 1;
+  }
+  return ret;
+}
+
+void flood(struct surface_t* s, int x, int y, int col) {
+  flood_ex(s, x, y, col, 0, NULL);
+}
+
+void cls(struct surface_t* s) {
+  __damage(s, 0, 0, s->w, s->h);
+  if (s->pitch == s->w) {
+    memset(s->buf, 0, s->w * s->h * sizeof(int));
     return;
-  switch (draw_mode) {
+  }
+  for (int y = 0; y < s->h; ++y)
+    memset(__ROW(s, y), 0, s->w * sizeof(int));
+}
+
+/* Write one pixel in the given draw mode, no clipping or damage */
+static inline void __pset(struct surface_t* s, int x, int y, int c, enum draw_mode mode) {
+  switch (mode) {
     case MASK:
       if (a_channel(c) < 255)
         return;
     default:
     case NORMAL:
-      s->buf[y * s->w + x] = c;
+      __PIXEL(s, x, y) = c;
       break;
     case ALPHA: {
-      int  a = a_channel(c);
-      int* p = &s->buf[y * s->w + x];
-      int  b = a_channel(*p);
-      *p = (a == 255 || !b) ? c : rgba(BLEND(r_channel(c), r_channel(*p), a, b),
-                                       BLEND(g_channel(c), g_channel(*p), a, b),
-                                       BLEND(b_channel(c), b_channel(*p), a, b),
-                                       a + (b * (255 - a) >> 8));
+      int* p = &__PIXEL(s, x, y);
+      *p = __blend(*p, c);
       break;
     }
   }
 }
 
+void pset(struct surface_t* s, int x, int y, int c) {
+  if (x < 0 || y < 0 || x >= s->w || y >= s->h)
+    return;
+  struct graphics_ctx_t* ctx = __ctx();
+  if (ctx->clipping && (x < ctx->clip.x || y < ctx->clip.y || x >= ctx->clip.x + ctx->clip.w || y >= ctx->clip.y + ctx->clip.h))
+    return;
+  __damage(s, x, y, x + 1, y + 1);
+  __pset(s, x, y, c, ctx->mode);
+}
+
 int pget(struct surface_t* s, int x, int y) {
-  return (x >= 0 && y >= 0 && x < s->w && y < s->h) ? s->buf[y * s->w + x] : 0;
+  return (x >= 0 && y >= 0 && x < s->w && y < s->h) ? __PIXEL(s, x, y) : 0;
+}
+
+static inline void __row_mask(int* dst, const int* src, int n) {
+  int i = 0;
+#if defined(GRAPHICS_AVX2)
+  const __m256i opaque8 = _mm256_set1_epi32(0xFF);
+  for (; i + 8 <= n; i += 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+    __m256i m = _mm256_cmpeq_epi32(_mm256_srli_epi32(s, 24), opaque8);
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_blendv_epi8(d, s, m));
+  }
+#endif
+#if defined(GRAPHICS_SSE2)
+  const __m128i opaque4 = _mm_set1_epi32(0xFF);
+  for (; i + 4 <= n; i += 4) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+    __m128i m = _mm_cmpeq_epi32(_mm_srli_epi32(s, 24), opaque4);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_and_si128(m, s), _mm_andnot_si128(m, d)));
+  }
+#endif
+  for (; i < n; ++i)
+    if (a_channel(src[i]) == 255)
+      dst[i] = src[i];
 }
 
-bool paste(struct surface_t* dst, struct surface_t* src, int x, int y) {
-  int ox, oy, c;
-  for (ox = 0; ox < src->w; ++ox) {
-    for (oy = 0; oy < src->h; ++oy) {
-      if (oy > dst->h)
-        break;
-      c = pget(src, ox, oy);
-      pset(dst, x + ox, y + oy, c);
-    }
-    if (ox > dst->w)
+static inline void __row_blend(int* dst, const int* src, int n) {
+  int i = 0;
+#if defined(GRAPHICS_AVX2)
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_si256((__m256i*)(dst + i), __blend8(_mm256_loadu_si256((const __m256i*)(dst + i)), _mm256_loadu_si256((const __m256i*)(src + i))));
+#endif
+#if defined(GRAPHICS_SSE2)
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_si128((__m128i*)(dst + i), __blend4(_mm_loadu_si128((const __m128i*)(dst + i)), _mm_loadu_si128((const __m128i*)(src + i))));
+#endif
+  for (; i < n; ++i)
+    dst[i] = __blend(dst[i], src[i]);
+}
+
+static inline void __row(int* dst, const int* src, int n) {
+  switch (__ctx()->mode) {
+    case MASK:
+      __row_mask(dst, src, n);
+      break;
+    default:
+    case NORMAL:
+      memmove(dst, src, n * sizeof(int));
+      break;
+    case ALPHA:
+      __row_blend(dst, src, n);
       break;
   }
+}
+
+/* Copy the w x h block at sx, sy in src to dx, dy in dst, clipped against
+ * the source and the drawable area of the destination */
+static void __blit(struct surface_t* dst, struct surface_t* src, int dx, int dy, int sx, int sy, int w, int h) {
+  int cx0, cy0, cx1, cy1;
+  if (!__clip_rect(dst, &cx0, &cy0, &cx1, &cy1))
+    return;
+  if (sx < 0) {
+    w  += sx;
+    dx -= sx;
+    sx  = 0;
+  }
+  if (sy < 0) {
+    h  += sy;
+    dy -= sy;
+    sy  = 0;
+  }
+  if (sx + w > src->w)
+    w = src->w - sx;
+  if (sy + h > src->h)
+    h = src->h - sy;
+  if (dx < cx0) {
+    w  -= cx0 - dx;
+    sx += cx0 - dx;
+    dx  = cx0;
+  }
+  if (dy < cy0) {
+    h  -= cy0 - dy;
+    sy += cy0 - dy;
+    dy  = cy0;
+  }
+  if (dx + w > cx1)
+    w = cx1 - dx;
+  if (dy + h > cy1)
+    h = cy1 - dy;
+  if (w <= 0 || h <= 0)
+    return;
+  __damage(dst, dx, dy, dx + w, dy + h);
+
+  int *d = &__PIXEL(dst, dx, dy), *p = &__PIXEL(src, sx, sy), y;
+  bool overlap = d <= &__PIXEL(src, sx + w - 1, sy + h - 1) && p <= &__PIXEL(dst, dx + w - 1, dy + h - 1);
+  if (overlap && __ctx()->mode != NORMAL) {
+    /* Only blitting a surface onto itself gets here, so take a copy first */
+    struct surface_t tmp, view;
+    if (!subsurface(src, sx, sy, w, h, &view) || !copy(&view, &tmp))
+      return;
+    __blit(dst, &tmp, dx, dy, 0, 0, w, h);
+    surface_destroy(&tmp);
+    return;
+  }
+
+  if (overlap && d > p) {
+    for (y = h - 1; y >= 0; --y)
+      __row(d + y * dst->pitch, p + y * src->pitch, w);
+  } else {
+    for (y = 0; y < h; ++y, d += dst->pitch, p += src->pitch)
+      __row(d, p, w);
+  }
+}
+
+bool paste(struct surface_t* dst, struct surface_t* src, int x, int y) {
+  __blit(dst, src, x, y, 0, 0, src->w, src->h);
   return true;
 }
 
 bool clip_paste(struct surface_t* dst, struct surface_t* src, int x, int y, int rx, int ry, int rw, int rh) {
-  for (int ox = 0; ox < rw; ++ox)
-    for (int oy = 0; oy < rh; ++oy)
-      pset(dst, ox + x, oy + y, pget(src, ox + rx, oy + ry));
+  __blit(dst, src, x, y, rx, ry, rw, rh);
   return true;
 }
 
 bool reset(struct surface_t* s, int nw, int nh) {
-    size_t sz = nw * nh * sizeof(unsigned int) + 1;
+  if (s->parent)
+    return surface(s, nw, nh);
+  size_t sz = nw * nh * sizeof(unsigned int) + 1;
   int* tmp = GRAPHICS_REALLOC(s->buf, sz);
   if (!tmp) {
     GRAPHICS_ERROR(OUT_OF_MEMEORY, "realloc() failed");
@@ -285,38 +918,171 @@ bool reset(struct surface_t* s, int nw, int nh) {
   s->buf = tmp;
   s->w = nw;
   s->h = nh;
+  s->pitch = nw;
   memset(s->buf, 0, sz);
+  if (s->damage) {
+    s->damage->count = 0;
+    __damage(s, 0, 0, nw, nh);
+  }
   return true;
 }
 
 bool copy(struct surface_t* a, struct surface_t* b) {
   if (!surface(b, a->w, a->h))
     return false;
-  memcpy(b->buf, a->buf, a->w * a->h * sizeof(unsigned int) + 1);
+  for (int y = 0; y < a->h; ++y)
+    memcpy(__ROW(b, y), __ROW(a, y), a->w * sizeof(unsigned int));
   return !!b->buf;
 }
 
 void passthru(struct surface_t* s, int (*fn)(int x, int y, int col)) {
-  int x, y;
+  int x, y, cx0, cy0, cx1, cy1;
+  bool visible = __clip_rect(s, &cx0, &cy0, &cx1, &cy1);
+  enum draw_mode mode = __ctx()->mode;
+  if (visible)
+    __damage(s, cx0, cy0, cx1, cy1);
+  /* fn still sees every pixel, only the clip rect is written */
   for (x = 0; x < s->w; ++x)
-    for (y = 0; y < s->h; ++y)
-      pset(s, x, y, fn(x, y, pget(s, x, y)));
+    for (y = 0; y < s->h; ++y) {
+      int c = fn(x, y, __PIXEL(s, x, y));
+      if (visible && x >= cx0 && y >= cy0 && x < cx1 && y < cy1)
+        __pset(s, x, y, c, mode);
+    }
+}
+
+/* Nearest neighbour, sampling the source pixel under the centre of each
+ * destination pixel. Only [x0, x1) x [y0, y1) of b is written */
+static void __resize_area(struct surface_t* a, struct surface_t* b, int x0, int y0, int x1, int y1) {
+  long long x_ratio = ((long long)a->w << 16) / b->w;
+  long long y_ratio = ((long long)a->h << 16) / b->h;
+  int i, j;
+  for (i = y0; i < y1; ++i) {
+    int* t = __ROW(b, i) + x0;
+    int* p = __ROW(a, (int)((i * y_ratio + (y_ratio >> 1)) >> 16));
+    long long rat = x0 * x_ratio + (x_ratio >> 1);
+    for (j = x0; j < x1; ++j, rat += x_ratio)
+      *t++ = p[rat >> 16];
+  }
 }
 
 static void __resize(struct surface_t* a, struct surface_t* b) {
-  int x_ratio = (int)((a->w << 16) / b->w) + 1;
-  int y_ratio = (int)((a->h << 16) / b->h) + 1;
-  int x2, y2, i, j;
-  for (i = 0; i < b->h; ++i) {
-    int* t = b->buf + i * b->w;
-    y2 = ((i * y_ratio) >> 16);
-    int* p = a->buf + y2 * a->w;
-    int rat = 0;
-    for (j = 0; j < b->w; ++j) {
-      x2 = (rat >> 16);
-      *t++ = p[x2];
-      rat += x_ratio;
+  __resize_area(a, b, 0, 0, b->w, b->h);
+}
+
+/* Nearest neighbour scaling of frames into a window. The source column and
+ * row of every window pixel are kept for the last size pair, frames that
+ * don't fill the window are centred between black bars */
+struct scaler_t {
+  int sw, sh, dw, dh, mode;
+  /* Window area the frame covers */
+  struct rect_t dst;
+  int *xlut, *ylut, xcap, ycap;
+};
+
+/* Sets moved when the frame moved in the window, so it has to be redrawn whole */
+static bool scaler_update(struct scaler_t* sc, int sw, int sh, int dw, int dh, int mode, bool* moved) {
+  *moved = false;
+  if (sc->xlut && sc->sw == sw && sc->sh == sh && sc->dw == dw && sc->dh == dh && sc->mode == mode)
+    return true;
+  struct rect_t r = { 0, 0, dw, dh };
+  int k = __MIN(dw / sw, dh / sh);
+  if (mode == PRESENT_INTEGER && k >= 1) {
+    r.w = k * sw;
+    r.h = k * sh;
+  } else if (mode != PRESENT_STRETCH) {
+    if ((long long)dw * sh <= (long long)dh * sw)
+      r.h = (int)__MAX(((long long)dw * sh + sw / 2) / sw, 1);
+    else
+      r.w = (int)__MAX(((long long)dh * sw + sh / 2) / sh, 1);
+  }
+  r.x = (dw - r.w) / 2;
+  r.y = (dh - r.h) / 2;
+  if (r.w > sc->xcap) {
+    int* tmp = GRAPHICS_REALLOC(sc->xlut, r.w * sizeof(int));
+    if (!tmp) {
+      GRAPHICS_ERROR(OUT_OF_MEMEORY, "realloc() failed");
+      return false;
+    }
+    sc->xlut = tmp;
+    sc->xcap = r.w;
+  }
+  if (r.h > sc->ycap) {
+    int* tmp = GRAPHICS_REALLOC(sc->ylut, r.h * sizeof(int));
+    if (!tmp) {
+      GRAPHICS_ERROR(OUT_OF_MEMEORY, "realloc() failed");
+      return false;
     }
+    sc->ylut = tmp;
+    sc->ycap = r.h;
+  }
+  /* Same sampling as __resize */
+  long long x_ratio = ((long long)sw << 16) / r.w, y_ratio = ((long long)sh << 16) / r.h;
+  for (int i = 0; i < r.w; ++i)
+    sc->xlut[i] = (int)((i * x_ratio + (x_ratio >> 1)) >> 16);
+  for (int i = 0; i < r.h; ++i)
+    sc->ylut[i] = (int)((i * y_ratio + (y_ratio >> 1)) >> 16);
+  sc->sw = sw;
+  sc->sh = sh;
+  sc->dw = dw;
+  sc->dh = dh;
+  sc->mode = mode;
+  sc->dst = r;
+  *moved = true;
+  return true;
+}
+
+static void scaler_destroy(struct scaler_t* sc) {
+  GRAPHICS_SAFE_FREE(sc->xlut);
+  GRAPHICS_SAFE_FREE(sc->ylut);
+  memset(sc, 0, sizeof(struct scaler_t));
+}
+
+/* Clear the parts of the window the frame doesn't cover */
+static void scaler_bars(struct scaler_t* sc, struct surface_t* b) {
+  struct rect_t* r = &sc->dst;
+  for (int y = 0; y < b->h; ++y) {
+    if (y < r->y || y >= r->y + r->h)
+      memset(__ROW(b, y), 0, b->w * sizeof(int));
+    else if (r->w < b->w) {
+      memset(__ROW(b, y), 0, r->x * sizeof(int));
+      memset(__ROW(b, y) + r->x + r->w, 0, (b->w - r->x - r->w) * sizeof(int));
+    }
+  }
+}
+
+/* Scale the part of a into [x0, x1) x [y0, y1) of the window b. Window rows
+ * sampling the same row as the one above are copied from it, and when the
+ * frame is a whole multiple of the source width each pixel is repeated */
+static void scaler_run(struct scaler_t* sc, struct surface_t* a, struct surface_t* b, int x0, int y0, int x1, int y1) {
+  struct rect_t* r = &sc->dst;
+  x0 = __MAX(x0, r->x);
+  y0 = __MAX(y0, r->y);
+  x1 = __MIN(x1, r->x + r->w);
+  y1 = __MIN(y1, r->y + r->h);
+  if (x0 >= x1 || y0 >= y1)
+    return;
+  int k = r->w % a->w ? 0 : r->w / a->w, n = x1 - x0;
+  for (int y = y0; y < y1; ++y) {
+    int sy = sc->ylut[y - r->y], *d = __ROW(b, y) + x0;
+    if (y > y0 && sc->ylut[y - r->y - 1] == sy) {
+      memcpy(d, d - b->pitch, n * sizeof(int));
+      continue;
+    }
+    const int* p = __ROW(a, sy);
+    int j = x0 - r->x, end = x1 - r->x;
+    if (k == 1)
+      memcpy(d, p + j, n * sizeof(int));
+    else if (k) {
+      const int* q = p + j / k;
+      for (int run = k - j % k; j < end; run = k) {
+        int v = *q++, m = __MIN(run, end - j);
+        j += m;
+        while (m--)
+          *d++ = v;
+      }
+    } else
+      for (; j < end; ++j)
+        *d++ = p[sc->xlut[j]];
   }
 }
 
@@ -327,57 +1093,600 @@ bool resize(struct surface_t* a, int nw, int nh, struct surface_t* b) {
   return true;
 }
 
-bool rotate(struct surface_t* a, float angle, struct surface_t* b) {
-  float theta = __D2R(angle);
-  float c = cosf(theta), s = sinf(theta);
-  float r[3][2] = {
-    { -a->h * s, a->h * c },
-    {  a->w * c - a->h * s, a->h * c + a->w * s },
-    {  a->w * c, a->w * s }
-  };
-
-  float mm[2][2] = {{
-    __MIN(0, __MIN(r[0][0], __MIN(r[1][0], r[2][0]))),
-    __MIN(0, __MIN(r[0][1], __MIN(r[1][1], r[2][1])))
-  }, {
-    (theta > 1.5708  && theta < 3.14159 ? 0.f : __MAX(r[0][0], __MAX(r[1][0], r[2][0]))),
-    (theta > 3.14159 && theta < 4.71239 ? 0.f : __MAX(r[0][1], __MAX(r[1][1], r[2][1])))
-  }};
-
-  int dw = (int)ceil(fabsf(mm[1][0]) - mm[0][0]);
-  int dh = (int)ceil(fabsf(mm[1][1]) - mm[0][1]);
-  if (!surface(b, dw, dh))
-    return false;
-
-  int x, y, sx, sy;
-  for (x = 0; x < dw; ++x)
-    for (y = 0; y < dh; ++y) {
-      sx = ((x + mm[0][0]) * c + (y + mm[0][1]) * s);
-      sy = ((y + mm[0][1]) * c - (x + mm[0][0]) * s);
-      if (sx < 0 || sx >= a->w || sy < 0 || sy >= a->h)
-        continue;
-      pset(b, x, y, pget(a, sx, sy));
-    }
-  return true;
+static double resize_box(double x) {
+  return x >= -.5 && x < .5 ? 1. : 0.;
 }
 
-static inline void vline(struct surface_t* s, int x, int y0, int y1, int col) {
-  if (y1 < y0) {
-    y0 += y1;
-    y1  = y0 - y1;
-    y0 -= y1;
-  }
+static double resize_triangle(double x) {
+  x = fabs(x);
+  return x < 1. ? 1. - x : 0.;
+}
 
-  if (x < 0 || x >= s->w || y0 >= s->h)
-    return;
+/* Keys' cubic convolution with a = -0.5 */
+static double resize_bicubic(double x) {
+  const double a = -.5;
+  x = fabs(x);
+  if (x < 1.)
+    return ((a + 2.) * x - (a + 3.)) * x * x + 1.;
+  if (x < 2.)
+    return (((x - 5.) * x + 8.) * x - 4.) * a;
+  return 0.;
+}
 
-  if (y0 < 0)
-    y0 = 0;
-  if (y1 >= s->h)
-    y1 = s->h - 1;
+static double __sinc(double x) {
+  if (x == 0.)
+    return 1.;
+  x *= M_PI;
+  return sin(x) / x;
+}
 
-  for(int y = y0; y <= y1; y++)
-    pset(s, x, y, col);
+static double resize_lanczos3(double x) {
+  return x > -3. && x < 3. ? __sinc(x) * __sinc(x / 3.) : 0.;
+}
+
+static const struct {
+  double(*fn)(double);
+  double support;
+} resize_filters[] = {
+  { NULL,            0. }, /* RESIZE_NEAREST */
+  { resize_triangle, 1. }, /* RESIZE_BILINEAR */
+  { resize_bicubic,  2. }, /* RESIZE_BICUBIC */
+  { resize_lanczos3, 3. }, /* RESIZE_LANCZOS3 */
+  { resize_box,      .5 }  /* RESIZE_BOX */
+};
+
+#define __RESAMPLE_BITS 14
+
+/* Weights of one axis. Destination pixel i reads taps source pixels from
+ * bounds[i * 2], bounds[i * 2 + 1] of which have a weight. Weights are fixed
+ * point with __RESAMPLE_BITS of fraction and always add up to exactly one */
+static bool resampler_axis(int in, int out, enum resize_filter filter, int* taps, int** bounds, short** weights) {
+  double scale = (double)in / out, fscale = __MAX(scale, 1.);
+  double support = resize_filters[filter].support * fscale;
+  int n = filter == RESIZE_NEAREST ? 1 : (int)ceil(support) * 2 + 1;
+  double* k = GRAPHICS_MALLOC(n * sizeof(double));
+  *bounds = GRAPHICS_MALLOC(out * 2 * sizeof(int));
+  *weights = GRAPHICS_MALLOC(out * n * sizeof(short));
+  if (!k || !*bounds || !*weights) {
+    GRAPHICS_SAFE_FREE(k);
+    GRAPHICS_SAFE_FREE(*bounds);
+    GRAPHICS_SAFE_FREE(*weights);
+    GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+    return false;
+  }
+  memset(*weights, 0, out * n * sizeof(short));
+  *taps = n;
+
+  for (int i = 0; i < out; ++i) {
+    double center = (i + .5) * scale, total = 0.;
+    int* b = *bounds + i * 2;
+    short* w = *weights + i * n;
+    int xmin = __MAX((int)(center - support + .5), 0);
+    int xmax = __MIN((int)(center + support + .5), in);
+    int j, count = xmax - xmin, sum = 0, peak = 0;
+    if (filter != RESIZE_NEAREST)
+      for (j = 0; j < count; ++j)
+        total += (k[j] = resize_filters[filter].fn((j + xmin - center + .5) / fscale));
+    if (filter == RESIZE_NEAREST || count <= 0 || total == 0.) {
+      b[0] = __MIN((int)center, in - 1);
+      b[1] = 1;
+      w[0] = 1 << __RESAMPLE_BITS;
+      continue;
+    }
+
+    b[0] = xmin;
+    b[1] = count;
+    for (j = 0; j < count; ++j) {
+      w[j] = (short)floor(k[j] / total * (1 << __RESAMPLE_BITS) + .5);
+      sum += w[j];
+      if (w[j] > w[peak])
+        peak = j;
+    }
+    /* Put the rounding error on the biggest tap so flat areas stay flat */
+    w[peak] += (1 << __RESAMPLE_BITS) - sum;
+  }
+  GRAPHICS_FREE(k);
+  return true;
+}
+
+bool resampler(struct resampler_t* r, int sw, int sh, int dw, int dh, enum resize_filter filter) {
+  memset(r, 0, sizeof(struct resampler_t));
+  if (sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0 || filter < RESIZE_NEAREST || filter > RESIZE_BOX) {
+    GRAPHICS_ERROR(INVALID_PARAMETERS, "resampler() failed: invalid size or filter");
+    return false;
+  }
+  r->sw = sw;
+  r->sh = sh;
+  r->dw = dw;
+  r->dh = dh;
+  r->filter = filter;
+  if (!resampler_axis(sw, dw, filter, &r->xtaps, &r->xbounds, &r->xweights) ||
+      !resampler_axis(sh, dh, filter, &r->ytaps, &r->ybounds, &r->yweights)) {
+    resampler_destroy(r);
+    return false;
+  }
+  return true;
+}
+
+void resampler_destroy(struct resampler_t* r) {
+  GRAPHICS_SAFE_FREE(r->xbounds);
+  GRAPHICS_SAFE_FREE(r->ybounds);
+  GRAPHICS_SAFE_FREE(r->xweights);
+  GRAPHICS_SAFE_FREE(r->yweights);
+  GRAPHICS_SAFE_FREE(r->buf);
+  memset(r, 0, sizeof(struct resampler_t));
+}
+
+static inline int resample_pack(int b, int g, int r, int a) {
+  b = __CLAMP(b >> __RESAMPLE_BITS, 0, 255);
+  g = __CLAMP(g >> __RESAMPLE_BITS, 0, 255);
+  r = __CLAMP(r >> __RESAMPLE_BITS, 0, 255);
+  a = __CLAMP(a >> __RESAMPLE_BITS, 0, 255);
+  return (int)((unsigned)a << 24 | r << 16 | g << 8 | b);
+}
+
+/* Weighted sum of n pixels stride apart */
+static inline int resample_taps(const int* p, ptrdiff_t stride, const short* w, int n) {
+  int b = 1 << (__RESAMPLE_BITS - 1), g = b, r = b, a = b;
+  for (int j = 0; j < n; ++j, p += stride) {
+    unsigned int c = (unsigned int)*p;
+    b += (int)(c & 0xFF) * w[j];
+    g += (int)((c >> 8) & 0xFF) * w[j];
+    r += (int)((c >> 16) & 0xFF) * w[j];
+    a += (int)(c >> 24) * w[j];
+  }
+  return resample_pack(b, g, r, a);
+}
+
+#if defined(GRAPHICS_SSE2)
+#define __RESAMPLE_PAIR(w0, w1) _mm_set1_epi32((int)((unsigned short)(w0) | (unsigned int)(unsigned short)(w1) << 16))
+
+/* Horizontal taps, two neighbouring pixels per _mm_madd_epi16 */
+static inline int resample_taps_h_sse2(const int* p, const short* w, int n) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = _mm_set1_epi32(1 << (__RESAMPLE_BITS - 1));
+  int j = 0;
+  for (; j + 2 <= n; j += 2) {
+    /* b0 b1 g0 g1 r0 r1 a0 a1 as 16 bit pairs, times w0 w1 */
+    __m128i px = _mm_loadl_epi64((const __m128i*)(p + j));
+    px = _mm_unpacklo_epi8(_mm_unpacklo_epi8(px, _mm_srli_si128(px, 4)), zero);
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(px, __RESAMPLE_PAIR(w[j], w[j + 1])));
+  }
+  if (j < n) {
+    __m128i px = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(p[j]), zero), zero);
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(px, __RESAMPLE_PAIR(w[j], 0)));
+  }
+  acc = _mm_srai_epi32(acc, __RESAMPLE_BITS);
+  acc = _mm_packs_epi32(acc, acc);
+  return _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+}
+
+/* Vertical taps for four neighbouring pixels, two rows per _mm_madd_epi16 */
+static inline void resample_taps_v_sse2(int* dst, const int* p, ptrdiff_t pitch, const short* w, int n) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a0 = _mm_set1_epi32(1 << (__RESAMPLE_BITS - 1)), a1 = a0, a2 = a0, a3 = a0;
+  int j = 0;
+  for (; j + 2 <= n; j += 2, p += pitch * 2) {
+    __m128i wt = __RESAMPLE_PAIR(w[j], w[j + 1]);
+    __m128i r0 = _mm_loadu_si128((const __m128i*)p), r1 = _mm_loadu_si128((const __m128i*)(p + pitch));
+    __m128i lo = _mm_unpacklo_epi8(r0, r1), hi = _mm_unpackhi_epi8(r0, r1);
+    a0 = _mm_add_epi32(a0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), wt));
+    a1 = _mm_add_epi32(a1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), wt));
+    a2 = _mm_add_epi32(a2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), wt));
+    a3 = _mm_add_epi32(a3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), wt));
+  }
+  if (j < n) {
+    __m128i wt = __RESAMPLE_PAIR(w[j], 0);
+    __m128i r0 = _mm_loadu_si128((const __m128i*)p);
+    __m128i lo = _mm_unpacklo_epi8(r0, zero), hi = _mm_unpackhi_epi8(r0, zero);
+    a0 = _mm_add_epi32(a0, _mm_madd_epi16(_mm_unpacklo_epi16(lo, zero), wt));
+    a1 = _mm_add_epi32(a1, _mm_madd_epi16(_mm_unpackhi_epi16(lo, zero), wt));
+    a2 = _mm_add_epi32(a2, _mm_madd_epi16(_mm_unpacklo_epi16(hi, zero), wt));
+    a3 = _mm_add_epi32(a3, _mm_madd_epi16(_mm_unpackhi_epi16(hi, zero), wt));
+  }
+  a0 = _mm_packs_epi32(_mm_srai_epi32(a0, __RESAMPLE_BITS), _mm_srai_epi32(a1, __RESAMPLE_BITS));
+  a2 = _mm_packs_epi32(_mm_srai_epi32(a2, __RESAMPLE_BITS), _mm_srai_epi32(a3, __RESAMPLE_BITS));
+  _mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(a0, a2));
+}
+#endif
+
+static void resample_h(struct resampler_t* r, struct surface_t* src, int* dst, ptrdiff_t pitch) {
+  for (int y = 0; y < src->h; ++y, dst += pitch) {
+    const int* row = __ROW(src, y);
+    for (int x = 0; x < r->dw; ++x) {
+      const int* b = r->xbounds + x * 2;
+      const short* w = r->xweights + x * r->xtaps;
+#if defined(GRAPHICS_SSE2)
+      dst[x] = resample_taps_h_sse2(row + b[0], w, b[1]);
+#else
+      dst[x] = resample_taps(row + b[0], 1, w, b[1]);
+#endif
+    }
+  }
+}
+
+static void resample_v(struct resampler_t* r, const int* src, ptrdiff_t pitch, struct surface_t* dst) {
+  for (int y = 0; y < r->dh; ++y) {
+    const int* b = r->ybounds + y * 2;
+    const short* w = r->yweights + y * r->ytaps;
+    const int* p = src + b[0] * pitch;
+    int* d = __ROW(dst, y), x = 0;
+#if defined(GRAPHICS_SSE2)
+    for (; x + 4 <= r->dw; x += 4)
+      resample_taps_v_sse2(d + x, p + x, pitch, w, b[1]);
+#endif
+    for (; x < r->dw; ++x)
+      d[x] = resample_taps(p + x, pitch, w, b[1]);
+  }
+}
+
+bool resample(struct resampler_t* r, struct surface_t* src, struct surface_t* dst) {
+  if (src->w != r->sw || src->h != r->sh || dst->w != r->dw || dst->h != r->dh) {
+    GRAPHICS_ERROR(INVALID_PARAMETERS, "resample() failed: surfaces don't match the resampler");
+    return false;
+  }
+  __damage(dst, 0, 0, dst->w, dst->h);
+
+  if (r->filter == RESIZE_NEAREST) {
+    for (int y = 0; y < r->dh; ++y) {
+      const int* p = __ROW(src, r->ybounds[y * 2]);
+      int* d = __ROW(dst, y);
+      for (int x = 0; x < r->dw; ++x)
+        d[x] = p[r->xbounds[x * 2]];
+    }
+    return true;
+  }
+
+  /* An axis that isn't scaled has identity weights, so skip its pass */
+  if (r->sh == r->dh) {
+    if (r->sw == r->dw)
+      for (int y = 0; y < r->dh; ++y)
+        memcpy(__ROW(dst, y), __ROW(src, y), r->dw * sizeof(int));
+    else
+      resample_h(r, src, dst->buf, dst->pitch);
+    return true;
+  }
+  if (r->sw == r->dw) {
+    resample_v(r, src->buf, src->pitch, dst);
+    return true;
+  }
+
+  /* The horizontal pass goes into an intermediate buffer kept for the next call */
+  if (!r->buf && !(r->buf = GRAPHICS_MALLOC((size_t)r->dw * r->sh * sizeof(int)))) {
+    GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+    return false;
+  }
+  resample_h(r, src, r->buf, r->dw);
+  resample_v(r, r->buf, r->dw, dst);
+  return true;
+}
+
+bool resize_ex(struct surface_t* a, int nw, int nh, enum resize_filter filter, struct surface_t* b) {
+  struct resampler_t r;
+  if (!resampler(&r, a->w, a->h, nw, nh, filter))
+    return false;
+  if (!surface(b, nw, nh)) {
+    resampler_destroy(&r);
+    return false;
+  }
+  bool ret = resample(&r, a, b);
+  resampler_destroy(&r);
+  if (!ret)
+    surface_destroy(b);
+  return ret;
+}
+
+/* b(x, y) = *(p + x * sx + y * sy). Transposing walks the source in 32 x 32
+ * blocks so both sides stay in cache */
+static void __remap(struct surface_t* b, const int* p, ptrdiff_t sx, ptrdiff_t sy) {
+  int x, y, bx, by;
+  if (sx == 1 || sx == -1) {
+    for (y = 0; y < b->h; ++y) {
+      const int* q = p + y * sy;
+      int* d = __ROW(b, y);
+      if (sx == 1)
+        memcpy(d, q, b->w * sizeof(int));
+      else
+        for (x = 0; x < b->w; ++x)
+          d[x] = *q--;
+    }
+    return;
+  }
+  for (by = 0; by < b->h; by += 32)
+    for (bx = 0; bx < b->w; bx += 32) {
+      int ye = __MIN(by + 32, b->h), xe = __MIN(bx + 32, b->w);
+      for (y = by; y < ye; ++y) {
+        const int* q = p + bx * sx + y * sy;
+        int* d = __ROW(b, y);
+        for (x = bx; x < xe; ++x, q += sx)
+          d[x] = *q;
+      }
+    }
+}
+
+bool rotate90(struct surface_t* a, int turns, struct surface_t* b) {
+  turns = ((turns % 4) + 4) % 4;
+  if (!surface(b, turns & 1 ? a->h : a->w, turns & 1 ? a->w : a->h))
+    return false;
+  switch (turns) {
+    case 0:
+      __remap(b, a->buf, 1, a->pitch);
+      break;
+    case 1: /* b(x, y) = a(y, h - 1 - x) */
+      __remap(b, &__PIXEL(a, 0, a->h - 1), -a->pitch, 1);
+      break;
+    case 2:
+      __remap(b, &__PIXEL(a, a->w - 1, a->h - 1), -1, -a->pitch);
+      break;
+    case 3: /* b(x, y) = a(w - 1 - y, x) */
+      __remap(b, &__PIXEL(a, a->w - 1, 0), a->pitch, -1);
+      break;
+  }
+  return true;
+}
+
+bool flip(struct surface_t* a, int flags, struct surface_t* b) {
+  if (!surface(b, a->w, a->h))
+    return false;
+  bool h = flags & FLIP_HORIZONTAL, v = flags & FLIP_VERTICAL;
+  __remap(b, &__PIXEL(a, h ? a->w - 1 : 0, v ? a->h - 1 : 0), h ? -1 : 1, v ? -a->pitch : a->pitch);
+  return true;
+}
+
+#define __AFFINE_BITS 32
+#define __AFFINE_ONE (1LL << __AFFINE_BITS)
+
+/* Destination pixel x, y samples the source at (ox + x * ux + y * vx,
+ * oy + x * uy + y * vy), fixed point source coordinates where pixel i covers
+ * [i, i + 1). ox, oy already point at the centre of pixel 0, 0 */
+struct affine_t {
+  long long ox, oy, ux, uy, vx, vy;
+};
+
+static inline void affine(struct affine_t* m, double ox, double oy, double ux, double uy, double vx, double vy) {
+  m->ox = (long long)floor(ox * __AFFINE_ONE);
+  m->oy = (long long)floor(oy * __AFFINE_ONE);
+  m->ux = (long long)floor(ux * __AFFINE_ONE + .5);
+  m->uy = (long long)floor(uy * __AFFINE_ONE + .5);
+  m->vx = (long long)floor(vx * __AFFINE_ONE + .5);
+  m->vy = (long long)floor(vy * __AFFINE_ONE + .5);
+}
+
+/* Interpolate packed pixels a and b by t / 256, two channels at a time */
+static inline unsigned int __lerp(unsigned int a, unsigned int b, unsigned int t) {
+  unsigned int rb = ((a & 0xFF00FF) * (256 - t) + (b & 0xFF00FF) * t) >> 8;
+  unsigned int ag = ((a >> 8) & 0xFF00FF) * (256 - t) + ((b >> 8) & 0xFF00FF) * t;
+  return (rb & 0xFF00FF) | (ag & 0xFF00FF00);
+}
+
+static inline int affine_bilinear(struct surface_t* s, struct rect_t* r, long long u, long long v) {
+  /* Interpolate between the centres either side of u, v, clamped to the source rect */
+  u -= __AFFINE_ONE / 2;
+  v -= __AFFINE_ONE / 2;
+  int x0 = (int)(u >> __AFFINE_BITS), y0 = (int)(v >> __AFFINE_BITS), x1 = x0 + 1, y1 = y0 + 1;
+  unsigned int fx = (unsigned int)(u >> (__AFFINE_BITS - 8)) & 0xFF, fy = (unsigned int)(v >> (__AFFINE_BITS - 8)) & 0xFF;
+  if (x0 < r->x || y0 < r->y || x1 >= r->x + r->w || y1 >= r->y + r->h) {
+    x0 = __CLAMP(x0, r->x, r->x + r->w - 1);
+    y0 = __CLAMP(y0, r->y, r->y + r->h - 1);
+    x1 = __CLAMP(x1, r->x, r->x + r->w - 1);
+    y1 = __CLAMP(y1, r->y, r->y + r->h - 1);
+  }
+  const int *p0 = __ROW(s, y0), *p1 = __ROW(s, y1);
+  return (int)__lerp(__lerp(p0[x0], p0[x1], fx), __lerp(p1[x0], p1[x1], fx), fy);
+}
+
+/* Narrow [x0, x1] to the columns of a row whose samples u + x * du land in
+ * [lo, hi) along one source axis, inv being 1 / du */
+static inline void affine_interval(long long u, long long du, double inv, long long lo, long long hi, int* x0, int* x1) {
+  if (!du) {
+    if (u < lo || u >= hi)
+      *x1 = *x0 - 1;
+    return;
+  }
+  /* Estimate in floating point, then settle on the exact ends */
+  double a = (lo - u) * inv, b = (hi - u) * inv;
+  if (a > b) {
+    double t = a;
+    a = b;
+    b = t;
+  }
+  int s = *x0, e = *x1;
+  if (a > s)
+    s = a > e ? e + 1 : (int)ceil(a);
+  if (b < e)
+    e = b < s ? s - 1 : (int)floor(b);
+#define __AFFINE_IN(x) (u + (x) * du >= lo && u + (x) * du < hi)
+  if (s <= e) {
+    while (s <= e && !__AFFINE_IN(s))
+      s++;
+    while (s > *x0 && __AFFINE_IN(s - 1))
+      s--;
+    while (e >= s && !__AFFINE_IN(e))
+      e--;
+    while (e < *x1 && __AFFINE_IN(e + 1))
+      e++;
+  }
+#undef __AFFINE_IN
+  if (s > e) {
+    *x1 = *x0 - 1;
+    return;
+  }
+  *x0 = s;
+  *x1 = e;
+}
+
+/* Resample the r area of src into the [x0, x1) x [y0, y1) area of dst
+ * through m. Only pixels whose sample lands inside r are touched, found per
+ * row up front so the inner loop is two adds per pixel. copy writes pixels
+ * as is, otherwise they are drawn with the current draw mode */
+static void __affine_blit(struct surface_t* dst, int x0, int y0, int x1, int y1, struct surface_t* src, struct rect_t* r, struct affine_t* m, bool bilinear, bool copy) {
+  int buf[256];
+  long long lox = (long long)r->x << __AFFINE_BITS, hix = (long long)(r->x + r->w) << __AFFINE_BITS;
+  long long loy = (long long)r->y << __AFFINE_BITS, hiy = (long long)(r->y + r->h) << __AFFINE_BITS;
+  double invx = m->ux ? 1. / m->ux : 0., invy = m->uy ? 1. / m->uy : 0.;
+  for (int y = y0; y < y1; ++y) {
+    long long u = m->ox + y * m->vx, v = m->oy + y * m->vy;
+    int s = x0, e = x1 - 1;
+    affine_interval(u, m->ux, invx, lox, hix, &s, &e);
+    affine_interval(v, m->uy, invy, loy, hiy, &s, &e);
+    if (s > e)
+      continue;
+
+    u += s * m->ux;
+    v += s * m->uy;
+    int* d = &__PIXEL(dst, s, y);
+    for (int n = e - s + 1; n > 0;) {
+      int k = __MIN(n, 256), *out = copy ? d : buf;
+      if (bilinear)
+        for (int i = 0; i < k; ++i, u += m->ux, v += m->uy)
+          out[i] = affine_bilinear(src, r, u, v);
+      else
+        for (int i = 0; i < k; ++i, u += m->ux, v += m->uy)
+          out[i] = __PIXEL(src, (int)(u >> __AFFINE_BITS), (int)(v >> __AFFINE_BITS));
+      if (!copy)
+        __row(d, buf, k);
+      d += k;
+      n -= k;
+    }
+  }
+}
+
+bool rotate_ex(struct surface_t* a, float angle, enum resize_filter filter, struct surface_t* b) {
+  /* Right angles are exact whatever the filter, every sample hits a pixel centre */
+  if (fmod(angle, 90.) == 0.)
+    return rotate90(a, (int)fmod(angle / 90., 4.), b);
+
+  double theta = __D2R(angle), c = cos(theta), s = sin(theta);
+  int dw = (int)ceil(fabs(a->w * c) + fabs(a->h * s) - 1e-9);
+  int dh = (int)ceil(fabs(a->w * s) + fabs(a->h * c) - 1e-9);
+  if (!surface(b, __MAX(dw, 1), __MAX(dh, 1)))
+    return false;
+
+  /* Rotate about the centres of both surfaces, sampling at pixel centres */
+  double X = .5 - b->w / 2., Y = .5 - b->h / 2.;
+  struct affine_t m;
+  struct rect_t r = { 0, 0, a->w, a->h };
+  affine(&m, X * c + Y * s + a->w / 2., -X * s + Y * c + a->h / 2., c, -s, s, c);
+  __affine_blit(b, 0, 0, b->w, b->h, a, &r, &m, filter != RESIZE_NEAREST, true);
+  return true;
+}
+
+bool rotate(struct surface_t* a, float angle, struct surface_t* b) {
+  return rotate_ex(a, angle, RESIZE_NEAREST, b);
+}
+
+void transform(struct transform_t* t) {
+  t->a = t->d = 1.f;
+  t->b = t->c = t->tx = t->ty = 0.f;
+}
+
+/* t = t * [a c tx; b d ty], so the newest operation applies to the source first */
+static inline void transform_mul(struct transform_t* t, float a, float b, float c, float d, float tx, float ty) {
+  struct transform_t r;
+  r.a  = t->a * a + t->c * b;
+  r.b  = t->b * a + t->d * b;
+  r.c  = t->a * c + t->c * d;
+  r.d  = t->b * c + t->d * d;
+  r.tx = t->a * tx + t->c * ty + t->tx;
+  r.ty = t->b * tx + t->d * ty + t->ty;
+  *t = r;
+}
+
+void transform_translate(struct transform_t* t, float x, float y) {
+  transform_mul(t, 1.f, 0.f, 0.f, 1.f, x, y);
+}
+
+void transform_scale(struct transform_t* t, float x, float y) {
+  transform_mul(t, x, 0.f, 0.f, y, 0.f, 0.f);
+}
+
+void transform_rotate(struct transform_t* t, float angle) {
+  float theta = (float)__D2R(angle), c = cosf(theta), s = sinf(theta);
+  transform_mul(t, c, s, -s, c, 0.f, 0.f);
+}
+
+bool paste_ex(struct surface_t* dst, struct surface_t* src, struct transform_t* t, struct rect_t* rect, int flags, enum resize_filter filter) {
+  struct rect_t r = { 0, 0, src->w, src->h };
+  if (rect) {
+    r.x = __MAX(rect->x, 0);
+    r.y = __MAX(rect->y, 0);
+    r.w = __MIN(rect->x + rect->w, src->w) - r.x;
+    r.h = __MIN(rect->y + rect->h, src->h) - r.y;
+  }
+  double det = (double)t->a * t->d - (double)t->b * t->c;
+  if (r.w <= 0 || r.h <= 0 || fabs(det) < 1e-12)
+    return true;
+
+  /* Destination bounds of the transformed source rect, clipped */
+  double xs[4], ys[4], x0, y0, x1, y1;
+  for (int i = 0; i < 4; ++i) {
+    double u = i & 1 ? r.w : 0, v = i & 2 ? r.h : 0;
+    xs[i] = t->a * u + t->c * v + t->tx;
+    ys[i] = t->b * u + t->d * v + t->ty;
+  }
+  x0 = __MIN(__MIN(xs[0], xs[1]), __MIN(xs[2], xs[3]));
+  y0 = __MIN(__MIN(ys[0], ys[1]), __MIN(ys[2], ys[3]));
+  x1 = __MAX(__MAX(xs[0], xs[1]), __MAX(xs[2], xs[3]));
+  y1 = __MAX(__MAX(ys[0], ys[1]), __MAX(ys[2], ys[3]));
+  int cx0, cy0, cx1, cy1;
+  if (!__clip_rect(dst, &cx0, &cy0, &cx1, &cy1))
+    return true;
+  cx0 = (int)__MAX(cx0, floor(x0));
+  cy0 = (int)__MAX(cy0, floor(y0));
+  cx1 = (int)__MIN(cx1, ceil(x1));
+  cy1 = (int)__MIN(cy1, ceil(y1));
+  if (cx0 >= cx1 || cy0 >= cy1)
+    return true;
+  __damage(dst, cx0, cy0, cx1, cy1);
+
+  /* Invert t, then fold the flips and the source rect offset in. Flipping
+   * mirrors u to w - u, so it negates the steps and moves the origin */
+  double ia = t->d / det, ib = -t->b / det, ic = -t->c / det, id = t->a / det;
+  double ox = ia * (cx0 + .5 - t->tx) + ic * (cy0 + .5 - t->ty);
+  double oy = ib * (cx0 + .5 - t->tx) + id * (cy0 + .5 - t->ty);
+  double fx = flags & FLIP_HORIZONTAL ? -1. : 1., fy = flags & FLIP_VERTICAL ? -1. : 1.;
+  ox = (flags & FLIP_HORIZONTAL ? r.w - ox : ox) + r.x;
+  oy = (flags & FLIP_VERTICAL ? r.h - oy : oy) + r.y;
+  struct affine_t m;
+  affine(&m, ox, oy, ia * fx, ib * fy, ic * fx, id * fy);
+  m.ox -= cx0 * m.ux + cy0 * m.vx;
+  m.oy -= cx0 * m.uy + cy0 * m.vy;
+
+  struct surface_t tmp, view;
+  bool aliased = surface_root(src) == surface_root(dst);
+  if (aliased) {
+    /* Drawing onto the source would read back pixels already drawn */
+    if (!subsurface(src, r.x, r.y, r.w, r.h, &view) || !copy(&view, &tmp))
+      return false;
+    m.ox -= (long long)r.x << __AFFINE_BITS;
+    m.oy -= (long long)r.y << __AFFINE_BITS;
+    r.x = r.y = 0;
+    src = &tmp;
+  }
+  __affine_blit(dst, cx0, cy0, cx1, cy1, src, &r, &m, filter != RESIZE_NEAREST, false);
+  if (aliased)
+    surface_destroy(&tmp);
+  return true;
+}
+
+static inline void vline(struct surface_t* s, int x, int y0, int y1, int col) {
+  if (y1 < y0) {
+    y0 += y1;
+    y1  = y0 - y1;
+    y0 -= y1;
+  }
+
+  int cx0, cy0, cx1, cy1;
+  if (!__clip_rect(s, &cx0, &cy0, &cx1, &cy1) || x < cx0 || x >= cx1 || y0 >= cy1 || y1 < cy0)
+    return;
+
+  if (y0 < cy0)
+    y0 = cy0;
+  if (y1 >= cy1)
+    y1 = cy1 - 1;
+
+  __vspan(s, x, y0, y1 - y0 + 1, col);
+  __damage(s, x, y0, x + 1, y1 + 1);
 }
 
 static inline void hline(struct surface_t* s, int y, int x0, int x1, int col) {
@@ -387,45 +1696,156 @@ static inline void hline(struct surface_t* s, int y, int x0, int x1, int col) {
     x0 -= x1;
   }
 
-  if (y < 0 || y >= s->h || x0 >= s->w)
+  int cx0, cy0, cx1, cy1;
+  if (!__clip_rect(s, &cx0, &cy0, &cx1, &cy1) || y < cy0 || y >= cy1 || x0 >= cx1 || x1 < cx0)
+    return;
+
+  if (x0 < cx0)
+    x0 = cx0;
+  if (x1 >= cx1)
+    x1 = cx1 - 1;
+
+  __span(s, x0, y, x1 - x0 + 1, col);
+  __damage(s, x0, y, x1 + 1, y + 1);
+}
+
+/* Bresenham in closed form: stepping i from 0 to n along the major axis, the
+ * minor axis has moved round(i * m / n), halves rounding away from the start.
+ * That gives the visible range of i straight away, so off-screen parts of a
+ * line cost nothing and a clipped line draws exactly the pixels the whole
+ * line would. Set first to plot the starting pixel */
+static void line_fn(struct surface_t* s, long long x0, long long y0, long long x1, long long y1, int col, bool first) {
+  long long dx = llabs(x1 - x0), dy = llabs(y1 - y0), n = __MAX(dx, dy);
+  if (n >= (1LL << 30)) {
+    /* Keep the arithmetic below inside 64 bits */
+    long long xm = (x0 + x1) >> 1, ym = (y0 + y1) >> 1;
+    line_fn(s, x0, y0, xm, ym, col, first);
+    line_fn(s, xm, ym, x1, y1, col, false);
+    return;
+  }
+
+  int cx0, cy0, cx1, cy1;
+  if (!n || !__clip_rect(s, &cx0, &cy0, &cx1, &cy1))
+    return;
+  bool xmajor = dx >= dy;
+  long long a0 = xmajor ? x0 : y0, b0 = xmajor ? y0 : x0, m = xmajor ? dy : dx;
+  int sa = (xmajor ? x1 > x0 : y1 > y0) ? 1 : -1;
+  int sb = (xmajor ? y1 > y0 : x1 > x0) ? 1 : -1;
+  int alo = xmajor ? cx0 : cy0, ahi = (xmajor ? cx1 : cy1) - 1;
+  int blo = xmajor ? cy0 : cx0, bhi = (xmajor ? cy1 : cx1) - 1;
+
+  /* Steps that land inside the clip rect on the major axis... */
+  long long i0 = first ? 0 : 1, i1 = n;
+  if (sa > 0) {
+    i0 = __MAX(i0, alo - a0);
+    i1 = __MIN(i1, ahi - a0);
+  } else {
+    i0 = __MAX(i0, a0 - ahi);
+    i1 = __MIN(i1, a0 - alo);
+  }
+  /* ...and on the minor axis, where k(i) = floor((2im + n) / 2n) is in [klo, khi] */
+  long long klo = sb > 0 ? blo - b0 : b0 - bhi, khi = sb > 0 ? bhi - b0 : b0 - blo;
+  if (khi < 0 || klo > m)
+    return;
+  if (klo > 0)
+    i0 = __MAX(i0, (n * (2 * klo - 1) + 2 * m - 1) / (2 * m));
+  if (khi < m)
+    i1 = __MIN(i1, (n * (2 * khi + 1) - 1) / (2 * m));
+  if (i0 > i1)
     return;
 
-  if (x0 < 0)
-    x0 = 0;
-  if (x1 >= s->w)
-    x1 = s->w - 1;
+  long long num = 2 * i0 * m + n, k = num / (2 * n), r = num % (2 * n);
+  int x = (int)(xmajor ? a0 + sa * i0 : b0 + sb * k);
+  int y = (int)(xmajor ? b0 + sb * k : a0 + sa * i0);
+  int *p = &__PIXEL(s, x, y), cnt = (int)(i1 - i0 + 1);
+  ptrdiff_t step_a = xmajor ? sa : sa * (ptrdiff_t)s->pitch;
+  ptrdiff_t step_b = xmajor ? sb * (ptrdiff_t)s->pitch : sb;
 
-  for(int x = x0; x <= x1; x++)
-    pset(s, x, y, col);
+  enum draw_mode mode = __ctx()->mode;
+  if (mode == MASK && a_channel(col) < 255)
+    return;
+  long long ke = (2 * i1 * m + n) / (2 * n);
+  int ex = (int)(xmajor ? a0 + sa * i1 : b0 + sb * ke);
+  int ey = (int)(xmajor ? b0 + sb * ke : a0 + sa * i1);
+  __damage(s, __MIN(x, ex), __MIN(y, ey), __MAX(x, ex) + 1, __MAX(y, ey) + 1);
+  if (mode == ALPHA && a_channel(col) < 255)
+    for (; cnt--; p += step_a) {
+      *p = __blend(*p, col);
+      if ((r += 2 * m) >= 2 * n) {
+        r -= 2 * n;
+        p += step_b;
+      }
+    }
+  else
+    for (; cnt--; p += step_a) {
+      *p = col;
+      if ((r += 2 * m) >= 2 * n) {
+        r -= 2 * n;
+        p += step_b;
+      }
+    }
 }
 
 void line(struct surface_t* s, int x0, int y0, int x1, int y1, int col) {
-  if (x0 == x1)
-    vline(s, x0, y0, y1, col);
   if (y0 == y1)
     hline(s, y0, x0, x1, col);
-    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
-  int dy = abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
-  int err = (dx > dy ? dx : -dy) / 2;
+  else if (x0 == x1)
+    vline(s, x0, y0, y1, col);
+  else
+    line_fn(s, x0, y0, x1, y1, col, true);
+}
 
-  while (pset(s, x0, y0, col), x0 != x1 || y0 != y1) {
-    int e2 = err;
-    if (e2 > -dx) { err -= dy; x0 += sx; }
-    if (e2 <  dy) { err += dx; y0 += sy; }
+/* pset against a clip rect the caller looked up once */
+static inline void __plot(struct surface_t* s, int x, int y, int col, enum draw_mode mode, int cx0, int cy0, int cx1, int cy1) {
+  if (x < cx0 || y < cy0 || x >= cx1 || y >= cy1)
+    return;
+  int* p = &__PIXEL(s, x, y);
+  switch (mode) {
+    case MASK:
+      if (a_channel(col) < 255)
+        return;
+    default:
+    case NORMAL:
+      *p = col;
+      break;
+    case ALPHA:
+      *p = __blend(*p, col);
+      break;
   }
 }
 
 void circle(struct surface_t* s, int xc, int yc, int r, int col, bool fill) {
-  int x = -r, y = 0, err = 2 - 2 * r; /* II. Quadrant */
-  do {
-    pset(s, xc - x, yc + y, col);    /*   I. Quadrant */
-    pset(s, xc - y, yc - x, col);    /*  II. Quadrant */
-    pset(s, xc + x, yc - y, col);    /* III. Quadrant */
-    pset(s, xc + y, yc + x, col);    /*  IV. Quadrant */
+  int cx0, cy0, cx1, cy1;
+  if (!__clip_rect(s, &cx0, &cy0, &cx1, &cy1))
+    return;
+  if (r >= 0) {
+    if ((long long)xc + r < cx0 || (long long)xc - r >= cx1 || (long long)yc + r < cy0 || (long long)yc - r >= cy1)
+      return;
+    /* Every outline pixel is within a pixel of the radius, so if the
+     * furthest corner of the clip rect is closer there's nothing to draw */
+    long long fx = __MAX(llabs((long long)cx0 - xc), llabs((long long)cx1 - 1 - xc));
+    long long fy = __MAX(llabs((long long)cy0 - yc), llabs((long long)cy1 - 1 - yc));
+    if (!fill && r > 1 && fx * fx + fy * fy < (long long)(r - 1) * (r - 1))
+      return;
+    __damage(s, (int)__MAX((long long)xc - r, cx0), (int)__MAX((long long)yc - r, cy0), (int)__MIN((long long)xc + r + 1, cx1), (int)__MIN((long long)yc + r + 1, cy1));
+  }
 
+  enum draw_mode mode = __ctx()->mode;
+  int x = -r, y = 0, err = 2 - 2 * r, last = -1; /* II. Quadrant */
+  do {
     if (fill) {
-      hline(s, yc - y, xc - x, xc + x, col);
-      hline(s, yc + y, xc - x, xc + x, col);
+      /* x only grows, so the first step on each row is the widest span */
+      if (y != last) {
+        hline(s, yc - y, xc - x, xc + x, col);
+        if (y)
+          hline(s, yc + y, xc - x, xc + x, col);
+        last = y;
+      }
+    } else {
+      __plot(s, xc - x, yc + y, col, mode, cx0, cy0, cx1, cy1);    /*   I. Quadrant */
+      __plot(s, xc - y, yc - x, col, mode, cx0, cy0, cx1, cy1);    /*  II. Quadrant */
+      __plot(s, xc + x, yc - y, col, mode, cx0, cy0, cx1, cy1);    /* III. Quadrant */
+      __plot(s, xc + y, yc + x, col, mode, cx0, cy0, cx1, cy1);    /*  IV. Quadrant */
     }
 
     r = err;
@@ -437,33 +1857,32 @@ void circle(struct surface_t* s, int xc, int yc, int r, int col, bool fill) {
 }
 
 void rect(struct surface_t* s, int x, int y, int w, int h, int col, bool fill) {
-  if (x < 0) {
-    w += x;
-    x  = 0;
-  }
-  if (y < 0) {
-    h += y;
-    y  = 0;
-  }
-
-  w += x;
-  h += y;
-  if (w < 0 || h < 0 || x > s->w || y > s->h)
+  if (w <= 0 || h <= 0)
     return;
 
-  if (w > s->w)
-    w = s->w;
-  if (h > s->h)
-    h = s->h;
-
   if (fill) {
-    for (; y < h; ++y)
-      hline(s, y, x, w, col);
+    int x0, y0, x1, y1;
+    if (!__clip_rect(s, &x0, &y0, &x1, &y1))
+      return;
+    x0 = __MAX(x, x0);
+    y0 = __MAX(y, y0);
+    x1 = __MIN(x + w, x1);
+    y1 = __MIN(y + h, y1);
+    if (x0 >= x1)
+      return;
+    __damage(s, x0, y0, x1, y1);
+    for (; y0 < y1; ++y0)
+      __span(s, x0, y0, x1 - x0, col);
   } else {
-    hline(s, y, x, w, col);
-    hline(s, h, x, w, col);
-    vline(s, x, y, h, col);
-    vline(s, w, y, h, col);
+    /* Every border pixel is touched once, so ALPHA corners aren't blended twice */
+    hline(s, y, x, x + w - 1, col);
+    if (h > 1)
+      hline(s, y + h - 1, x, x + w - 1, col);
+    if (h > 2) {
+      vline(s, x, y + 1, y + h - 2, col);
+      if (w > 1)
+        vline(s, x + w - 1, y + 1, y + h - 2, col);
+    }
   }
 }
 
@@ -474,247 +1893,867 @@ void rect(struct surface_t* s, int x, int y, int w, int h, int col, bool fill) {
     b = temp;          \
   } while(0)
 
-void tri(struct surface_t* s, int x0, int y0, int x1, int y1, int x2, int y2, int col, bool fill) {
-  if (y0 ==  y1 && y0 ==  y2)
+#define __SUBPIXEL_BITS 4
+#define __SUBPIXEL_ONE GRAPHICS_SUBPIXEL_ONE
+/* Triangles reaching further out than this (fixed point) are clipped to it
+ * first, which keeps every edge equation well inside 64 bits */
+#define __SUBPIXEL_GUARD (1LL << 26)
+
+static inline long long __floordiv(long long a, long long b) {
+  return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+/* Half-space edge A * x + B >= t for pixel column x on the current row */
+struct tri_edge_t {
+  long long dx, dy, x0, y0;
+  int t;
+};
+
+static inline void tri_edge(struct tri_edge_t* e, long long x0, long long y0, long long x1, long long y1) {
+  e->dx = x1 - x0;
+  e->dy = y1 - y0;
+  e->x0 = x0;
+  e->y0 = y0;
+  /* Top-left fill rule: pixel centres exactly on a top or left edge belong to this triangle */
+  e->t = (e->dy < 0 || (e->dy == 0 && e->dx > 0)) ? 0 : 1;
+}
+
+/* Narrow [*xl, *xr] to the columns on row y (fixed point) inside edge e */
+static inline void tri_edge_span(struct tri_edge_t* e, long long y, int* xl, int* xr) {
+  long long a = -e->dy * __SUBPIXEL_ONE;
+  long long b = e->dx * (y - e->y0) + e->dy * e->x0;
+  if (a > 0) {
+    long long x = -__floordiv(b - e->t, a);
+    if (x > *xl)
+      *xl = x > INT_MAX ? INT_MAX : (int)x;
+  } else if (a < 0) {
+    long long x = __floordiv(b - e->t, -a);
+    if (x < *xr)
+      *xr = x < INT_MIN ? INT_MIN : (int)x;
+  } else if (b < e->t)
+    *xr = *xl - 1;
+}
+
+/* Rasterize a triangle given in __SUBPIXEL_BITS fixed point, pixel centres at
+ * whole coordinates. Vertices must be inside __SUBPIXEL_GUARD */
+static void tri_raster(struct surface_t* s, long long x0, long long y0, long long x1, long long y1, long long x2, long long y2, int col) {
+  long long area = (x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0);
+  if (!area)
     return;
-  if (fill) {
-    if (y0 > y1) {
-      GRAPHICS_SWAP(x0, x1);
-      GRAPHICS_SWAP(y0, y1);
-    }
-    if (y0 > y2) {
-      GRAPHICS_SWAP(x0, x2);
-      GRAPHICS_SWAP(y0, y2);
-    }
-    if (y1 > y2) {
-      GRAPHICS_SWAP(x1, x2);
-      GRAPHICS_SWAP(y1, y2);
-    }
+  if (area < 0) {
+    long long t = x1;
+    x1 = x2;
+    x2 = t;
+    t = y1;
+    y1 = y2;
+    y2 = t;
+  }
+
+  struct tri_edge_t e[3];
+  tri_edge(&e[0], x0, y0, x1, y1);
+  tri_edge(&e[1], x1, y1, x2, y2);
+  tri_edge(&e[2], x2, y2, x0, y0);
+
+  int ys = (int)-__floordiv(-__MIN(y0, __MIN(y1, y2)), __SUBPIXEL_ONE);
+  int ye = (int)__floordiv(__MAX(y0, __MAX(y1, y2)), __SUBPIXEL_ONE);
+  int xs = (int)-__floordiv(-__MIN(x0, __MIN(x1, x2)), __SUBPIXEL_ONE);
+  int xe = (int)__floordiv(__MAX(x0, __MAX(x1, x2)), __SUBPIXEL_ONE);
+  int cx0, cy0, cx1, cy1;
+  if (!__clip_rect(s, &cx0, &cy0, &cx1, &cy1))
+    return;
+  ys = __MAX(ys, cy0);
+  ye = __MIN(ye, cy1 - 1);
+  xs = __MAX(xs, cx0);
+  xe = __MIN(xe, cx1 - 1);
+  __damage(s, xs, ys, xe + 1, ye + 1);
+
+  for (int y = ys; y <= ye; ++y) {
+    int xl = xs, xr = xe;
+    for (int i = 0; i < 3 && xl <= xr; ++i)
+      tri_edge_span(&e[i], (long long)y * __SUBPIXEL_ONE, &xl, &xr);
+    if (xl <= xr)
+      __span(s, xl, y, xr - xl + 1, col);
+  }
+}
 
-    int total_height = y2 - y0, i, j;
-    for (i = 0; i < total_height; ++i) {
-      bool second_half = i > y1 - y0 || y1 == y0;
-      int segment_height = second_half ? y2 - y1 : y1 - y0;
-      float alpha = (float)i / total_height;
-      float beta  = (float)(i - (second_half ? y1 - y0 : 0)) / segment_height;
-      int ax = x0 + (x2 - x0) * alpha;
-      int ay = y0 + (y2 - y0) * alpha;
-      int bx = second_half ? x1 + (x2 - x1) : x0 + (x1 - x0) * beta;
-      int by = second_half ? y1 + (y2 - y1) : y0 + (y1 - y0) * beta;
-      if (ax > bx) {
-        GRAPHICS_SWAP(ax, bx);
-        GRAPHICS_SWAP(ay, by);
+/* Clip to the guard band and fan the polygon left over into triangles. The
+ * new vertices are far off any surface, so rounding them to the fixed point
+ * grid can't move a visible edge, and the fan's shared edges follow the same
+ * fill rule so nothing is drawn twice */
+static void tri_fill(struct surface_t* s, long long x0, long long y0, long long x1, long long y1, long long x2, long long y2, int col) {
+  const long long g = __SUBPIXEL_GUARD;
+  if (__MAX(llabs(x0), __MAX(llabs(x1), llabs(x2))) <= g && __MAX(llabs(y0), __MAX(llabs(y1), llabs(y2))) <= g) {
+    tri_raster(s, x0, y0, x1, y1, x2, y2, col);
+    return;
+  }
+
+  double p[2][8][2] = { { { (double)x0, (double)y0 }, { (double)x1, (double)y1 }, { (double)x2, (double)y2 } } };
+  int n = 3, cur = 0;
+  for (int side = 0; side < 4 && n; ++side) {
+    /* x >= -g, x <= g, y >= -g, y <= g */
+    int axis = side >> 1;
+    double sign = side & 1 ? -1. : 1., lim = side & 1 ? (double)g : (double)-g;
+    double (*in)[2] = p[cur], (*out)[2] = p[cur ^ 1];
+    int m = 0;
+    for (int i = 0; i < n; ++i) {
+      double* a = in[i];
+      double* b = in[(i + 1) % n];
+      bool ain = (a[axis] - lim) * sign >= 0, bin = (b[axis] - lim) * sign >= 0;
+      if (ain) {
+        out[m][0] = a[0];
+        out[m++][1] = a[1];
+      }
+      if (ain != bin) {
+        double t = (lim - a[axis]) / (b[axis] - a[axis]);
+        out[m][axis] = lim;
+        out[m++][axis ^ 1] = a[axis ^ 1] + t * (b[axis ^ 1] - a[axis ^ 1]);
       }
-      for (j = ax; j <= bx; ++j)
-        pset(s, j, y0 + i, col);
     }
-  } else {
+    n = m;
+    cur ^= 1;
+  }
+  for (int i = 1; i + 1 < n; ++i)
+    tri_raster(s, llround(p[cur][0][0]), llround(p[cur][0][1]),
+               llround(p[cur][i][0]), llround(p[cur][i][1]),
+               llround(p[cur][i + 1][0]), llround(p[cur][i + 1][1]), col);
+}
+
+void tri(struct surface_t* s, int x0, int y0, int x1, int y1, int x2, int y2, int col, bool fill) {
+  if (y0 ==  y1 && y0 ==  y2)
+    return;
+  if (fill)
+    tri_fill(s, (long long)x0 * __SUBPIXEL_ONE, (long long)y0 * __SUBPIXEL_ONE, (long long)x1 * __SUBPIXEL_ONE,
+             (long long)y1 * __SUBPIXEL_ONE, (long long)x2 * __SUBPIXEL_ONE, (long long)y2 * __SUBPIXEL_ONE, col);
+  else {
     line(s, x0, y0, x1, y1, col);
     line(s, x1, y1, x2, y2, col);
     line(s, x2, y2, x0, y0, col);
   }
 }
 
-typedef struct {
-//unsigned short type; /* Magic identifier */
-  unsigned int size; /* File size in bytes */
-  unsigned int reserved;
-  unsigned int offset; /* Offset to image data, bytes */
-} BMPHEADER;
-
-typedef struct {
-  unsigned int size; /* Header size in bytes */
-  int width, height; /* Width and height of image */
-  unsigned short planes; /* Number of colour planes */
-  unsigned short bits; /* Bits per pixel */
-  unsigned int compression; /* Compression type */
-  unsigned int image_size; /* Image size in bytes */
-  int xresolution, yresolution; /* Pixels per meter */
-  unsigned int ncolours; /* Number of colours */
-  unsigned int important_colours; /* Important colours */
-} BMPINFOHEADER;
-
-typedef struct {
-  unsigned int size; /* size of bitmap core header */
-  unsigned short width; /* image with */
-  unsigned short height; /* image height */
-  unsigned short planes; /* must be equal to 1 */
-  unsigned short count; /* bits per pixel */
-} BMPCOREHEADER;
-
-#define BMP_GET(d, b, s) \
-  memcpy(d, b + off, s); \
-  off += s;
+void tri_fixed(struct surface_t* s, int x0, int y0, int x1, int y1, int x2, int y2, int col) {
+  tri_fill(s, x0, y0, x1, y1, x2, y2, col);
+}
 
-bool bmp(struct surface_t* s, const char* path) {
-  FILE* fp = fopen(path, "rb");
-  if (!fp) {
-    GRAPHICS_ERROR(FILE_OPEN_FAILED, "fopen() failed: %s", path);
-    return false;
-  }
+#if !defined(GRAPHICS_BMP_BUFFER)
+#define GRAPHICS_BMP_BUFFER 65536
+#endif
 
-  fseek(fp, 0, SEEK_END);
-  size_t length = ftell(fp);
-  rewind(fp);
+#if defined(_MSC_VER)
+#define __fseek64 _fseeki64
+#define __ftell64 _ftelli64
+#else
+#define __fseek64 fseeko
+#define __ftell64 ftello
+#endif
 
-  unsigned char* data = GRAPHICS_MALLOC((length + 1) * sizeof(unsigned char));
-  if (!data) {
-    GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
-    return false;
-  }
-  fread(data, 1, length, fp);
-  fclose(fp);
+/* BMP files are streamed through a buffer of GRAPHICS_BMP_BUFFER bytes (or
+ * one row, if that's bigger) and converted a whole row at a time */
+struct bmp_t {
+  FILE* fp;
+  unsigned char* buf;
+  size_t cap, len, pos, stride;
+  /* Read at most this much at a time when set, instead of filling the buffer */
+  size_t ahead;
+  /* File offset of buf[0], of the pixel data and size of the file */
+  long long base, data, size;
+  int w, h, bits, compression;
+  bool top_down;
+  /* Row kernel for uncompressed data, converts n pixels from pixel x of p */
+  void(*convert)(struct bmp_t*, const unsigned char*, int, int, int*);
+  int palette[256];
+  /* Bitfield channels (red, green, blue, alpha), the masked value is
+   * shifted down, cut to 8 bits and looked up to expand it to 0-255 */
+  unsigned int mask[4];
+  int shift[4], drop[4];
+  unsigned char scale[4][256];
+  /* Next row handed out, and where the RLE stream is up to */
+  int row, rle_x, rle_y;
+  bool rle_done;
+};
 
-  if (data[0] != 0x42 || data[1] != 0x4D) {
-    GRAPHICS_ERROR(INVALID_BMP, "bmp() failed: invalid BMP signiture '0x%x%x'", data[1], data[0]);
-    return false;
+static inline unsigned int __le16(const unsigned char* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static inline unsigned int __le32(const unsigned char* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/* Make sure n bytes are buffered, n is never more than cap */
+static bool bmp_fill(struct bmp_t* b, size_t n) {
+  if (b->len - b->pos >= n)
+    return true;
+  memmove(b->buf, b->buf + b->pos, b->len - b->pos);
+  b->base += b->pos;
+  b->len -= b->pos;
+  b->pos = 0;
+  b->len += fread(b->buf + b->len, 1, (b->ahead ? __MAX(n, b->ahead) : b->cap) - b->len, b->fp);
+  return b->len >= n;
+}
+
+static inline long long bmp_tell(struct bmp_t* b) {
+  return b->base + (long long)b->pos;
+}
+
+static void bmp_seek(struct bmp_t* b, long long off) {
+  if (off >= b->base && off <= b->base + (long long)b->len) {
+    b->pos = (size_t)(off - b->base);
+    return;
+  }
+  __fseek64(b->fp, off, SEEK_SET);
+  b->base = off;
+  b->len = b->pos = 0;
+}
+
+static inline int bmp_byte(struct bmp_t* b) {
+  if (b->pos == b->len && !bmp_fill(b, 1))
+    return -1;
+  return b->buf[b->pos++];
+}
+
+static void bmp_close(struct bmp_t* b) {
+  if (b->fp)
+    fclose(b->fp);
+  GRAPHICS_SAFE_FREE(b->buf);
+  b->fp = NULL;
+}
+
+static void bmp_pal8(struct bmp_t* b, const unsigned char* p, int x, int n, int* out) {
+  p += x;
+  for (int i = 0; i < n; ++i)
+    out[i] = b->palette[p[i]];
+}
+
+/* 1, 2 and 4 bpp, pixels are packed from the high bits down */
+static void bmp_pal(struct bmp_t* b, const unsigned char* p, int x, int n, int* out) {
+  int bits = b->bits, per = 8 / bits, m = (1 << bits) - 1, i = 0;
+  p += x / per;
+  for (x %= per; i < n && x; ++i, x = (x + 1) % per)
+    out[i] = b->palette[(*p >> (8 - bits * (x + 1))) & m];
+  if (i && !x)
+    ++p;
+  for (; i + per <= n; i += per, ++p)
+    for (int j = 0, v = *p; j < per; ++j)
+      out[i + j] = b->palette[(v >> (8 - bits * (j + 1))) & m];
+  for (int j = 0; i < n; ++i, ++j)
+    out[i] = b->palette[(*p >> (8 - bits * (j + 1))) & m];
+}
+
+/* Four pixels from three words at a time, the alpha byte covers whatever
+ * was shifted into the top */
+static void bmp_rgb24(struct bmp_t* b, const unsigned char* p, int x, int n, int* out) {
+  int i = 0;
+  for (p += x * 3; i + 4 <= n; i += 4, p += 12) {
+    unsigned int w0 = __le32(p), w1 = __le32(p + 4), w2 = __le32(p + 8);
+    out[i] = (int)(0xFF000000 | w0);
+    out[i + 1] = (int)(0xFF000000 | (w0 >> 24) | (w1 << 8));
+    out[i + 2] = (int)(0xFF000000 | (w1 >> 16) | (w2 << 16));
+    out[i + 3] = (int)(0xFF000000 | (w2 >> 8));
   }
+  for (; i < n; ++i, p += 3)
+    out[i] = 0xFF000000 | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+/* BGRX, the unused byte is ignored */
+static void bmp_rgb32(struct bmp_t* b, const unsigned char* p, int x, int n, int* out) {
+  int i = 0;
+  p += x * 4;
+#if defined(GRAPHICS_SSE2)
+  const __m128i opaque4 = _mm_set1_epi32(0xFF000000);
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + i * 4)), opaque4));
+#endif
+  for (; i < n; ++i)
+    out[i] = 0xFF000000 | __le32(p + i * 4);
+}
 
-  int off = sizeof(unsigned short);
-  BMPHEADER header;
-  BMPINFOHEADER info;
-  //BMPCOREHEADER core;
-  BMP_GET(&header, data, sizeof(BMPHEADER));
-  //int info_pos = off;
-  BMP_GET(&info, data, sizeof(BMPINFOHEADER));
-
-#pragma message WARN("TODO: bmp() add support for OS/2 bitmaps")
-#pragma message WARN("TODO: bmp() add RLE support")
-#pragma message WARN("TODO: bmp() add BITFIELDS support")
-#pragma message WARN("TODO: bmp() add 1, 4 & 8 bpp support")
-
-  unsigned char* color_map = NULL;
-  int color_map_size = 0;
-  if (info.bits <= 8) {
-    color_map_size = (1 << info.bits) * 4;
-    color_map = GRAPHICS_MALLOC(color_map_size * sizeof(unsigned char));
-    if (!color_map) {
-      GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+/* BGRA, already the layout of a surface */
+static void bmp_argb32(struct bmp_t* b, const unsigned char* p, int x, int n, int* out) {
+  int i = 0;
+  p += x * 4;
+#if defined(GRAPHICS_SSE2)
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_si128((__m128i*)(out + i), _mm_loadu_si128((const __m128i*)(p + i * 4)));
+#endif
+  for (; i < n; ++i)
+    out[i] = __le32(p + i * 4);
+}
+
+static inline int bmp_bitfields(struct bmp_t* b, unsigned int v) {
+  return (int)(((unsigned int)b->scale[3][((v & b->mask[3]) >> b->shift[3]) >> b->drop[3]] << 24) |
+               (b->scale[0][((v & b->mask[0]) >> b->shift[0]) >> b->drop[0]] << 16) |
+               (b->scale[1][((v & b->mask[1]) >> b->shift[1]) >> b->drop[1]] << 8) |
+                b->scale[2][((v & b->mask[2]) >> b->shift[2]) >> b->drop[2]]);
+}
+
+static void bmp_bf16(struct bmp_t* b, const unsigned char* p, int x, int n, int* out) {
+  p += x * 2;
+  for (int i = 0; i < n; ++i, p += 2)
+    out[i] = bmp_bitfields(b, __le16(p));
+}
+
+static void bmp_bf32(struct bmp_t* b, const unsigned char* p, int x, int n, int* out) {
+  p += x * 4;
+  for (int i = 0; i < n; ++i, p += 4)
+    out[i] = bmp_bitfields(b, __le32(p));
+}
+
+static bool bmp_masks(struct bmp_t* b) {
+  for (int i = 0; i < 4; ++i) {
+    unsigned int m = b->mask[i];
+    int shift = 0, n = 0;
+    if (!m) {
+      /* Missing channels are black, a missing alpha is opaque */
+      b->shift[i] = b->drop[i] = 0;
+      b->scale[i][0] = i == 3 ? 255 : 0;
+      continue;
+    }
+    while (!(m & 1)) {
+      m >>= 1;
+      ++shift;
+    }
+    if (m & (m + 1)) {
+      GRAPHICS_ERROR(UNSUPPORTED_BMP, "bmp() failed: bitfield mask 0x%x isn't contiguous", b->mask[i]);
       return false;
     }
-    BMP_GET(color_map, data, color_map_size);
+    while (n < 32 && (m >> n))
+      ++n;
+    b->shift[i] = shift;
+    b->drop[i] = n > 8 ? n - 8 : 0;
+    m >>= b->drop[i];
+    for (unsigned int v = 0; v <= m; ++v)
+      b->scale[i][v] = (unsigned char)((v * 255 + m / 2) / m);
   }
+  return true;
+}
 
-  if (!surface(s, info.width, info.height)) {
-    GRAPHICS_SAFE_FREE(color_map);
-    GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+static bool bmp_open(struct bmp_t* b, const char* path) {
+  memset(b, 0, sizeof(struct bmp_t));
+  if (!(b->fp = fopen(path, "rb"))) {
+    GRAPHICS_ERROR(FILE_OPEN_FAILED, "fopen() failed: %s", path);
+    return false;
+  }
+  __fseek64(b->fp, 0, SEEK_END);
+  b->size = (long long)__ftell64(b->fp);
+  rewind(b->fp);
+  /* Big enough for the headers and a whole palette */
+  b->cap = __MAX(GRAPHICS_BMP_BUFFER, 1024);
+  if (!(b->buf = GRAPHICS_MALLOC(b->cap))) {
+    GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+    bmp_close(b);
+    return false;
+  }
+
+  if (!bmp_fill(b, 18)) {
+    GRAPHICS_ERROR(INVALID_BMP, "bmp() failed: file is too short");
+    bmp_close(b);
+    return false;
+  }
+  if (b->buf[0] != 0x42 || b->buf[1] != 0x4D) {
+    GRAPHICS_ERROR(INVALID_BMP, "bmp() failed: invalid BMP signiture '0x%x%x'", b->buf[1], b->buf[0]);
+    bmp_close(b);
+    return false;
+  }
+  b->data = __le32(b->buf + 10);
+  unsigned int hs = __le32(b->buf + 14);
+  /* OS/2 1.x headers are 12 bytes, OS/2 2.x ones anything from 16 to 64 */
+  if ((hs != 12 && hs < 16) || (hs > 64 && hs != 108 && hs != 124)) {
+    GRAPHICS_ERROR(INVALID_BMP, "bmp() failed: invalid header size %u", hs);
+    bmp_close(b);
+    return false;
+  }
+  if (!bmp_fill(b, 14 + hs)) {
+    GRAPHICS_ERROR(INVALID_BMP, "bmp() failed: file is too short");
+    bmp_close(b);
     return false;
   }
 
-  off = header.offset;
-  int i, p, x, y, sz = info.width * info.height;
-  unsigned char color;
-  switch (info.compression) {
+  unsigned char hd[124] = { 0 };
+  unsigned int planes, colours = 0, entry = 4;
+  bool os2 = hs < 40 || (hs > 40 && hs < 52) || hs == 64;
+  memcpy(hd, b->buf + 14, hs);
+  if (hs == 12) {
+    b->w = __le16(hd + 4);
+    b->h = __le16(hd + 6);
+    planes = __le16(hd + 8);
+    b->bits = __le16(hd + 10);
+    entry = 3;
+  } else {
+    b->w = (int)__le32(hd + 4);
+    b->h = (int)__le32(hd + 8);
+    planes = __le16(hd + 12);
+    b->bits = __le16(hd + 14);
+    b->compression = (int)__le32(hd + 16);
+    colours = __le32(hd + 32);
+    for (int i = 0; i < 4; ++i)
+      b->mask[i] = __le32(hd + 40 + i * 4);
+  }
+  b->pos = 14 + hs;
+
+  if (planes != 1) {
+    GRAPHICS_ERROR(INVALID_BMP, "bmp() failed: invalid number of planes %u", planes);
+    bmp_close(b);
+    return false;
+  }
+  if (b->w <= 0 || !b->h || b->h == INT_MIN) {
+    GRAPHICS_ERROR(INVALID_BMP, "bmp() failed: invalid size %dx%d", b->w, b->h);
+    bmp_close(b);
+    return false;
+  }
+  bool valid = true;
+  switch (b->compression) {
     case 0: // RGB
-      switch (info.bits) { // BPP
-        case 1:
-        case 4:
-        case 8:
-          GRAPHICS_ERROR(UNSUPPORTED_BMP, "bmp() failed. Unsupported BPP: %d", info.bits);
-          surface_destroy(s);
-          break;
-        case 24: {
-          int pad = (4 - (info.width * 3) % 4) % 4;
-          for (int j = info.height; j; --j, off += pad)
-            for (int i = 0; i < info.width; ++i, off += 3)
-              pset(s, i, j, rgb(data[off + 2], data[off + 1], data[off]));
-          break;
-        }
-        case 32:
-          for (int j = info.height; j; --j)
-            for (int i = 0; i < info.width; ++i, off += 4)
-              pset(s, i, j, rgba(data[off + 2], data[off + 1], data[off], 255 - data[off + 3]));
-          break;
-        default:
-          GRAPHICS_ERROR(UNSUPPORTED_BMP, "bmp() failed. Unsupported BPP: %d", info.bits);
-          GRAPHICS_SAFE_FREE(color_map);
-          surface_destroy(s);
-          return false;
-      }
       break;
     case 1: // RLE8
+      valid = b->bits == 8;
+      break;
     case 2: // RLE4
-    case 3: // BITFIELDS
-    case 6: // BI_ALHPABITFIELDS
+      valid = b->bits == 4;
+      break;
+    case 3: // BITFIELDS, or Huffman on OS/2
+    case 6: // ALPHABITFIELDS
+      if (!os2) {
+        valid = b->bits == 16 || b->bits == 32;
+        break;
+      }
     default:
-      GRAPHICS_ERROR(UNSUPPORTED_BMP, "bmp() failed. Unsupported compression: %d", info.compression);
-      GRAPHICS_SAFE_FREE(color_map);
-      surface_destroy(s);
+      GRAPHICS_ERROR(UNSUPPORTED_BMP, "bmp() failed. Unsupported compression: %d", b->compression);
+      bmp_close(b);
       return false;
   }
+  switch (b->bits) {
+    case 1:
+    case 2:
+    case 4:
+    case 8:
+    case 16:
+    case 24:
+    case 32:
+      break;
+    default:
+      GRAPHICS_ERROR(INVALID_BMP, "bmp() failed: invalid BPP: %d", b->bits);
+      bmp_close(b);
+      return false;
+  }
+  if (!valid) {
+    GRAPHICS_ERROR(INVALID_BMP, "bmp() failed: compression %d doesn't match BPP %d", b->compression, b->bits);
+    bmp_close(b);
+    return false;
+  }
+  if (b->h < 0 && (b->compression == 1 || b->compression == 2)) {
+    GRAPHICS_ERROR(INVALID_BMP, "bmp() failed: RLE bitmaps can't be top-down");
+    bmp_close(b);
+    return false;
+  }
+  b->top_down = b->h < 0;
+  b->h = abs(b->h);
+  b->stride = (size_t)((((long long)b->w * b->bits + 31) / 32) * 4);
+
+  /* Masks follow a plain info header */
+  if (hs == 40 && (b->compression == 3 || b->compression == 6)) {
+    int n = b->compression == 3 ? 3 : 4;
+    if (!bmp_fill(b, n * 4)) {
+      GRAPHICS_ERROR(INVALID_BMP, "bmp() failed: file is too short");
+      bmp_close(b);
+      return false;
+    }
+    for (int i = 0; i < n; ++i)
+      b->mask[i] = __le32(b->buf + b->pos + i * 4);
+    b->pos += n * 4;
+  }
+  if (b->compression != 3 && b->compression != 6) {
+    b->mask[0] = b->bits == 16 ? 0x7C00 : 0xFF0000;
+    b->mask[1] = b->bits == 16 ? 0x3E0 : 0xFF00;
+    b->mask[2] = b->bits == 16 ? 0x1F : 0xFF;
+    b->mask[3] = 0;
+  } else if (b->compression == 3 && hs < 56)
+    b->mask[3] = 0;
+
+  if (b->bits <= 8) {
+    /* Only as many entries as fit before the pixel data, the rest are black */
+    long long avail = (b->data - bmp_tell(b)) / entry;
+    long long n = colours ? colours : 1 << b->bits;
+    n = __MAX(__MIN(n, __MIN(avail, 256)), 0);
+    if (!bmp_fill(b, n * entry)) {
+      GRAPHICS_ERROR(INVALID_BMP, "bmp() failed: file is too short");
+      bmp_close(b);
+      return false;
+    }
+    for (int i = 0; i < 256; ++i) {
+      const unsigned char* p = b->buf + b->pos + (i < n ? i * entry : 0);
+      b->palette[i] = i < n ? rgb(p[2], p[1], p[0]) : rgb(0, 0, 0);
+    }
+    b->pos += n * entry;
+    b->convert = b->bits == 8 ? bmp_pal8 : bmp_pal;
+  } else if (b->bits == 24)
+    b->convert = bmp_rgb24;
+  else {
+    if (!bmp_masks(b)) {
+      bmp_close(b);
+      return false;
+    }
+    if (b->bits == 16)
+      b->convert = bmp_bf16;
+    else if (b->mask[0] == 0xFF0000 && b->mask[1] == 0xFF00 && b->mask[2] == 0xFF)
+      b->convert = !b->mask[3] ? bmp_rgb32 : b->mask[3] == 0xFF000000 ? bmp_argb32 : bmp_bf32;
+    else
+      b->convert = bmp_bf32;
+  }
 
-  GRAPHICS_SAFE_FREE(color_map);
+  if (b->data < bmp_tell(b) || b->data > b->size) {
+    GRAPHICS_ERROR(INVALID_BMP, "bmp() failed: invalid pixel data offset %lld", b->data);
+    bmp_close(b);
+    return false;
+  }
+  if (!b->compression || b->compression >= 3) {
+    if (b->stride > (size_t)INT_MAX || (long long)b->stride * b->h > b->size - b->data) {
+      GRAPHICS_ERROR(INVALID_BMP, "bmp() failed: file is truncated");
+      bmp_close(b);
+      return false;
+    }
+    if (b->stride > b->cap) {
+      unsigned char* tmp = GRAPHICS_REALLOC(b->buf, b->stride);
+      if (!tmp) {
+        GRAPHICS_ERROR(OUT_OF_MEMEORY, "realloc() failed");
+        bmp_close(b);
+        return false;
+      }
+      b->buf = tmp;
+      b->cap = b->stride;
+    }
+  }
+  bmp_seek(b, b->data);
   return true;
 }
 
-bool save_bmp(struct surface_t* s, const char* path) {
-  const int filesize = 54 + 3 * s->w * s->h;
-  unsigned char* img = GRAPHICS_MALLOC(sizeof(unsigned char) * 3 * s->w * s->h);
-  if (!img) {
+static inline void bmp_rle_put(struct bmp_t* b, int* out, int v) {
+  if (b->rle_x < b->w)
+    out[b->rle_x] = b->palette[v];
+  b->rle_x++;
+}
+
+/* Decode the RLE stream up to the end of row b->row. Pixels skipped by
+ * deltas, or cut off at the end of the file, are left transparent */
+static void bmp_rle(struct bmp_t* b, int* out) {
+  bool rle4 = b->compression == 2;
+  memset(out, 0, b->w * sizeof(int));
+  if (b->rle_done || b->rle_y > b->row)
+    return;
+  for (;;) {
+    int n = bmp_byte(b), v = bmp_byte(b);
+    if (n < 0 || v < 0) {
+      b->rle_done = true;
+      return;
+    }
+    if (n) {
+      for (int i = 0; i < n; ++i)
+        bmp_rle_put(b, out, rle4 ? (i & 1 ? v & 0xF : v >> 4) : v);
+      continue;
+    }
+    switch (v) {
+      case 0: // End of line
+        b->rle_x = 0;
+        b->rle_y++;
+        return;
+      case 1: // End of bitmap
+        b->rle_done = true;
+        return;
+      case 2: { // Delta
+        int dx = bmp_byte(b), dy = bmp_byte(b);
+        if (dx < 0 || dy < 0) {
+          b->rle_done = true;
+          return;
+        }
+        b->rle_x += dx;
+        if (dy) {
+          b->rle_y += dy;
+          return;
+        }
+        break;
+      }
+      default: { // Absolute run of v pixels, padded to a word
+        int bytes = rle4 ? (v + 1) / 2 : v, c = 0;
+        for (int i = 0; i < bytes; ++i) {
+          if ((c = bmp_byte(b)) < 0) {
+            b->rle_done = true;
+            return;
+          }
+          if (!rle4)
+            bmp_rle_put(b, out, c);
+          else {
+            bmp_rle_put(b, out, c >> 4);
+            if (i * 2 + 1 < v)
+              bmp_rle_put(b, out, c & 0xF);
+          }
+        }
+        if (bytes & 1)
+          bmp_byte(b);
+        break;
+      }
+    }
+  }
+}
+
+/* Convert the next row in file order, bottom up unless b->top_down */
+static bool bmp_row(struct bmp_t* b, int* out) {
+  if (b->compression == 1 || b->compression == 2)
+    bmp_rle(b, out);
+  else {
+    if (!bmp_fill(b, b->stride)) {
+      GRAPHICS_ERROR(INVALID_BMP, "bmp() failed: file is truncated");
+      return false;
+    }
+    b->convert(b, b->buf + b->pos, 0, b->w, out);
+    b->pos += b->stride;
+  }
+  b->row++;
+  return true;
+}
+
+bool bmp(struct surface_t* s, const char* path) {
+  struct bmp_t b;
+  if (!bmp_open(&b, path))
+    return false;
+  if ((unsigned long long)b.w * b.h > UINT_MAX / sizeof(int)) {
+    GRAPHICS_ERROR(UNSUPPORTED_BMP, "bmp() failed: %dx%d is too large", b.w, b.h);
+    bmp_close(&b);
+    return false;
+  }
+  if (!surface(s, b.w, b.h)) {
+    bmp_close(&b);
+    return false;
+  }
+  for (int i = 0; i < b.h; ++i)
+    if (!bmp_row(&b, __ROW(s, b.top_down ? i : b.h - 1 - i))) {
+      surface_destroy(s);
+      bmp_close(&b);
+      return false;
+    }
+  bmp_close(&b);
+  return true;
+}
+
+bool bmp_size(const char* path, int* w, int* h) {
+  struct bmp_t b;
+  if (!bmp_open(&b, path))
+    return false;
+  if (w)
+    *w = b.w;
+  if (h)
+    *h = b.h;
+  bmp_close(&b);
+  return true;
+}
+
+bool bmp_region(struct surface_t* s, const char* path, int x, int y, int w, int h, int reduce) {
+  if (reduce < 1 || (reduce & (reduce - 1))) {
+    GRAPHICS_ERROR(INVALID_PARAMETERS, "bmp_region() failed: reduce must be a power of two");
+    return false;
+  }
+  struct bmp_t b;
+  if (!bmp_open(&b, path))
+    return false;
+  if (x < 0) {
+    w += x;
+    x  = 0;
+  }
+  if (y < 0) {
+    h += y;
+    y  = 0;
+  }
+  if ((long long)x + w > b.w)
+    w = b.w - x;
+  if ((long long)y + h > b.h)
+    h = b.h - y;
+  if (w <= 0 || h <= 0) {
+    GRAPHICS_ERROR(INVALID_PARAMETERS, "bmp_region() failed: region is outside of image");
+    bmp_close(&b);
+    return false;
+  }
+  int ow = (w + reduce - 1) / reduce, oh = (h + reduce - 1) / reduce;
+  if ((unsigned long long)ow * oh > UINT_MAX / sizeof(int)) {
+    GRAPHICS_ERROR(UNSUPPORTED_BMP, "bmp_region() failed: %dx%d is too large", ow, oh);
+    bmp_close(&b);
+    return false;
+  }
+
+  /* RLE has to be decoded from the start, whole rows at a time */
+  bool rle = b.compression == 1 || b.compression == 2;
+  int* row = NULL;
+  if ((rle || reduce > 1) && !(row = GRAPHICS_MALLOC((rle ? b.w : w) * sizeof(int)))) {
     GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+    bmp_close(&b);
+    return false;
+  }
+  if (!surface(s, ow, oh)) {
+    GRAPHICS_SAFE_FREE(row);
+    bmp_close(&b);
     return false;
   }
-  memset(img, 0, 3 * s->w * s->h);
 
-  int i, j, y, c;
-  for (i = 0; i < s->w; ++i) {
-    for (j = s->h; j > 0; --j) {
-      y = (s->h - 1) - j;
-      c = pget(s, i, y);
-      img[(i + y * s->w) * 3 + 2] = (unsigned char)r_channel(c);
-      img[(i + y * s->w) * 3 + 1] = (unsigned char)g_channel(c);
-      img[(i + y * s->w) * 3 + 0] = (unsigned char)b_channel(c);
+  /* Bytes of each row the region covers, and the first pixel's place in the first byte */
+  long long first = (long long)x * b.bits / 8;
+  size_t span = (size_t)(((long long)(x + w) * b.bits + 7) / 8 - first);
+  int phase = (int)(((long long)x * b.bits % 8) / b.bits);
+  bool ok = true;
+  /* Rows too far apart to share a read are read on their own */
+  if (!rle && (long long)b.stride * reduce + span > (long long)b.cap)
+    b.ahead = span;
+  /* In file order, so reading only ever moves forward */
+  for (int i = 0; i < oh && ok; ++i) {
+    int j = b.top_down ? i : oh - 1 - i, sy = y + j * reduce;
+    int fr = b.top_down ? sy : b.h - 1 - sy, *out = __ROW(s, j), *src = out;
+    if (rle) {
+      while (ok && b.row <= fr)
+        ok = bmp_row(&b, row);
+      src = row + x;
+    } else {
+      bmp_seek(&b, b.data + (long long)fr * b.stride + first);
+      if (!(ok = bmp_fill(&b, span))) {
+        GRAPHICS_ERROR(INVALID_BMP, "bmp_region() failed: file is truncated");
+        break;
+      }
+      if (reduce > 1)
+        src = row;
+      b.convert(&b, b.buf + b.pos, phase, w, src);
     }
+    if (src != out)
+      for (int k = 0; k < ow; ++k)
+        out[k] = src[k * reduce];
+  }
+  GRAPHICS_SAFE_FREE(row);
+  bmp_close(&b);
+  if (!ok)
+    surface_destroy(s);
+  return ok;
+}
+
+static inline void __put_le16(unsigned char* p, unsigned int v) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+}
+
+static inline void __put_le32(unsigned char* p, unsigned int v) {
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  p[3] = (unsigned char)(v >> 24);
+}
+
+/* ARGB pixels to BGR, the SSE2 path packs four pixels into 12 bytes but
+ * stores 16, so dst needs 4 bytes to spare */
+static void bmp_pack24(const int* src, int n, unsigned char* dst) {
+  int i = 0;
+#if defined(GRAPHICS_SSE2)
+  const __m128i rgb4 = _mm_set1_epi32(0x00FFFFFF);
+  const __m128i lo = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+  const __m128i hi = _mm_set_epi32(0x0000FFFF, (int)0xFF000000, 0x0000FFFF, (int)0xFF000000);
+  const __m128i first = _mm_set_epi32(0, 0, 0x0000FFFF, -1);
+  for (; i + 4 <= n; i += 4, dst += 12) {
+    __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + i)), rgb4);
+    /* Each 64-bit lane to 6 bytes, then the lanes next to each other */
+    __m128i t = _mm_or_si128(_mm_and_si128(v, lo), _mm_and_si128(_mm_srli_epi64(v, 8), hi));
+    t = _mm_or_si128(_mm_and_si128(t, first), _mm_andnot_si128(first, _mm_srli_si128(t, 2)));
+    _mm_storeu_si128((__m128i*)dst, t);
+  }
+#endif
+  for (; i < n; ++i, dst += 3) {
+    dst[0] = (unsigned char)src[i];
+    dst[1] = (unsigned char)(src[i] >> 8);
+    dst[2] = (unsigned char)(src[i] >> 16);
   }
+}
 
-  unsigned char header[14] = {
-    'B', 'M',
-    0,  0, 0, 0,
-    0,  0,
-    0,  0,
-    54, 0, 0, 0
-  };
-  unsigned char info[40] = {
-    40, 0, 0, 0,
-    0,  0, 0, 0,
-    0,  0, 0, 0,
-    1,  0,
-    24, 0
-  };
-  unsigned char pad[3] = { 0, 0, 0 };
-
-  header[2]  = (unsigned char)(filesize);
-  header[3]  = (unsigned char)(filesize >> 8);
-  header[4]  = (unsigned char)(filesize >> 16);
-  header[5]  = (unsigned char)(filesize >> 24);
-
-  info[4]  = (unsigned char)(s->w);
-  info[5]  = (unsigned char)(s->w >> 8);
-  info[6]  = (unsigned char)(s->w >> 16);
-  info[7]  = (unsigned char)(s->w >> 24);
-  info[8]  = (unsigned char)(s->h);
-  info[9]  = (unsigned char)(s->h >> 8);
-  info[10] = (unsigned char)(s->h >> 16);
-  info[11] = (unsigned char)(s->h >> 24);
+static bool bmp_write(FILE* fp, const void* p, size_t n, const char* path) {
+  if (fwrite(p, 1, n, fp) == n)
+    return true;
+  GRAPHICS_ERROR(UNKNOWN_ERROR, "fwrite() failed: %s", path);
+  return false;
+}
+
+bool save_bmp_ex(struct surface_t* s, const char* path, int flags) {
+  bool alpha = flags & BMP_ALPHA, top_down = flags & BMP_TOP_DOWN;
+  unsigned int hs = alpha ? 108 : 40;
+  size_t stride = ((size_t)s->w * (alpha ? 4 : 3) + 3) & ~(size_t)3;
+  unsigned long long size = 14 + hs + (unsigned long long)stride * s->h;
+  if (s->w <= 0 || s->h <= 0 || size > UINT_MAX) {
+    GRAPHICS_ERROR(INVALID_PARAMETERS, "save_bmp() failed: invalid size %dx%d", s->w, s->h);
+    return false;
+  }
+
+  unsigned char header[14 + 108] = { 'B', 'M' };
+  __put_le32(header + 2, (unsigned int)size);
+  __put_le32(header + 10, 14 + hs);
+  unsigned char* info = header + 14;
+  __put_le32(info, hs);
+  __put_le32(info + 4, s->w);
+  __put_le32(info + 8, top_down ? -s->h : s->h);
+  __put_le16(info + 12, 1);
+  __put_le16(info + 14, alpha ? 32 : 24);
+  __put_le32(info + 20, (unsigned int)(size - 14 - hs));
+  __put_le32(info + 24, 2835); // 72 DPI
+  __put_le32(info + 28, 2835);
+  if (alpha) {
+    /* BITMAPV4HEADER, BITFIELDS with an alpha mask in sRGB */
+    __put_le32(info + 16, 3);
+    __put_le32(info + 40, 0x00FF0000);
+    __put_le32(info + 44, 0x0000FF00);
+    __put_le32(info + 48, 0x000000FF);
+    __put_le32(info + 52, 0xFF000000);
+    __put_le32(info + 56, 0x73524742); // 'sRGB'
+  }
 
   FILE* fp = fopen(path, "wb");
   if (!fp) {
     GRAPHICS_ERROR(FILE_OPEN_FAILED, "fopen() failed: %s", path);
-    GRAPHICS_SAFE_FREE(img);
     return false;
   }
+  bool ok = bmp_write(fp, header, 14 + hs, path);
+  const int one = 1;
+  if (alpha && *(const char*)&one) {
+    /* Rows are already BGRA, written straight from the surface */
+    if (top_down && s->pitch == s->w)
+      ok = ok && bmp_write(fp, s->buf, stride * s->h, path);
+    else
+      for (int i = 0; i < s->h && ok; ++i)
+        ok = bmp_write(fp, __ROW(s, top_down ? i : s->h - 1 - i), stride, path);
+    fclose(fp);
+    return ok;
+  }
 
-  int padding = (4 - (s->w * 3) % 4) % 4;
-  fwrite(header, 1, 14, fp);
-  fwrite(info, 1, 40, fp);
-  for(i = 0; i < s->h; ++i) {
-    fwrite(img + (s->w * (s->h - i - 1) * 3), 3, s->w, fp);
-    fwrite(pad, 1, padding, fp);
+  /* Converted a block of rows at a time */
+  size_t cap = __MAX((size_t)GRAPHICS_BMP_BUFFER, stride), fill = 0;
+  unsigned char* block = GRAPHICS_MALLOC(cap + 16);
+  if (!block) {
+    GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+    fclose(fp);
+    return false;
   }
-  
+  for (int i = 0; i < s->h && ok; ++i) {
+    const int* row = __ROW(s, top_down ? i : s->h - 1 - i);
+    unsigned char* dst = block + fill;
+    if (alpha)
+      for (int x = 0; x < s->w; ++x)
+        __put_le32(dst + x * 4, (unsigned int)row[x]);
+    else {
+      bmp_pack24(row, s->w, dst);
+      memset(dst + (size_t)s->w * 3, 0, stride - (size_t)s->w * 3);
+    }
+    if ((fill += stride) + stride > cap) {
+      ok = bmp_write(fp, block, fill, path);
+      fill = 0;
+    }
+  }
+  if (ok && fill)
+    ok = bmp_write(fp, block, fill, path);
+  GRAPHICS_SAFE_FREE(block);
   fclose(fp);
-  GRAPHICS_SAFE_FREE(img);
-  return true;
+  return ok;
+}
+
+bool save_bmp(struct surface_t* s, const char* path) {
+  return save_bmp_ex(s, path, 0);
 }
 
 static unsigned char font[540][8] = {
@@ -1356,103 +3395,1912 @@ static inline int letter_index(int c) {
         return 530 + i;
     return 0;
   }
-}
+}
+
+/* Draw each row of a glyph as runs of foreground and background pixels,
+ * inside a clip rect [cx0, cx1) x [cy0, cy1) looked up by the caller */
+static inline void glyph(struct surface_t* s, int c, int x, int y, int fg, int bg, bool draw_bg, int cx0, int cy0, int cx1, int cy1) {
+  int i, j, k, u, v;
+  bool on;
+  if (x >= cx1 || y >= cy1 || (long long)x + 8 <= cx0 || (long long)y + 8 <= cy0)
+    return;
+  __damage(s, __MAX(x, cx0), __MAX(y, cy0), (int)__MIN((long long)x + 8, cx1), (int)__MIN((long long)y + 8, cy1));
+  for (i = __MAX(cy0 - y, 0); i < 8 && y + i < cy1; ++i) {
+    for (j = 0; j < 8; j = k) {
+      on = font[c][i] & 1 << j;
+      for (k = j + 1; k < 8 && !!(font[c][i] & 1 << k) == on; ++k);
+      if (!on && !draw_bg)
+        continue;
+      u = __MAX(x + j, cx0);
+      v = __MIN(x + k, cx1);
+      if (u < v)
+        __span(s, u, y + i, v - u, on ? fg : bg);
+    }
+  }
+}
+
+void ascii(struct surface_t* s, unsigned char ch, int x, int y, int fg, int bg) {
+  int cx0, cy0, cx1, cy1;
+  if (__clip_rect(s, &cx0, &cy0, &cx1, &cy1))
+    glyph(s, letter_index((int)ch), x, y, fg, bg, bg != -1, cx0, cy0, cx1, cy1);
+}
+
+int character(struct surface_t* s, const char* ch, int x, int y, int fg, int bg) {
+  int u = -1, cx0, cy0, cx1, cy1;
+  int l = ctoi(ch, &u);
+  if (__clip_rect(s, &cx0, &cy0, &cx1, &cy1))
+    glyph(s, letter_index(u), x, y, fg, bg, true, cx0, cy0, cx1, cy1);
+  return l;
+}
+
+void writeln(struct surface_t* s, int x, int y, int fg, int bg, const char* str) {
+  const char* c = str;
+  int u = x, v = y, w, cx0, cy0, cx1, cy1;
+  if (!__clip_rect(s, &cx0, &cy0, &cx1, &cy1))
+    return;
+  while (c && *c != '\0')
+    switch (*c) {
+      case '\n':
+        v += LINE_HEIGHT;
+        u  = x;
+        c++;
+        break;
+      default:
+        w = -1;
+        c += ctoi(c, &w);
+        glyph(s, letter_index(w), u, v, fg, bg, true, cx0, cy0, cx1, cy1);
+        u += 8;
+        break;
+    }
+}
+
+void writelnf(struct surface_t* s, int x, int y, int fg, int bg, const char* fmt, ...) {
+  char* buffer = NULL;
+  int buffer_size = 0;
+
+  va_list argptr;
+  va_start(argptr, fmt);
+  int length = vsnprintf(buffer, buffer_size, fmt, argptr);
+  va_end(argptr);
+
+  if (length + 1 > buffer_size) {
+    buffer_size = length + 1;
+    buffer = GRAPHICS_REALLOC(buffer, buffer_size);
+    va_start(argptr, fmt);
+    vsnprintf(buffer, buffer_size, fmt, argptr);
+    va_end(argptr);
+  }
+
+  writeln(s, x, y, fg, bg, buffer);
+  GRAPHICS_SAFE_FREE(buffer);
+}
+
+void string(struct surface_t* s, int fg, int bg, const char* str) {
+    int w, h;
+  str_size(str, &w, &h);
+  surface(s, w * 8, h * LINE_HEIGHT);
+  fill(s, (bg == -1 ? 0 : bg));
+  writeln(s, 0, 0, fg, bg, str);
+}
+
+void stringf(struct surface_t* s, int fg, int bg, const char* fmt, ...) {
+    unsigned char* buffer = NULL;
+  int buffer_size = 0;
+
+  va_list argptr;
+  va_start(argptr, fmt);
+  int length = vsnprintf((char*)buffer, buffer_size, fmt, argptr);
+  va_end(argptr);
+
+  if (length + 1 > buffer_size) {
+    buffer_size = length + 1;
+    buffer = GRAPHICS_REALLOC(buffer, buffer_size);
+    va_start(argptr, fmt);
+    vsnprintf((char*)buffer, buffer_size, fmt, argptr);
+    va_end(argptr);
+  }
+
+  string(s, fg, bg, (char*)buffer);
+  GRAPHICS_SAFE_FREE(buffer);
+}
+
+#if !defined(GRAPHICS_NO_THREADS)
+#if defined(GRAPHICS_WINDOWS)
+typedef HANDLE thread_handle_t;
+typedef CRITICAL_SECTION thread_mutex_t;
+typedef CONDITION_VARIABLE thread_cond_t;
+#define thread_mutex_init(m) InitializeCriticalSection(m)
+#define thread_mutex_destroy(m) DeleteCriticalSection(m)
+#define thread_mutex_lock(m) EnterCriticalSection(m)
+#define thread_mutex_unlock(m) LeaveCriticalSection(m)
+#define thread_cond_init(c) InitializeConditionVariable(c)
+#define thread_cond_destroy(c)
+#define thread_cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define thread_cond_signal(c) WakeConditionVariable(c)
+#define thread_cond_broadcast(c) WakeAllConditionVariable(c)
+#define thread_atomic_inc(p) (InterlockedIncrement((volatile LONG*)(p)) - 1)
+#define thread_atomic_swap(p, v) InterlockedExchange((volatile LONG*)(p), (v))
+#define thread_atomic_load(p) InterlockedCompareExchange((volatile LONG*)(p), 0, 0)
+#define thread_barrier() MemoryBarrier()
+#define thread_yield() Sleep(0)
+#else
+typedef pthread_t thread_handle_t;
+typedef pthread_mutex_t thread_mutex_t;
+typedef pthread_cond_t thread_cond_t;
+#define thread_mutex_init(m) pthread_mutex_init(m, NULL)
+#define thread_mutex_destroy(m) pthread_mutex_destroy(m)
+#define thread_mutex_lock(m) pthread_mutex_lock(m)
+#define thread_mutex_unlock(m) pthread_mutex_unlock(m)
+#define thread_cond_init(c) pthread_cond_init(c, NULL)
+#define thread_cond_destroy(c) pthread_cond_destroy(c)
+#define thread_cond_wait(c, m) pthread_cond_wait(c, m)
+#define thread_cond_signal(c) pthread_cond_signal(c)
+#define thread_cond_broadcast(c) pthread_cond_broadcast(c)
+#define thread_atomic_inc(p) __sync_fetch_and_add((p), 1)
+#define thread_atomic_swap(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define thread_atomic_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define thread_barrier() __sync_synchronize()
+#define thread_yield() sched_yield()
+#endif
+
+struct thread_start_t {
+  void(*fn)(void*);
+  void* arg;
+};
+
+#if defined(GRAPHICS_WINDOWS)
+static DWORD WINAPI thread_entry(LPVOID arg) {
+#else
+static void* thread_entry(void* arg) {
+#endif
+  struct thread_start_t start = *(struct thread_start_t*)arg;
+  GRAPHICS_FREE(arg);
+  start.fn(start.arg);
+  return 0;
+}
+
+static bool thread_create(thread_handle_t* t, void(*fn)(void*), void* arg) {
+  struct thread_start_t* start = GRAPHICS_MALLOC(sizeof(struct thread_start_t));
+  if (!start)
+    return false;
+  start->fn = fn;
+  start->arg = arg;
+#if defined(GRAPHICS_WINDOWS)
+  if ((*t = CreateThread(NULL, 0, thread_entry, start, 0, NULL)))
+    return true;
+#else
+  if (!pthread_create(t, NULL, thread_entry, start))
+    return true;
+#endif
+  GRAPHICS_FREE(start);
+  return false;
+}
+
+static void thread_join(thread_handle_t t) {
+#if defined(GRAPHICS_WINDOWS)
+  WaitForSingleObject(t, INFINITE);
+  CloseHandle(t);
+#else
+  pthread_join(t, NULL);
+#endif
+}
+#else
+#define thread_atomic_inc(p) ((*(p))++)
+#endif
+
+static int thread_cpu_count(void) {
+#if defined(GRAPHICS_NO_THREADS)
+  return 1;
+#elif defined(GRAPHICS_WINDOWS)
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+#endif
+}
+
+/* A lazily created pool of cpu count - 1 workers, the calling thread always
+ * takes part in a job so a single core machine never spawns anything. Only one
+ * job runs at a time, and jobs started from inside a job run on the caller */
+#if !defined(GRAPHICS_NO_THREADS)
+static struct {
+  thread_handle_t* threads;
+  int count, slots, pending;
+  unsigned int generation;
+  volatile int once;
+  volatile bool ready;
+  bool quit;
+  void(*job)(void*);
+  void* arg;
+  thread_mutex_t lock, run_lock;
+  thread_cond_t wake, done;
+} pool;
+static GRAPHICS_THREAD_LOCAL bool pool_worker = false;
+
+static void thread_pool_worker(void* arg) {
+  unsigned int seen = 0;
+  pool_worker = true;
+  thread_mutex_lock(&pool.lock);
+  for (;;) {
+    while (pool.generation == seen && !pool.quit)
+      thread_cond_wait(&pool.wake, &pool.lock);
+    if (pool.quit)
+      break;
+    seen = pool.generation;
+    if (pool.slots <= 0)
+      continue;
+    pool.slots--;
+    thread_mutex_unlock(&pool.lock);
+    pool.job(pool.arg);
+    thread_mutex_lock(&pool.lock);
+    if (!--pool.pending)
+      thread_cond_signal(&pool.done);
+  }
+  thread_mutex_unlock(&pool.lock);
+}
+
+static void thread_pool_init(void) {
+  while (!pool.ready) {
+    if (thread_atomic_inc(&pool.once)) {
+      /* Another thread is creating the pool */
+      thread_yield();
+      continue;
+    }
+
+    thread_mutex_init(&pool.lock);
+    thread_mutex_init(&pool.run_lock);
+    thread_cond_init(&pool.wake);
+    thread_cond_init(&pool.done);
+    int n = thread_cpu_count() - 1;
+    if (n > 0 && (pool.threads = GRAPHICS_MALLOC(n * sizeof(thread_handle_t))))
+      for (; pool.count < n; pool.count++)
+        if (!thread_create(&pool.threads[pool.count], thread_pool_worker, NULL))
+          break;
+    thread_barrier();
+    pool.ready = true;
+  }
+}
+
+#endif
+
+static void thread_pool_destroy(void) {
+#if !defined(GRAPHICS_NO_THREADS)
+  if (!pool.ready)
+    return;
+  thread_mutex_lock(&pool.lock);
+  pool.quit = true;
+  thread_cond_broadcast(&pool.wake);
+  thread_mutex_unlock(&pool.lock);
+  for (int i = 0; i < pool.count; ++i)
+    thread_join(pool.threads[i]);
+  GRAPHICS_SAFE_FREE(pool.threads);
+  thread_cond_destroy(&pool.wake);
+  thread_cond_destroy(&pool.done);
+  thread_mutex_destroy(&pool.lock);
+  thread_mutex_destroy(&pool.run_lock);
+  memset(&pool, 0, sizeof(pool));
+#endif
+}
+
+/* Run fn(arg) on up to n threads at once, including the caller */
+static void thread_pool_run(void(*fn)(void*), void* arg, int n) {
+#if !defined(GRAPHICS_NO_THREADS)
+  if (n > 1 && !pool_worker) {
+    thread_pool_init();
+    thread_mutex_lock(&pool.run_lock);
+    thread_mutex_lock(&pool.lock);
+    pool.job = fn;
+    pool.arg = arg;
+    pool.slots = pool.pending = __MIN(n - 1, pool.count);
+    pool.generation++;
+    thread_cond_broadcast(&pool.wake);
+    thread_mutex_unlock(&pool.lock);
+
+    pool_worker = true;
+    fn(arg);
+    pool_worker = false;
+
+    thread_mutex_lock(&pool.lock);
+    while (pool.pending)
+      thread_cond_wait(&pool.done, &pool.lock);
+    thread_mutex_unlock(&pool.lock);
+    thread_mutex_unlock(&pool.run_lock);
+    return;
+  }
+#else
+  (void)n;
+#endif
+  fn(arg);
+}
+
+#if !defined(GRAPHICS_PNG_BAND)
+#define GRAPHICS_PNG_BAND 262144
+#endif
+#define PNG_WINDOW 32768
+#define PNG_HASH_BITS 15
+#define PNG_BLOCK 16384
+
+/* PNG rows are filtered and deflated in bands of about GRAPHICS_PNG_BAND
+ * bytes, each compressed on its own so they can run on the thread pool. A
+ * band is primed with the window of filtered rows before it, so matches still
+ * reach back across the seam, and ends byte aligned - the zlib stream is just
+ * the bands one after another, each written as its own IDAT chunk */
+static unsigned int png_crc_table[8][256];
+static unsigned char png_len_sym[259];
+static unsigned char png_dist_sym[512];
+static volatile int png_once = 0;
+static volatile bool png_ready = false;
+
+static const unsigned short png_len_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const unsigned char png_len_extra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const unsigned short png_dist_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const unsigned char png_dist_extra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const unsigned char png_cl_order[19] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* Match finder settings per level, the same trade-offs zlib makes. Levels
+ * with no lazy length take the first match they find */
+static const struct {
+  unsigned short good, lazy, nice, chain;
+} png_levels[10] = {
+  { 0, 0, 0, 0 },
+  { 4, 0, 8, 4 },
+  { 4, 0, 16, 8 },
+  { 4, 0, 32, 32 },
+  { 4, 4, 16, 16 },
+  { 8, 16, 32, 32 },
+  { 8, 16, 128, 128 },
+  { 8, 32, 128, 256 },
+  { 32, 128, 258, 1024 },
+  { 32, 258, 258, 4096 }
+};
+
+static void png_init(void) {
+  while (!png_ready) {
+    if (thread_atomic_inc(&png_once)) {
+#if !defined(GRAPHICS_NO_THREADS)
+      thread_yield();
+#endif
+      continue;
+    }
+
+    for (unsigned int i = 0; i < 256; ++i) {
+      unsigned int c = i;
+      for (int k = 0; k < 8; ++k)
+        c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      png_crc_table[0][i] = c;
+    }
+    for (int t = 1; t < 8; ++t)
+      for (int i = 0; i < 256; ++i)
+        png_crc_table[t][i] = (png_crc_table[t - 1][i] >> 8) ^ png_crc_table[0][png_crc_table[t - 1][i] & 0xFF];
+    for (int c = 0; c < 29; ++c)
+      for (int l = png_len_base[c]; l < png_len_base[c] + (1 << png_len_extra[c]) && l <= 258; ++l)
+        png_len_sym[l] = (unsigned char)c;
+    for (int c = 0; c < 30; ++c)
+      for (int d = png_dist_base[c]; d < png_dist_base[c] + (1 << png_dist_extra[c]); ++d)
+        png_dist_sym[d <= 256 ? d - 1 : 256 + ((d - 1) >> 7)] = (unsigned char)c;
+#if !defined(GRAPHICS_NO_THREADS)
+    thread_barrier();
+#endif
+    png_ready = true;
+  }
+}
+
+#define PNG_DIST_SYM(d) ((d) <= 256 ? png_dist_sym[(d) - 1] : png_dist_sym[256 + (((d) - 1) >> 7)])
+
+static inline void __put_be32(unsigned char* p, unsigned int v) {
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
+}
+
+/* Slicing-by-8, c is the running register (start with 0xFFFFFFFF, invert at the end) */
+static unsigned int png_crc(unsigned int c, const unsigned char* p, size_t n) {
+  for (; n >= 8; n -= 8, p += 8) {
+    c ^= (unsigned int)p[0] | (unsigned int)p[1] << 8 | (unsigned int)p[2] << 16 | (unsigned int)p[3] << 24;
+    c = png_crc_table[7][c & 0xFF] ^ png_crc_table[6][(c >> 8) & 0xFF] ^
+        png_crc_table[5][(c >> 16) & 0xFF] ^ png_crc_table[4][c >> 24] ^
+        png_crc_table[3][p[4]] ^ png_crc_table[2][p[5]] ^
+        png_crc_table[1][p[6]] ^ png_crc_table[0][p[7]];
+  }
+  while (n--)
+    c = png_crc_table[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
+  return c;
+}
+
+static unsigned int png_adler(unsigned int adler, const unsigned char* p, size_t n) {
+  unsigned int a = adler & 0xFFFF, b = adler >> 16;
+  while (n) {
+    /* 5552 is the most bytes that can be summed before b overflows */
+    size_t k = __MIN(n, (size_t)5552);
+    n -= k;
+    for (; k >= 4; k -= 4, p += 4) {
+      a += p[0];
+      b += a;
+      a += p[1];
+      b += a;
+      a += p[2];
+      b += a;
+      a += p[3];
+      b += a;
+    }
+    while (k--) {
+      a += *p++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return a | b << 16;
+}
+
+/* Adler-32 of two buffers one after the other, given the length of the second */
+static unsigned int png_adler_combine(unsigned int a1, unsigned int a2, size_t n2) {
+  unsigned long long base = 65521, rem = n2 % base;
+  unsigned long long s1 = a1 & 0xFFFF, s2 = rem * s1 % base;
+  unsigned long long sum1 = s1 + (a2 & 0xFFFF) + base - 1;
+  unsigned long long sum2 = (a1 >> 16) + (a2 >> 16) + base - rem + s2;
+  if (sum1 >= base)
+    sum1 -= base;
+  if (sum1 >= base)
+    sum1 -= base;
+  if (sum2 >= base << 1)
+    sum2 -= base << 1;
+  if (sum2 >= base)
+    sum2 -= base;
+  return (unsigned int)(sum1 | sum2 << 16);
+}
+
+struct png_bits_t {
+  unsigned char* buf;
+  size_t len, cap;
+  unsigned long long acc;
+  int count;
+};
+
+static bool png_reserve(struct png_bits_t* b, size_t n) {
+  if (b->len + n + 8 <= b->cap)
+    return true;
+  size_t cap = __MAX(b->cap * 2, b->len + n + 8);
+  unsigned char* buf = GRAPHICS_REALLOC(b->buf, cap);
+  if (!buf)
+    return false;
+  b->buf = buf;
+  b->cap = cap;
+  return true;
+}
+
+/* Bits go out LSB first, a word at a time. n is at most 16 */
+static inline void png_put(struct png_bits_t* b, unsigned int v, int n) {
+  b->acc |= (unsigned long long)v << b->count;
+  if ((b->count += n) >= 32) {
+    __put_le32(b->buf + b->len, (unsigned int)b->acc);
+    b->len += 4;
+    b->acc >>= 32;
+    b->count -= 32;
+  }
+}
+
+static void png_align(struct png_bits_t* b) {
+  for (; b->count > 0; b->count -= 8, b->acc >>= 8)
+    b->buf[b->len++] = (unsigned char)b->acc;
+  b->acc = 0;
+  b->count = 0;
+}
+
+/* Code lengths no longer than limit. Built with the two queue method from
+ * sorted weights, halving the weights until the tree is shallow enough */
+static void png_huffman(const unsigned int* freq, int n, int limit, unsigned char* lens) {
+  int sym[286], parent[2 * 286], m = 0;
+  unsigned int w[2 * 286];
+  unsigned char depth[2 * 286];
+  memset(lens, 0, n);
+  for (int i = 0; i < n; ++i)
+    if (freq[i]) {
+      int j = m++;
+      for (; j > 0 && freq[sym[j - 1]] > freq[i]; --j)
+        sym[j] = sym[j - 1];
+      sym[j] = i;
+    }
+  if (m < 2) {
+    /* A lone code still needs a complete tree for some decoders */
+    int a = m ? sym[0] : 0;
+    lens[a] = 1;
+    lens[a ? 0 : 1] = 1;
+    return;
+  }
+
+  for (int i = 0; i < m; ++i)
+    w[i] = freq[sym[i]];
+  for (;;) {
+    int leaf = 0, node = m, max = 0;
+    for (int k = m; k < 2 * m - 1; ++k) {
+      int a = leaf < m && (node >= k || w[leaf] <= w[node]) ? leaf++ : node++;
+      int b = leaf < m && (node >= k || w[leaf] <= w[node]) ? leaf++ : node++;
+      w[k] = w[a] + w[b];
+      parent[a] = parent[b] = k;
+    }
+    depth[2 * m - 2] = 0;
+    for (int k = 2 * m - 3; k >= 0; --k)
+      depth[k] = depth[parent[k]] + 1;
+    for (int i = 0; i < m; ++i)
+      max = __MAX(max, depth[i]);
+    if (max <= limit) {
+      for (int i = 0; i < m; ++i)
+        lens[sym[i]] = depth[i];
+      return;
+    }
+    for (int i = 0; i < m; ++i)
+      w[i] = (w[i] + 1) >> 1;
+  }
+}
+
+/* Canonical codes, bit reversed to be written LSB first */
+static void png_codes(const unsigned char* lens, int n, unsigned short* codes) {
+  unsigned int count[16] = { 0 }, next[16], code = 0;
+  for (int i = 0; i < n; ++i)
+    count[lens[i]]++;
+  count[0] = 0;
+  for (int b = 1; b < 16; ++b)
+    next[b] = code = (code + count[b - 1]) << 1;
+  for (int i = 0; i < n; ++i)
+    if (lens[i]) {
+      unsigned int c = next[lens[i]]++, r = 0;
+      for (int k = 0; k < lens[i]; ++k, c >>= 1)
+        r = r << 1 | (c & 1);
+      codes[i] = (unsigned short)r;
+    }
+}
+
+struct png_deflate_t {
+  const unsigned char* data;
+  size_t end, block;
+  int good, lazy, nice, chain;
+  int head[1 << PNG_HASH_BITS], prev[PNG_WINDOW];
+  /* Literals are the byte, copies are length << 16 | distance */
+  unsigned int syms[PNG_BLOCK + 2], lfreq[286], dfreq[30];
+  int count;
+  struct png_bits_t out;
+};
+
+static inline unsigned int png_hash(const unsigned char* p) {
+  return ((unsigned int)p[0] << 16 | (unsigned int)p[1] << 8 | p[2]) * 2654435761u >> (32 - PNG_HASH_BITS);
+}
+
+/* Add position i to the hash chains, returning the previous head */
+static inline int png_insert(struct png_deflate_t* d, size_t i) {
+  unsigned int h = png_hash(d->data + i);
+  int cand = d->head[h];
+  d->prev[i & (PNG_WINDOW - 1)] = cand;
+  d->head[h] = (int)i;
+  return cand;
+}
+
+static inline int png_match_len(const unsigned char* a, const unsigned char* b, int limit) {
+  int n = 0;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for (; n + 8 <= limit; n += 8) {
+    unsigned long long x, y;
+    memcpy(&x, a + n, 8);
+    memcpy(&y, b + n, 8);
+    if (x != y)
+      return n + (__builtin_ctzll(x ^ y) >> 3);
+  }
+#endif
+  while (n < limit && a[n] == b[n])
+    ++n;
+  return n;
+}
+
+/* Longest match at pos longer than best, 0 if there isn't one */
+static int png_match(struct png_deflate_t* d, size_t pos, int cand, int best, int* dist) {
+  const unsigned char* p = d->data + pos;
+  int limit = (int)__MIN(d->end - pos, (size_t)258), chain = d->chain, found = 0;
+  if (best >= d->good)
+    chain >>= 2;
+  while (best < limit && cand >= 0 && pos - cand <= PNG_WINDOW && chain-- > 0) {
+    const unsigned char* q = d->data + cand;
+    if (q[best] == p[best] && q[0] == p[0] && q[1] == p[1]) {
+      int n = png_match_len(p, q, limit);
+      if (n > best) {
+        best = found = n;
+        *dist = (int)(pos - cand);
+        if (n >= d->nice)
+          break;
+      }
+    }
+    /* Entries are overwritten once they leave the window */
+    int next = d->prev[cand & (PNG_WINDOW - 1)];
+    if (next >= cand)
+      break;
+    cand = next;
+  }
+  return found;
+}
+
+static inline void png_literal(struct png_deflate_t* d, unsigned char c) {
+  d->syms[d->count++] = c;
+  d->lfreq[c]++;
+}
+
+static inline void png_copy(struct png_deflate_t* d, int len, int dist) {
+  d->syms[d->count++] = (unsigned int)len << 16 | (unsigned int)dist;
+  d->lfreq[257 + png_len_sym[len]]++;
+  d->dfreq[PNG_DIST_SYM(dist)]++;
+}
+
+/* Start the next block at end */
+static void png_reset(struct png_deflate_t* d, size_t end) {
+  d->count = 0;
+  d->block = end;
+  memset(d->lfreq, 0, sizeof(d->lfreq));
+  memset(d->dfreq, 0, sizeof(d->dfreq));
+}
+
+static bool png_stored(struct png_deflate_t* d, size_t end, bool last) {
+  size_t n = end - d->block;
+  const unsigned char* p = d->data + d->block;
+  if (!png_reserve(&d->out, n + 10 * (n / 65535 + 1) + 8))
+    return false;
+  do {
+    size_t k = __MIN(n, (size_t)65535);
+    n -= k;
+    png_put(&d->out, last && !n, 3);
+    png_align(&d->out);
+    __put_le16(d->out.buf + d->out.len, (unsigned int)k);
+    __put_le16(d->out.buf + d->out.len + 2, (unsigned int)~k & 0xFFFF);
+    memcpy(d->out.buf + d->out.len + 4, p, k);
+    d->out.len += k + 4;
+    p += k;
+  } while (n);
+  png_reset(d, end);
+  return true;
+}
+
+/* Write the symbols so far as one block, whichever of dynamic codes, the
+ * fixed codes or storing input [block, end) is smallest */
+static bool png_block(struct png_deflate_t* d, size_t end, bool last) {
+  unsigned char llen[286], dlen[30], clen[19], all[286 + 30], fixed[288];
+  unsigned short lcode[288], dcode[30], ccode[19], cl[286 + 30];
+  unsigned int cfreq[19] = { 0 };
+  int hlit = 286, hdist = 30, hclen = 19, ncl = 0;
+  unsigned long long extra = 0, dyn = 17, fix = 3, stored;
+
+  d->lfreq[256] = 1;
+  png_huffman(d->lfreq, 286, 15, llen);
+  png_huffman(d->dfreq, 30, 15, dlen);
+  while (hlit > 257 && !llen[hlit - 1])
+    hlit--;
+  while (hdist > 1 && !dlen[hdist - 1])
+    hdist--;
+
+  /* Run length code the code lengths, extra bits in the high byte */
+  memcpy(all, llen, hlit);
+  memcpy(all + hlit, dlen, hdist);
+  for (int i = 0, total = hlit + hdist; i < total;) {
+    int v = all[i], run = 1;
+    while (i + run < total && all[i + run] == v)
+      run++;
+    i += run;
+    if (!v)
+      for (; run >= 3; run -= __MIN(run, 138))
+        cl[ncl++] = run >= 11 ? 18 | (__MIN(run, 138) - 11) << 8 : 17 | (run - 3) << 8;
+    else {
+      cl[ncl++] = v;
+      for (run--; run >= 3; run -= __MIN(run, 6))
+        cl[ncl++] = 16 | (__MIN(run, 6) - 3) << 8;
+    }
+    for (; run > 0; run--)
+      cl[ncl++] = v;
+  }
+  for (int i = 0; i < ncl; ++i)
+    cfreq[cl[i] & 0xFF]++;
+  png_huffman(cfreq, 19, 7, clen);
+  while (hclen > 4 && !clen[png_cl_order[hclen - 1]])
+    hclen--;
+
+  for (int c = 0; c < 29; ++c)
+    extra += (unsigned long long)d->lfreq[257 + c] * png_len_extra[c];
+  for (int c = 0; c < 30; ++c) {
+    extra += (unsigned long long)d->dfreq[c] * png_dist_extra[c];
+    dyn += (unsigned long long)d->dfreq[c] * dlen[c];
+    fix += (unsigned long long)d->dfreq[c] * 5;
+  }
+  for (int i = 0; i < 288; ++i)
+    fixed[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+  for (int i = 0; i < 286; ++i) {
+    dyn += (unsigned long long)d->lfreq[i] * llen[i];
+    fix += (unsigned long long)d->lfreq[i] * fixed[i];
+  }
+  dyn += 3 * hclen + cfreq[16] * 2 + cfreq[17] * 3 + cfreq[18] * 7 + extra;
+  for (int i = 0; i < 19; ++i)
+    dyn += (unsigned long long)cfreq[i] * clen[i];
+  fix += extra;
+  stored = ((end - d->block) + 5 * ((end - d->block) / 65535 + 1)) * 8 + 7;
+
+  if (stored <= dyn && stored <= fix)
+    return png_stored(d, end, last);
+  if (!png_reserve(&d->out, __MIN(dyn, fix) / 8 + 16))
+    return false;
+  if (fix <= dyn) {
+    /* Codes 286 and 287 never appear but still count towards the fixed code */
+    memcpy(llen, fixed, 286);
+    memset(dlen, 5, 30);
+    png_codes(fixed, 288, lcode);
+    png_put(&d->out, last | 2, 3);
+  } else {
+    png_codes(llen, 286, lcode);
+    png_codes(clen, 19, ccode);
+    png_put(&d->out, last | 4, 3);
+    png_put(&d->out, hlit - 257, 5);
+    png_put(&d->out, hdist - 1, 5);
+    png_put(&d->out, hclen - 4, 4);
+    for (int i = 0; i < hclen; ++i)
+      png_put(&d->out, clen[png_cl_order[i]], 3);
+    for (int i = 0; i < ncl; ++i) {
+      int c = cl[i] & 0xFF;
+      png_put(&d->out, ccode[c], clen[c]);
+      if (c >= 16)
+        png_put(&d->out, cl[i] >> 8, c == 16 ? 2 : c == 17 ? 3 : 7);
+    }
+  }
+  png_codes(dlen, 30, dcode);
+
+  for (int i = 0; i < d->count; ++i) {
+    unsigned int v = d->syms[i];
+    if (!(v >> 16)) {
+      png_put(&d->out, lcode[v], llen[v]);
+      continue;
+    }
+    int len = v >> 16, dist = v & 0xFFFF, c = png_len_sym[len], dc = PNG_DIST_SYM(dist);
+    png_put(&d->out, lcode[257 + c], llen[257 + c]);
+    if (png_len_extra[c])
+      png_put(&d->out, len - png_len_base[c], png_len_extra[c]);
+    png_put(&d->out, dcode[dc], dlen[dc]);
+    if (png_dist_extra[dc])
+      png_put(&d->out, dist - png_dist_base[dc], png_dist_extra[dc]);
+  }
+  png_put(&d->out, lcode[256], llen[256]);
+  png_reset(d, end);
+  return true;
+}
+
+/* Compress data[start, end), data[0, start) is the dictionary */
+static bool png_deflate(struct png_deflate_t* d, size_t start, int level, bool last) {
+  size_t pos = start, end = d->end;
+  if (!level)
+    return png_stored(d, end, last);
+
+  d->good = png_levels[level].good;
+  d->lazy = png_levels[level].lazy;
+  d->nice = png_levels[level].nice;
+  d->chain = png_levels[level].chain;
+  memset(d->head, 0xFF, sizeof(d->head));
+  for (size_t i = start > PNG_WINDOW ? start - PNG_WINDOW : 0; i < start && i + 3 <= end; ++i)
+    png_insert(d, i);
+
+  if (!d->lazy) {
+    while (pos < end) {
+      int len = 0, dist = 0;
+      if (pos + 3 <= end)
+        len = png_match(d, pos, png_insert(d, pos), 2, &dist);
+      if (len) {
+        png_copy(d, len, dist);
+        /* Long matches aren't worth indexing at the fast levels */
+        if (len <= d->nice)
+          for (size_t i = pos + 1; i < pos + len && i + 3 <= end; ++i)
+            png_insert(d, i);
+        pos += len;
+      } else
+        png_literal(d, d->data[pos++]);
+      if (d->count >= PNG_BLOCK && !png_block(d, pos, false))
+        return false;
+    }
+    return png_block(d, pos, last);
+  }
+
+  /* Lazy matching, a match is only taken if the next position doesn't have a longer one */
+  int prev_len = 0, prev_dist = 0;
+  bool pending = false;
+  while (pos < end) {
+    int len = 0, dist = 0;
+    if (pos + 3 <= end) {
+      int cand = png_insert(d, pos);
+      if (prev_len < d->lazy)
+        len = png_match(d, pos, cand, __MAX(prev_len, 2), &dist);
+    }
+    if (prev_len >= 3 && !len) {
+      png_copy(d, prev_len, prev_dist);
+      size_t stop = pos - 1 + prev_len;
+      for (size_t i = pos + 1; i < stop && i + 3 <= end; ++i)
+        png_insert(d, i);
+      pos = stop;
+      pending = false;
+      prev_len = 0;
+    } else {
+      if (pending)
+        png_literal(d, d->data[pos - 1]);
+      pending = true;
+      prev_len = len;
+      prev_dist = dist;
+      pos++;
+    }
+    if (d->count >= PNG_BLOCK && !png_block(d, pending ? pos - 1 : pos, false))
+      return false;
+  }
+  if (pending)
+    png_literal(d, d->data[pos - 1]);
+  return png_block(d, pos, last);
+}
+
+static inline unsigned char png_paeth(int a, int b, int c) {
+  int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  return (unsigned char)(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+/* Filter a row of n bytes against the one above it, picking the filter with
+ * the smallest sum of absolute differences. tmp holds 4 rows */
+static void png_filter(const unsigned char* cur, const unsigned char* up, size_t n, int bpp, bool choose, unsigned char* out, unsigned char* tmp) {
+  if (!choose) {
+    out[0] = 0;
+    memcpy(out + 1, cur, n);
+    return;
+  }
+  unsigned char *sub = tmp, *upf = tmp + n, *avg = tmp + 2 * n, *paeth = tmp + 3 * n;
+  unsigned int cost[5] = { 0 };
+  size_t i = 0;
+  for (; i < (size_t)bpp; ++i) {
+    sub[i] = cur[i];
+    upf[i] = cur[i] - up[i];
+    avg[i] = cur[i] - (up[i] >> 1);
+    paeth[i] = cur[i] - up[i];
+  }
+#if defined(GRAPHICS_SSE2)
+  /* Nothing depends on an earlier output, so 16 bytes go at once. Paeth is
+   * worked out in 16 bits, and |x| of a byte read as signed is min(x, -x) */
+  const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+  __m128i sums[5] = { zero, zero, zero, zero, zero };
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(cur + i));
+    __m128i a = _mm_loadu_si128((const __m128i*)(cur + i - bpp));
+    __m128i b = _mm_loadu_si128((const __m128i*)(up + i));
+    __m128i c = _mm_loadu_si128((const __m128i*)(up + i - bpp));
+    __m128i f[5], pred[2];
+    f[0] = x;
+    f[1] = _mm_sub_epi8(x, a);
+    f[2] = _mm_sub_epi8(x, b);
+    f[3] = _mm_sub_epi8(x, _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one)));
+    for (int h = 0; h < 2; ++h) {
+      __m128i a16 = h ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+      __m128i b16 = h ? _mm_unpackhi_epi8(b, zero) : _mm_unpacklo_epi8(b, zero);
+      __m128i c16 = h ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero);
+      __m128i bc = _mm_sub_epi16(b16, c16), ac = _mm_sub_epi16(a16, c16), abc = _mm_add_epi16(bc, ac);
+      __m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(zero, bc));
+      __m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(zero, ac));
+      __m128i pc = _mm_max_epi16(abc, _mm_sub_epi16(zero, abc));
+      __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+      __m128i not_b = _mm_cmpgt_epi16(pb, pc);
+      __m128i bc_pick = _mm_or_si128(_mm_andnot_si128(not_b, b16), _mm_and_si128(not_b, c16));
+      pred[h] = _mm_or_si128(_mm_andnot_si128(not_a, a16), _mm_and_si128(not_a, bc_pick));
+    }
+    f[4] = _mm_sub_epi8(x, _mm_packus_epi16(pred[0], pred[1]));
+    for (int k = 0; k < 5; ++k)
+      sums[k] = _mm_add_epi64(sums[k], _mm_sad_epu8(_mm_min_epu8(f[k], _mm_sub_epi8(zero, f[k])), zero));
+    _mm_storeu_si128((__m128i*)(sub + i), f[1]);
+    _mm_storeu_si128((__m128i*)(upf + i), f[2]);
+    _mm_storeu_si128((__m128i*)(avg + i), f[3]);
+    _mm_storeu_si128((__m128i*)(paeth + i), f[4]);
+  }
+  for (int k = 0; k < 5; ++k)
+    cost[k] = (unsigned int)(_mm_cvtsi128_si32(sums[k]) + _mm_cvtsi128_si32(_mm_srli_si128(sums[k], 8)));
+#endif
+  for (; i < n; ++i) {
+    sub[i] = cur[i] - cur[i - bpp];
+    upf[i] = cur[i] - up[i];
+    avg[i] = cur[i] - ((cur[i - bpp] + up[i]) >> 1);
+    paeth[i] = cur[i] - png_paeth(cur[i - bpp], up[i], up[i - bpp]);
+    cost[0] += abs((signed char)cur[i]);
+    cost[1] += abs((signed char)sub[i]);
+    cost[2] += abs((signed char)upf[i]);
+    cost[3] += abs((signed char)avg[i]);
+    cost[4] += abs((signed char)paeth[i]);
+  }
+  /* The first pixel, done separately above */
+  for (i = 0; i < (size_t)bpp; ++i) {
+    cost[0] += abs((signed char)cur[i]);
+    cost[1] += abs((signed char)sub[i]);
+    cost[2] += abs((signed char)upf[i]);
+    cost[3] += abs((signed char)avg[i]);
+    cost[4] += abs((signed char)paeth[i]);
+  }
+  int best = 0;
+  for (int f = 1; f < 5; ++f)
+    if (cost[f] < cost[best])
+      best = f;
+  out[0] = (unsigned char)best;
+  memcpy(out + 1, best ? tmp + (best - 1) * n : cur, n);
+}
+
+struct png_band_t {
+  struct png_bits_t out;
+  size_t raw;
+  unsigned int crc, adler;
+  bool ok;
+};
+
+struct png_t {
+  struct surface_t* s;
+  int level, channels, rows, bands;
+  size_t stride;
+  volatile int next;
+  struct png_band_t* band;
+};
+
+static void png_row(struct surface_t* s, int y, int channels, unsigned char* dst) {
+  const int* row = __ROW(s, y);
+  if (channels == 4)
+    for (int x = 0; x < s->w; ++x, dst += 4) {
+      dst[0] = (unsigned char)(row[x] >> 16);
+      dst[1] = (unsigned char)(row[x] >> 8);
+      dst[2] = (unsigned char)row[x];
+      dst[3] = (unsigned char)((unsigned int)row[x] >> 24);
+    }
+  else
+    for (int x = 0; x < s->w; ++x, dst += 3) {
+      dst[0] = (unsigned char)(row[x] >> 16);
+      dst[1] = (unsigned char)(row[x] >> 8);
+      dst[2] = (unsigned char)row[x];
+    }
+}
+
+static bool png_band(struct png_t* p, int i, struct png_deflate_t* d) {
+  struct png_band_t* b = p->band + i;
+  int y0 = i * p->rows, y1 = __MIN(y0 + p->rows, p->s->h);
+  int first = p->level ? y0 - (int)__MIN((size_t)y0, (PNG_WINDOW + p->stride - 1) / p->stride) : y0;
+  size_t n = p->stride - 1, start = (size_t)(y0 - first) * p->stride;
+  unsigned char* data = GRAPHICS_MALLOC((size_t)(y1 - first) * p->stride);
+  unsigned char* rows = GRAPHICS_MALLOC(n * 6);
+  bool ok = data && rows;
+  if (ok) {
+    unsigned char *cur = rows, *up = rows + n;
+    if (first)
+      png_row(p->s, first - 1, p->channels, up);
+    else
+      memset(up, 0, n);
+    for (int y = first; y < y1; ++y) {
+      png_row(p->s, y, p->channels, cur);
+      png_filter(cur, up, n, p->channels, p->level > 0, data + (size_t)(y - first) * p->stride, rows + 2 * n);
+      unsigned char* t = cur;
+      cur = up;
+      up = t;
+    }
+
+    b->raw = (size_t)(y1 - y0) * p->stride;
+    b->adler = png_adler(1, data + start, b->raw);
+    memset(&d->out, 0, sizeof(struct png_bits_t));
+    d->data = data;
+    d->end = start + b->raw;
+    png_reset(d, start);
+    /* The zlib header goes at the front of the first band, the checksum is added at the end */
+    ok = png_reserve(&d->out, b->raw / 2 + 4096);
+    if (ok && !i) {
+      d->out.buf[0] = 0x78;
+      d->out.buf[1] = p->level < 2 ? 0x01 : p->level < 6 ? 0x5E : p->level == 6 ? 0x9C : 0xDA;
+      d->out.len = 2;
+    }
+    bool last = i == p->bands - 1;
+    ok = ok && png_deflate(d, start, p->level, last) && png_reserve(&d->out, 16);
+    if (ok && !last) {
+      /* An empty stored block leaves the band byte aligned */
+      png_put(&d->out, 0, 3);
+      png_align(&d->out);
+      __put_le32(d->out.buf + d->out.len, 0xFFFF0000);
+      d->out.len += 4;
+    } else if (ok)
+      png_align(&d->out);
+    b->out = d->out;
+    if (ok)
+      b->crc = png_crc(png_crc(0xFFFFFFFF, (const unsigned char*)"IDAT", 4), b->out.buf, b->out.len);
+  }
+  GRAPHICS_SAFE_FREE(data);
+  GRAPHICS_SAFE_FREE(rows);
+  return ok;
+}
+
+static void png_worker(void* arg) {
+  struct png_t* p = (struct png_t*)arg;
+  struct png_deflate_t* d = GRAPHICS_MALLOC(sizeof(struct png_deflate_t));
+  int i;
+  while ((i = thread_atomic_inc(&p->next)) < p->bands)
+    p->band[i].ok = d && png_band(p, i, d);
+  GRAPHICS_SAFE_FREE(d);
+}
+
+static bool png_chunk(FILE* fp, const char* type, const unsigned char* data, size_t n, const char* path) {
+  unsigned char head[8], tail[4];
+  __put_be32(head, (unsigned int)n);
+  memcpy(head + 4, type, 4);
+  __put_be32(tail, png_crc(png_crc(0xFFFFFFFF, head + 4, 4), data, n) ^ 0xFFFFFFFF);
+  return bmp_write(fp, head, 8, path) && (!n || bmp_write(fp, data, n, path)) && bmp_write(fp, tail, 4, path);
+}
+
+static bool png_save(struct surface_t* s, const char* path, int level, int flags, int threads) {
+  if (s->w <= 0 || s->h <= 0) {
+    GRAPHICS_ERROR(INVALID_PARAMETERS, "save_png() failed: invalid size %dx%d", s->w, s->h);
+    return false;
+  }
+  png_init();
+
+  struct png_t p;
+  p.s = s;
+  p.level = __CLAMP(level, 0, 9);
+  p.channels = flags & PNG_ALPHA ? 4 : 3;
+  p.stride = 1 + (size_t)s->w * p.channels;
+  p.rows = (int)__MIN(__MAX((size_t)GRAPHICS_PNG_BAND / p.stride, (size_t)1), (size_t)s->h);
+  p.bands = (s->h + p.rows - 1) / p.rows;
+  p.next = 0;
+  if (!(p.band = GRAPHICS_MALLOC(p.bands * sizeof(struct png_band_t)))) {
+    GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+    return false;
+  }
+  memset(p.band, 0, p.bands * sizeof(struct png_band_t));
+  thread_pool_run(png_worker, &p, __MIN(threads, p.bands));
+
+  bool ok = true;
+  unsigned int adler = 1;
+  for (int i = 0; i < p.bands; ++i) {
+    ok = ok && p.band[i].ok;
+    adler = png_adler_combine(adler, p.band[i].adler, p.band[i].raw);
+  }
+  struct png_band_t* last = p.band + p.bands - 1;
+  if (!ok || !png_reserve(&last->out, 4)) {
+    GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+    ok = false;
+  }
+
+  FILE* fp = NULL;
+  if (ok) {
+    __put_be32(last->out.buf + last->out.len, adler);
+    last->crc = png_crc(last->crc, last->out.buf + last->out.len, 4);
+    last->out.len += 4;
+    if (!(fp = fopen(path, "wb"))) {
+      GRAPHICS_ERROR(FILE_OPEN_FAILED, "fopen() failed: %s", path);
+      ok = false;
+    }
+  }
+  if (ok) {
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    unsigned char ihdr[13] = { 0 };
+    __put_be32(ihdr, s->w);
+    __put_be32(ihdr + 4, s->h);
+    ihdr[8] = 8;
+    ihdr[9] = p.channels == 4 ? 6 : 2;
+    ok = bmp_write(fp, signature, 8, path) && png_chunk(fp, "IHDR", ihdr, 13, path);
+    for (int i = 0; i < p.bands && ok; ++i) {
+      unsigned char head[8], tail[4];
+      __put_be32(head, (unsigned int)p.band[i].out.len);
+      memcpy(head + 4, "IDAT", 4);
+      __put_be32(tail, p.band[i].crc ^ 0xFFFFFFFF);
+      ok = bmp_write(fp, head, 8, path) && bmp_write(fp, p.band[i].out.buf, p.band[i].out.len, path) && bmp_write(fp, tail, 4, path);
+    }
+    ok = ok && png_chunk(fp, "IEND", NULL, 0, path);
+    fclose(fp);
+  }
+  for (int i = 0; i < p.bands; ++i)
+    GRAPHICS_SAFE_FREE(p.band[i].out.buf);
+  GRAPHICS_FREE(p.band);
+  return ok;
+}
+
+bool save_png(struct surface_t* s, const char* path) {
+  return png_save(s, path, 6, 0, thread_cpu_count());
+}
+
+bool save_png_ex(struct surface_t* s, const char* path, int level, int flags) {
+  return png_save(s, path, level, flags, thread_cpu_count());
+}
+
+/* Background image loading and saving. Jobs are queued in a fixed ring for a
+ * few dedicated workers, so slow disks never hold up drawing or the pool
+ * above. Finished jobs with a callback wait in a list until io_dispatch runs
+ * them on the caller's thread, and errors are copied from the worker so they
+ * are raised wherever the result is collected */
+#if !defined(GRAPHICS_IO_THREADS)
+#define GRAPHICS_IO_THREADS 2
+#endif
+#if !defined(GRAPHICS_IO_QUEUE)
+#define GRAPHICS_IO_QUEUE 64
+#endif
+
+enum io_job_type {
+  IO_LOAD,
+  IO_LOAD_REGION,
+  IO_SAVE_BMP,
+  IO_SAVE_PNG
+};
+
+struct io_job_t {
+  enum io_job_type type;
+  volatile int status;
+  int x, y, w, h, level, flags;
+  char* path;
+  struct surface_t* dst;
+  struct surface_t src;
+  void(*cb)(void*, bool);
+  void* userdata;
+  enum graphics_error error;
+  char message[1024];
+  struct io_job_t* next;
+};
+
+static struct {
+#if !defined(GRAPHICS_NO_THREADS)
+  thread_handle_t threads[GRAPHICS_IO_THREADS];
+  struct io_job_t* queue[GRAPHICS_IO_QUEUE];
+  int count, head, length;
+  volatile int once;
+  volatile bool ready;
+  bool quit;
+  thread_mutex_t lock;
+  thread_cond_t work, space, finished;
+#endif
+  struct io_job_t *done, *done_tail;
+} io;
+static GRAPHICS_THREAD_LOCAL struct io_job_t* io_current = NULL;
+
+static void io_error(enum graphics_error type, const char* msg, const char* file, const char* func, int line) {
+  (void)file;
+  (void)func;
+  (void)line;
+  if (io_current && io_current->error == UNKNOWN_ERROR && !io_current->message[0]) {
+    io_current->error = type;
+    snprintf(io_current->message, sizeof(io_current->message), "%s", msg);
+  }
+}
+
+static bool io_run(struct io_job_t* job) {
+  struct graphics_ctx_t* c = __ctx();
+  void(*prev)(enum graphics_error, const char*, const char*, const char*, int) = c->error_callback;
+  c->error_callback = io_error;
+  io_current = job;
+  bool ok = false;
+  switch (job->type) {
+    case IO_LOAD:
+      ok = bmp(job->dst, job->path);
+      break;
+    case IO_LOAD_REGION:
+      ok = bmp_region(job->dst, job->path, job->x, job->y, job->w, job->h, job->flags);
+      break;
+    case IO_SAVE_BMP:
+      ok = save_bmp_ex(&job->src, job->path, job->flags);
+      surface_destroy(&job->src);
+      break;
+    case IO_SAVE_PNG:
+      /* Compressed on this worker alone, the pool stays free for drawing */
+      ok = png_save(&job->src, job->path, job->level, job->flags, 1);
+      surface_destroy(&job->src);
+      break;
+  }
+  io_current = NULL;
+  c->error_callback = prev;
+  GRAPHICS_SAFE_FREE(job->path);
+  return ok;
+}
+
+/* Called with io.lock held when there are threads */
+static void io_finish(struct io_job_t* job, bool ok) {
+#if !defined(GRAPHICS_NO_THREADS)
+  thread_atomic_swap(&job->status, ok ? IO_DONE : IO_FAILED);
+#else
+  job->status = ok ? IO_DONE : IO_FAILED;
+#endif
+  if (!job->cb)
+    return;
+  if (io.done_tail)
+    io.done_tail->next = job;
+  else
+    io.done = job;
+  io.done_tail = job;
+}
+
+#if !defined(GRAPHICS_NO_THREADS)
+static void io_worker(void* arg) {
+  (void)arg;
+  thread_mutex_lock(&io.lock);
+  for (;;) {
+    while (!io.length && !io.quit)
+      thread_cond_wait(&io.work, &io.lock);
+    if (!io.length)
+      break;
+    struct io_job_t* job = io.queue[io.head];
+    io.head = (io.head + 1) % GRAPHICS_IO_QUEUE;
+    io.length--;
+    thread_cond_signal(&io.space);
+    thread_mutex_unlock(&io.lock);
+    bool ok = io_run(job);
+    thread_mutex_lock(&io.lock);
+    io_finish(job, ok);
+    thread_cond_broadcast(&io.finished);
+  }
+  thread_mutex_unlock(&io.lock);
+}
+
+static void io_init(void) {
+  while (!io.ready) {
+    if (thread_atomic_inc(&io.once)) {
+      thread_yield();
+      continue;
+    }
+
+    thread_mutex_init(&io.lock);
+    thread_cond_init(&io.work);
+    thread_cond_init(&io.space);
+    thread_cond_init(&io.finished);
+    for (; io.count < GRAPHICS_IO_THREADS; io.count++)
+      if (!thread_create(&io.threads[io.count], io_worker, NULL))
+        break;
+    thread_barrier();
+    io.ready = true;
+  }
+}
+#endif
+
+static struct io_job_t* io_job(enum io_job_type type, const char* path, void(*cb)(void*, bool), void* userdata) {
+  struct io_job_t* job = GRAPHICS_MALLOC(sizeof(struct io_job_t));
+  size_t n = strlen(path) + 1;
+  char* copy = GRAPHICS_MALLOC(n);
+  if (!job || !copy) {
+    GRAPHICS_SAFE_FREE(job);
+    GRAPHICS_SAFE_FREE(copy);
+    GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+    return NULL;
+  }
+  memcpy(copy, path, n);
+  job->path = copy;
+  job->type = type;
+  job->status = IO_PENDING;
+  job->x = job->y = job->w = job->h = job->level = job->flags = 0;
+  job->dst = NULL;
+  memset(&job->src, 0, sizeof(struct surface_t));
+  job->cb = cb;
+  job->userdata = userdata;
+  job->error = UNKNOWN_ERROR;
+  job->message[0] = '\0';
+  job->next = NULL;
+  return job;
+}
+
+static struct io_job_t* io_submit(struct io_job_t* job) {
+#if !defined(GRAPHICS_NO_THREADS)
+  io_init();
+  thread_mutex_lock(&io.lock);
+  if (io.count) {
+    while (io.length == GRAPHICS_IO_QUEUE)
+      thread_cond_wait(&io.space, &io.lock);
+    io.queue[(io.head + io.length++) % GRAPHICS_IO_QUEUE] = job;
+    thread_cond_signal(&io.work);
+    thread_mutex_unlock(&io.lock);
+    return job;
+  }
+  thread_mutex_unlock(&io.lock);
+#endif
+  /* No workers, run it now but still leave the callback for io_dispatch */
+  bool ok = io_run(job);
+#if !defined(GRAPHICS_NO_THREADS)
+  thread_mutex_lock(&io.lock);
+  io_finish(job, ok);
+  thread_mutex_unlock(&io.lock);
+#else
+  io_finish(job, ok);
+#endif
+  return job;
+}
+
+struct io_job_t* bmp_async(struct surface_t* s, const char* path, void(*cb)(void*, bool), void* userdata) {
+  struct io_job_t* job = io_job(IO_LOAD, path, cb, userdata);
+  if (!job)
+    return NULL;
+  job->dst = s;
+  return io_submit(job);
+}
+
+struct io_job_t* bmp_region_async(struct surface_t* s, const char* path, int x, int y, int w, int h, int reduce, void(*cb)(void*, bool), void* userdata) {
+  struct io_job_t* job = io_job(IO_LOAD_REGION, path, cb, userdata);
+  if (!job)
+    return NULL;
+  job->dst = s;
+  job->x = x;
+  job->y = y;
+  job->w = w;
+  job->h = h;
+  job->flags = reduce;
+  return io_submit(job);
+}
+
+/* Copy without clearing first, the copy is touched once */
+static struct io_job_t* io_save(struct io_job_t* job, struct surface_t* s) {
+  job->src.w = job->src.pitch = s->w;
+  job->src.h = s->h;
+  if (!(job->src.buf = GRAPHICS_MALLOC((size_t)s->w * s->h * sizeof(int) + 1))) {
+    GRAPHICS_FREE(job->path);
+    GRAPHICS_FREE(job);
+    GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+    return NULL;
+  }
+  if (s->pitch == s->w)
+    memcpy(job->src.buf, s->buf, (size_t)s->w * s->h * sizeof(int));
+  else
+    for (int y = 0; y < s->h; ++y)
+      memcpy(__ROW(&job->src, y), __ROW(s, y), s->w * sizeof(int));
+  return io_submit(job);
+}
+
+struct io_job_t* save_bmp_async(struct surface_t* s, const char* path, int flags, void(*cb)(void*, bool), void* userdata) {
+  struct io_job_t* job = io_job(IO_SAVE_BMP, path, cb, userdata);
+  if (!job)
+    return NULL;
+  job->flags = flags;
+  return io_save(job, s);
+}
+
+struct io_job_t* save_png_async(struct surface_t* s, const char* path, int level, int flags, void(*cb)(void*, bool), void* userdata) {
+  struct io_job_t* job = io_job(IO_SAVE_PNG, path, cb, userdata);
+  if (!job)
+    return NULL;
+  job->level = level;
+  job->flags = flags;
+  return io_save(job, s);
+}
+
+enum io_status io_poll(struct io_job_t* job) {
+#if !defined(GRAPHICS_NO_THREADS)
+  return (enum io_status)thread_atomic_load(&job->status);
+#else
+  return (enum io_status)job->status;
+#endif
+}
+
+static void io_report(struct io_job_t* job) {
+  if (job->status == IO_FAILED)
+    GRAPHICS_ERROR(job->error, "%s", job->message[0] ? job->message : "io failed");
+}
+
+bool io_wait(struct io_job_t* job) {
+#if !defined(GRAPHICS_NO_THREADS)
+  if (io.ready) {
+    thread_mutex_lock(&io.lock);
+    while (job->status == IO_PENDING)
+      thread_cond_wait(&io.finished, &io.lock);
+    thread_mutex_unlock(&io.lock);
+  }
+#endif
+  bool ok = job->status == IO_DONE;
+  if (job->cb)
+    return ok;
+  io_report(job);
+  GRAPHICS_FREE(job);
+  return ok;
+}
+
+void io_dispatch(void) {
+#if !defined(GRAPHICS_NO_THREADS)
+  if (!io.ready)
+    return;
+  thread_mutex_lock(&io.lock);
+#endif
+  struct io_job_t* job = io.done;
+  io.done = io.done_tail = NULL;
+#if !defined(GRAPHICS_NO_THREADS)
+  thread_mutex_unlock(&io.lock);
+#endif
+  while (job) {
+    struct io_job_t* next = job->next;
+    io_report(job);
+    job->cb(job->userdata, job->status == IO_DONE);
+    GRAPHICS_FREE(job);
+    job = next;
+  }
+}
+
+/* Finish everything still queued, then hand out the last callbacks */
+static void io_destroy(void) {
+#if !defined(GRAPHICS_NO_THREADS)
+  if (!io.ready)
+    return;
+  thread_mutex_lock(&io.lock);
+  io.quit = true;
+  thread_cond_broadcast(&io.work);
+  thread_mutex_unlock(&io.lock);
+  for (int i = 0; i < io.count; ++i)
+    thread_join(io.threads[i]);
+#endif
+  io_dispatch();
+#if !defined(GRAPHICS_NO_THREADS)
+  thread_cond_destroy(&io.work);
+  thread_cond_destroy(&io.space);
+  thread_cond_destroy(&io.finished);
+  thread_mutex_destroy(&io.lock);
+  memset(&io, 0, sizeof(io));
+#endif
+}
+
+enum draw_cmd_type {
+  DRAW_CMD_LINE,
+  DRAW_CMD_CIRCLE,
+  DRAW_CMD_RECT,
+  DRAW_CMD_TRI,
+  DRAW_CMD_PASTE,
+  DRAW_CMD_TEXT
+};
+
+/* Every command in a draw list starts with this header, followed by its arguments */
+struct draw_cmd_t {
+  unsigned int type, size;
+  enum draw_mode mode;
+  bool clipping;
+  struct rect_t bounds, clip;
+  union {
+    struct {
+      int x0, y0, x1, y1, col;
+    } line;
+    struct {
+      int xc, yc, r, col;
+      bool fill;
+    } circle;
+    struct {
+      int x, y, w, h, col;
+      bool fill;
+    } rect;
+    struct {
+      int x0, y0, x1, y1, x2, y2, col;
+      bool fill, fixed;
+    } tri;
+    struct {
+      struct surface_t* src;
+      int x, y, rx, ry, rw, rh;
+    } paste;
+    struct {
+      int x, y, fg, bg;
+      char str[1];
+    } text;
+  };
+};
+
+#define DRAW_CMD_ALIGN(x) (((x) + 7) & ~(size_t)7)
+#define DRAW_CMD_BASE_SIZE (offsetof(struct draw_cmd_t, line))
+
+bool draw_list(struct draw_list_t* l) {
+  memset(l, 0, sizeof(struct draw_list_t));
+  return true;
+}
+
+void draw_list_destroy(struct draw_list_t* l) {
+  GRAPHICS_SAFE_FREE(l->data);
+  memset(l, 0, sizeof(struct draw_list_t));
+}
+
+void draw_list_clear(struct draw_list_t* l) {
+  l->size = 0;
+  l->count = 0;
+}
+
+/* Reserve space for a command at the end of the arena, the arena only ever grows */
+static struct draw_cmd_t* draw_list_push(struct draw_list_t* l, enum draw_cmd_type type, size_t payload, int x, int y, int w, int h) {
+  size_t sz = DRAW_CMD_ALIGN(DRAW_CMD_BASE_SIZE + payload);
+  if (l->size + sz > l->capacity) {
+    size_t capacity = l->capacity ? l->capacity : 4096;
+    while (capacity < l->size + sz)
+      capacity *= 2;
+    unsigned char* tmp = GRAPHICS_REALLOC(l->data, capacity);
+    if (!tmp) {
+      GRAPHICS_ERROR(OUT_OF_MEMEORY, "realloc() failed");
+      return NULL;
+    }
+    l->data = tmp;
+    l->capacity = capacity;
+  }
+
+  struct draw_cmd_t* cmd = (struct draw_cmd_t*)(l->data + l->size);
+  cmd->type = type;
+  cmd->size = (unsigned int)sz;
+  struct graphics_ctx_t* c = __ctx();
+  cmd->mode = c->mode;
+  cmd->clipping = c->clipping;
+  cmd->clip = c->clip;
+  cmd->bounds.x = x;
+  cmd->bounds.y = y;
+  cmd->bounds.w = w;
+  cmd->bounds.h = h;
+  if (c->clipping) {
+    /* Commands clipped out entirely are culled and never binned */
+    long long x0 = __MAX(x, c->clip.x), y0 = __MAX(y, c->clip.y);
+    long long x1 = __MIN((long long)x + w, (long long)c->clip.x + c->clip.w);
+    long long y1 = __MIN((long long)y + h, (long long)c->clip.y + c->clip.h);
+    cmd->bounds.x = (int)x0;
+    cmd->bounds.y = (int)y0;
+    cmd->bounds.w = (int)__MAX(x1 - x0, 0);
+    cmd->bounds.h = (int)__MAX(y1 - y0, 0);
+  }
+  l->size += sz;
+  l->count++;
+  return cmd;
+}
+
+#define DRAW_CMD_PAYLOAD(x) (sizeof(((struct draw_cmd_t*)0)->x))
+
+bool draw_list_line(struct draw_list_t* l, int x0, int y0, int x1, int y1, int col) {
+  struct draw_cmd_t* cmd = draw_list_push(l, DRAW_CMD_LINE, DRAW_CMD_PAYLOAD(line), __MIN(x0, x1), __MIN(y0, y1), abs(x1 - x0) + 1, abs(y1 - y0) + 1);
+  if (!cmd)
+    return false;
+  cmd->line.x0 = x0;
+  cmd->line.y0 = y0;
+  cmd->line.x1 = x1;
+  cmd->line.y1 = y1;
+  cmd->line.col = col;
+  return true;
+}
+
+bool draw_list_circle(struct draw_list_t* l, int xc, int yc, int r, int col, bool fill) {
+  struct draw_cmd_t* cmd = draw_list_push(l, DRAW_CMD_CIRCLE, DRAW_CMD_PAYLOAD(circle), xc - r, yc - r, r * 2 + 1, r * 2 + 1);
+  if (!cmd)
+    return false;
+  cmd->circle.xc = xc;
+  cmd->circle.yc = yc;
+  cmd->circle.r = r;
+  cmd->circle.col = col;
+  cmd->circle.fill = fill;
+  return true;
+}
+
+bool draw_list_rect(struct draw_list_t* l, int x, int y, int w, int h, int col, bool fill) {
+  struct draw_cmd_t* cmd = draw_list_push(l, DRAW_CMD_RECT, DRAW_CMD_PAYLOAD(rect), x, y, w, h);
+  if (!cmd)
+    return false;
+  cmd->rect.x = x;
+  cmd->rect.y = y;
+  cmd->rect.w = w;
+  cmd->rect.h = h;
+  cmd->rect.col = col;
+  cmd->rect.fill = fill;
+  return true;
+}
+
+bool draw_list_tri(struct draw_list_t* l, int x0, int y0, int x1, int y1, int x2, int y2, int col, bool fill) {
+  int x = __MIN(x0, __MIN(x1, x2)), y = __MIN(y0, __MIN(y1, y2));
+  struct draw_cmd_t* cmd = draw_list_push(l, DRAW_CMD_TRI, DRAW_CMD_PAYLOAD(tri), x, y, __MAX(x0, __MAX(x1, x2)) - x + 1, __MAX(y0, __MAX(y1, y2)) - y + 1);
+  if (!cmd)
+    return false;
+  cmd->tri.x0 = x0;
+  cmd->tri.y0 = y0;
+  cmd->tri.x1 = x1;
+  cmd->tri.y1 = y1;
+  cmd->tri.x2 = x2;
+  cmd->tri.y2 = y2;
+  cmd->tri.col = col;
+  cmd->tri.fill = fill;
+  cmd->tri.fixed = false;
+  return true;
+}
+
+bool draw_list_tri_fixed(struct draw_list_t* l, int x0, int y0, int x1, int y1, int x2, int y2, int col) {
+  int x = (int)__floordiv(__MIN(x0, __MIN(x1, x2)), __SUBPIXEL_ONE), y = (int)__floordiv(__MIN(y0, __MIN(y1, y2)), __SUBPIXEL_ONE);
+  int w = (int)__floordiv(__MAX(x0, __MAX(x1, x2)), __SUBPIXEL_ONE) - x + 2, h = (int)__floordiv(__MAX(y0, __MAX(y1, y2)), __SUBPIXEL_ONE) - y + 2;
+  struct draw_cmd_t* cmd = draw_list_push(l, DRAW_CMD_TRI, DRAW_CMD_PAYLOAD(tri), x, y, w, h);
+  if (!cmd)
+    return false;
+  cmd->tri.x0 = x0;
+  cmd->tri.y0 = y0;
+  cmd->tri.x1 = x1;
+  cmd->tri.y1 = y1;
+  cmd->tri.x2 = x2;
+  cmd->tri.y2 = y2;
+  cmd->tri.col = col;
+  cmd->tri.fill = true;
+  cmd->tri.fixed = true;
+  return true;
+}
+
+bool draw_list_clip_paste(struct draw_list_t* l, struct surface_t* src, int x, int y, int rx, int ry, int rw, int rh) {
+  struct draw_cmd_t* cmd = draw_list_push(l, DRAW_CMD_PASTE, DRAW_CMD_PAYLOAD(paste), x, y, rw, rh);
+  if (!cmd)
+    return false;
+  cmd->paste.src = src;
+  cmd->paste.x = x;
+  cmd->paste.y = y;
+  cmd->paste.rx = rx;
+  cmd->paste.ry = ry;
+  cmd->paste.rw = rw;
+  cmd->paste.rh = rh;
+  return true;
+}
+
+bool draw_list_paste(struct draw_list_t* l, struct surface_t* src, int x, int y) {
+  return draw_list_clip_paste(l, src, x, y, 0, 0, src->w, src->h);
+}
+
+bool draw_list_writeln(struct draw_list_t* l, int x, int y, int fg, int bg, const char* str) {
+  int w = 0, h = 0;
+  size_t len = strlen(str);
+  str_size(str, &w, &h);
+  struct draw_cmd_t* cmd = draw_list_push(l, DRAW_CMD_TEXT, offsetof(struct draw_cmd_t, text.str) - DRAW_CMD_BASE_SIZE + len + 1, x, y, w * 8, h * LINE_HEIGHT);
+  if (!cmd)
+    return false;
+  cmd->text.x = x;
+  cmd->text.y = y;
+  cmd->text.fg = fg;
+  cmd->text.bg = bg;
+  memcpy(cmd->text.str, str, len + 1);
+  return true;
+}
+
+static inline bool draw_cmd_visible(struct draw_cmd_t* cmd, int x, int y, int w, int h) {
+  return cmd->bounds.w > 0 && cmd->bounds.h > 0 &&
+         cmd->bounds.x < x + w && cmd->bounds.x + cmd->bounds.w > x &&
+         cmd->bounds.y < y + h && cmd->bounds.y + cmd->bounds.h > y;
+}
+
+/* Commands are replayed at an offset so a tile can be drawn into a view of
+ * the target, every primitive is translation invariant so this is exact */
+static void draw_cmd_exec(struct draw_cmd_t* cmd, struct surface_t* s, int ox, int oy) {
+  struct graphics_ctx_t* c = __ctx();
+  struct rect_t clip = c->clip;
+  bool clipping = c->clipping;
+  c->mode = cmd->mode;
+  /* The recorded clip applies within whatever clip the list is replayed with */
+  if (cmd->clipping)
+    __clip_intersect(c, cmd->clip.x - ox, cmd->clip.y - oy, cmd->clip.w, cmd->clip.h);
+  switch (cmd->type) {
+    case DRAW_CMD_LINE:
+      line(s, cmd->line.x0 - ox, cmd->line.y0 - oy, cmd->line.x1 - ox, cmd->line.y1 - oy, cmd->line.col);
+      break;
+    case DRAW_CMD_CIRCLE:
+      circle(s, cmd->circle.xc - ox, cmd->circle.yc - oy, cmd->circle.r, cmd->circle.col, cmd->circle.fill);
+      break;
+    case DRAW_CMD_RECT:
+      rect(s, cmd->rect.x - ox, cmd->rect.y - oy, cmd->rect.w, cmd->rect.h, cmd->rect.col, cmd->rect.fill);
+      break;
+    case DRAW_CMD_TRI:
+      if (cmd->tri.fixed)
+        tri_fill(s, cmd->tri.x0 - (long long)ox * __SUBPIXEL_ONE, cmd->tri.y0 - (long long)oy * __SUBPIXEL_ONE,
+                 cmd->tri.x1 - (long long)ox * __SUBPIXEL_ONE, cmd->tri.y1 - (long long)oy * __SUBPIXEL_ONE,
+                 cmd->tri.x2 - (long long)ox * __SUBPIXEL_ONE, cmd->tri.y2 - (long long)oy * __SUBPIXEL_ONE, cmd->tri.col);
+      else
+        tri(s, cmd->tri.x0 - ox, cmd->tri.y0 - oy, cmd->tri.x1 - ox, cmd->tri.y1 - oy, cmd->tri.x2 - ox, cmd->tri.y2 - oy, cmd->tri.col, cmd->tri.fill);
+      break;
+    case DRAW_CMD_PASTE:
+      clip_paste(s, cmd->paste.src, cmd->paste.x - ox, cmd->paste.y - oy, cmd->paste.rx, cmd->paste.ry, cmd->paste.rw, cmd->paste.rh);
+      break;
+    case DRAW_CMD_TEXT:
+      writeln(s, cmd->text.x - ox, cmd->text.y - oy, cmd->text.fg, cmd->text.bg, cmd->text.str);
+      break;
+  }
+  c->clip = clip;
+  c->clipping = clipping;
+}
+
+void draw_list_exec(struct draw_list_t* l, struct surface_t* s) {
+  enum draw_mode mode = __ctx()->mode;
+  for (size_t off = 0; off < l->size;) {
+    struct draw_cmd_t* cmd = (struct draw_cmd_t*)(l->data + off);
+    if (draw_cmd_visible(cmd, 0, 0, s->w, s->h))
+      draw_cmd_exec(cmd, s, 0, 0);
+    off += cmd->size;
+  }
+  __ctx()->mode = mode;
+}
+
+#if !defined(GRAPHICS_TILE_SIZE)
+#define GRAPHICS_TILE_SIZE 64
+#endif
+
+struct draw_tiles_t {
+  struct draw_list_t* l;
+  struct surface_t* s;
+  struct graphics_ctx_t* ctx;
+  int cols, rows;
+  volatile int next;
+  /* Commands binned to tile t are cmds[first[t]] .. cmds[first[t + 1] - 1], in recorded order */
+  size_t *cmds, *first;
+};
+
+static void draw_tiles_worker(void* arg) {
+  struct draw_tiles_t* t = (struct draw_tiles_t*)arg;
+  struct surface_t view;
+  struct graphics_ctx_t c, *prev;
+  int i;
+
+  /* Draw with the caller's clip rect and error handler, moved into tile space */
+  graphics_ctx(&c);
+  c.error_callback = t->ctx->error_callback;
+  c.clipping = t->ctx->clipping;
+  prev = graphics_ctx_bind(&c);
+  while ((i = thread_atomic_inc(&t->next)) < t->cols * t->rows) {
+    int tx = (i % t->cols) * GRAPHICS_TILE_SIZE, ty = (i / t->cols) * GRAPHICS_TILE_SIZE;
+    if (!subsurface(t->s, tx, ty, GRAPHICS_TILE_SIZE, GRAPHICS_TILE_SIZE, &view))
+      continue;
+    c.clip.x = t->ctx->clip.x - tx;
+    c.clip.y = t->ctx->clip.y - ty;
+    c.clip.w = t->ctx->clip.w;
+    c.clip.h = t->ctx->clip.h;
+    for (size_t j = t->first[i]; j < t->first[i + 1]; ++j)
+      draw_cmd_exec((struct draw_cmd_t*)(t->l->data + t->cmds[j]), &view, tx, ty);
+  }
+  graphics_ctx_bind(prev);
+}
+
+/* Tile range [x0, x1) x [y0, y1) a command's clipped bounds fall into */
+static inline void draw_tiles_range(struct draw_tiles_t* t, struct draw_cmd_t* cmd, int* x0, int* y0, int* x1, int* y1) {
+  *x0 = __MAX(cmd->bounds.x, 0) / GRAPHICS_TILE_SIZE;
+  *y0 = __MAX(cmd->bounds.y, 0) / GRAPHICS_TILE_SIZE;
+  *x1 = (__MIN(cmd->bounds.x + cmd->bounds.w, t->s->w) + GRAPHICS_TILE_SIZE - 1) / GRAPHICS_TILE_SIZE;
+  *y1 = (__MIN(cmd->bounds.y + cmd->bounds.h, t->s->h) + GRAPHICS_TILE_SIZE - 1) / GRAPHICS_TILE_SIZE;
+}
+
+/* Narrow the columns of tile row y a line passes through. A shallow line
+ * covers half a row either side of a pixel centre, so the ideal line is taken
+ * from one row above the band to one row below, and widened by two pixels for
+ * Bresenham's rounding and the truncating division */
+static inline void draw_tiles_line(struct draw_cmd_t* cmd, int y, int* x0, int* x1) {
+  int ax = cmd->line.x0, ay = cmd->line.y0, bx = cmd->line.x1, by = cmd->line.y1;
+  if (ay == by)
+    return;
+  if (ay > by) {
+    GRAPHICS_SWAP(ax, bx);
+    GRAPHICS_SWAP(ay, by);
+  }
+  int top = __MAX(y * GRAPHICS_TILE_SIZE - 1, ay), bottom = __MIN((y + 1) * GRAPHICS_TILE_SIZE, by);
+  int u = ax + (int)((long long)(top - ay) * (bx - ax) / (by - ay));
+  int v = ax + (int)((long long)(bottom - ay) * (bx - ax) / (by - ay));
+  if (u > v)
+    GRAPHICS_SWAP(u, v);
+  *x0 = __MAX(*x0, __MAX(u - 2, 0) / GRAPHICS_TILE_SIZE);
+  *x1 = __MIN(*x1, __MAX(v + 2, 0) / GRAPHICS_TILE_SIZE + 1);
+}
+
+void draw_list_exec_mt(struct draw_list_t* l, struct surface_t* s, int threads) {
+  struct draw_tiles_t t;
+  int n, x, y, x0, y0, x1, y1;
+  size_t off, total = 0;
+
+  t.l = l;
+  t.s = s;
+  t.cols = (s->w + GRAPHICS_TILE_SIZE - 1) / GRAPHICS_TILE_SIZE;
+  t.rows = (s->h + GRAPHICS_TILE_SIZE - 1) / GRAPHICS_TILE_SIZE;
+  t.next = 0;
+  n = t.cols * t.rows;
+  if (threads <= 0 || threads > thread_cpu_count())
+    threads = thread_cpu_count();
+  if (threads == 1 || n <= 1 || !l->count) {
+    draw_list_exec(l, s);
+    return;
+  }
+
+  /* Count the commands landing in each tile, then turn the counts into offsets */
+  if (!(t.first = GRAPHICS_MALLOC((n + 1) * sizeof(size_t)))) {
+    draw_list_exec(l, s);
+    return;
+  }
+  memset(t.first, 0, (n + 1) * sizeof(size_t));
+  for (off = 0; off < l->size; off += ((struct draw_cmd_t*)(l->data + off))->size) {
+    struct draw_cmd_t* cmd = (struct draw_cmd_t*)(l->data + off);
+    if (!draw_cmd_visible(cmd, 0, 0, s->w, s->h))
+      continue;
+    if (cmd->type == DRAW_CMD_PASTE && surface_root(cmd->paste.src) == surface_root(s)) {
+      /* Pasting from the target reads pixels other tiles are still drawing */
+      GRAPHICS_FREE(t.first);
+      draw_list_exec(l, s);
+      return;
+    }
+    draw_tiles_range(&t, cmd, &x0, &y0, &x1, &y1);
+    for (y = y0; y < y1; ++y) {
+      int lx0 = x0, lx1 = x1;
+      if (cmd->type == DRAW_CMD_LINE)
+        draw_tiles_line(cmd, y, &lx0, &lx1);
+      for (x = lx0; x < lx1; ++x)
+        t.first[y * t.cols + x + 1]++;
+    }
+  }
+  for (x = 0; x < n; ++x)
+    t.first[x + 1] += t.first[x];
+  total = t.first[n];
 
-void ascii(struct surface_t* s, unsigned char ch, int x, int y, int fg, int bg) {
-  int c = letter_index((int)ch), i, j;
-  for (i = 0; i < 8; ++i)
-    for (j = 0; j < 8; ++j) {
-      if (font[c][i] & 1 << j) {
-        pset(s, x + j, y + i, fg);
-      } else {
-        if (bg == -1)
-          continue;
-        pset(s, x + j, y + i, bg);
-      }
+  if (!(t.cmds = GRAPHICS_MALLOC(__MAX(total, 1) * sizeof(size_t)))) {
+    GRAPHICS_FREE(t.first);
+    draw_list_exec(l, s);
+    return;
+  }
+  for (off = 0; off < l->size; off += ((struct draw_cmd_t*)(l->data + off))->size) {
+    struct draw_cmd_t* cmd = (struct draw_cmd_t*)(l->data + off);
+    if (!draw_cmd_visible(cmd, 0, 0, s->w, s->h))
+      continue;
+    draw_tiles_range(&t, cmd, &x0, &y0, &x1, &y1);
+    for (y = y0; y < y1; ++y) {
+      int lx0 = x0, lx1 = x1;
+      if (cmd->type == DRAW_CMD_LINE)
+        draw_tiles_line(cmd, y, &lx0, &lx1);
+      for (x = lx0; x < lx1; ++x)
+        t.cmds[t.first[y * t.cols + x]++] = off;
     }
-}
+  }
+  /* Filling shifted every offset up by one tile, shift them back */
+  memmove(t.first + 1, t.first, n * sizeof(size_t));
+  t.first[0] = 0;
 
-int character(struct surface_t* s, const char* ch, int x, int y, int fg, int bg) {
-  int u = -1;
-  int l = ctoi(ch, &u);
-  int uc = letter_index(u), i, j;
-  for (i = 0; i < 8; ++i)
-    for (j = 0; j < 8; ++j) {
-      if (font[uc][i] & 1 << j)
-        pset(s, x + j, y + i, fg);
-      else {
-        pset(s, x + j, y + i, bg);
-      }
-    }
+  /* Workers would race on the damage list, so it's recorded per tile here */
+  struct surface_t* root = surface_root(s);
+  struct damage_t* damage = root->damage;
+  root->damage = NULL;
+  t.ctx = __ctx();
+  thread_pool_run(draw_tiles_worker, &t, __MIN(threads, n));
+  root->damage = damage;
+  for (x = 0; x < n; ++x)
+    if (t.first[x + 1] > t.first[x])
+      surface_damage(s, (x % t.cols) * GRAPHICS_TILE_SIZE, (x / t.cols) * GRAPHICS_TILE_SIZE, GRAPHICS_TILE_SIZE, GRAPHICS_TILE_SIZE);
 
-  return l;
+  GRAPHICS_FREE(t.cmds);
+  GRAPHICS_FREE(t.first);
 }
 
-void writeln(struct surface_t* s, int x, int y, int fg, int bg, const char* str) {
-    const char* c = str;
-  int u = x, v = y;
-  while (c && *c != '\0')
-    switch (*c) {
-      case '\n':
-        v += LINE_HEIGHT;
-        u  = x;
-        c++;
-        break;
-      default:
-        c += character(s, c, u, v, fg, bg);
-        u += 8;
-        break;
-    }
+void pset_ctx(struct graphics_ctx_t* c, struct surface_t* s, int x, int y, int col) {
+  GRAPHICS_WITH_CTX(c, pset(s, x, y, col));
 }
 
-void writelnf(struct surface_t* s, int x, int y, int fg, int bg, const char* fmt, ...) {
-  char* buffer = NULL;
-  int buffer_size = 0;
+void line_ctx(struct graphics_ctx_t* c, struct surface_t* s, int x0, int y0, int x1, int y1, int col) {
+  GRAPHICS_WITH_CTX(c, line(s, x0, y0, x1, y1, col));
+}
 
-  va_list argptr;
-  va_start(argptr, fmt);
-  int length = vsnprintf(buffer, buffer_size, fmt, argptr);
-  va_end(argptr);
+void circle_ctx(struct graphics_ctx_t* c, struct surface_t* s, int xc, int yc, int r, int col, bool fill) {
+  GRAPHICS_WITH_CTX(c, circle(s, xc, yc, r, col, fill));
+}
 
-  if (length + 1 > buffer_size) {
-    buffer_size = length + 1;
-    buffer = GRAPHICS_REALLOC(buffer, buffer_size);
-    va_start(argptr, fmt);
-    vsnprintf(buffer, buffer_size, fmt, argptr);
-    va_end(argptr);
-  }
+void rect_ctx(struct graphics_ctx_t* c, struct surface_t* s, int x, int y, int w, int h, int col, bool fill) {
+  GRAPHICS_WITH_CTX(c, rect(s, x, y, w, h, col, fill));
+}
 
-  writeln(s, x, y, fg, bg, buffer);
-  GRAPHICS_SAFE_FREE(buffer);
+void tri_ctx(struct graphics_ctx_t* c, struct surface_t* s, int x0, int y0, int x1, int y1, int x2, int y2, int col, bool fill) {
+  GRAPHICS_WITH_CTX(c, tri(s, x0, y0, x1, y1, x2, y2, col, fill));
 }
 
-void string(struct surface_t* s, int fg, int bg, const char* str) {
-    int w, h;
-  str_size(str, &w, &h);
-  surface(s, w * 8, h * LINE_HEIGHT);
-  fill(s, (bg == -1 ? 0 : bg));
-  writeln(s, 0, 0, fg, bg, str);
+bool flood_ctx(struct graphics_ctx_t* c, struct surface_t* s, int x, int y, int col, int tolerance, struct rect_t* bounds) {
+  bool ret;
+  GRAPHICS_WITH_CTX(c, ret = flood_ex(s, x, y, col, tolerance, bounds));
+  return ret;
 }
 
-void stringf(struct surface_t* s, int fg, int bg, const char* fmt, ...) {
-    unsigned char* buffer = NULL;
-  int buffer_size = 0;
+bool paste_ctx(struct graphics_ctx_t* c, struct surface_t* dst, struct surface_t* src, int x, int y) {
+  bool ret;
+  GRAPHICS_WITH_CTX(c, ret = paste(dst, src, x, y));
+  return ret;
+}
 
-  va_list argptr;
-  va_start(argptr, fmt);
-  int length = vsnprintf((char*)buffer, buffer_size, fmt, argptr);
-  va_end(argptr);
+bool clip_paste_ctx(struct graphics_ctx_t* c, struct surface_t* dst, struct surface_t* src, int x, int y, int rx, int ry, int rw, int rh) {
+  bool ret;
+  GRAPHICS_WITH_CTX(c, ret = clip_paste(dst, src, x, y, rx, ry, rw, rh));
+  return ret;
+}
 
-  if (length + 1 > buffer_size) {
-    buffer_size = length + 1;
-    buffer = GRAPHICS_REALLOC(buffer, buffer_size);
-    va_start(argptr, fmt);
-    vsnprintf((char*)buffer, buffer_size, fmt, argptr);
-    va_end(argptr);
-  }
+void writeln_ctx(struct graphics_ctx_t* c, struct surface_t* s, int x, int y, int fg, int bg, const char* str) {
+  GRAPHICS_WITH_CTX(c, writeln(s, x, y, fg, bg, str));
+}
 
-  string(s, fg, bg, (char*)buffer);
-  GRAPHICS_SAFE_FREE(buffer);
+void draw_list_exec_ctx(struct graphics_ctx_t* c, struct draw_list_t* l, struct surface_t* s) {
+  GRAPHICS_WITH_CTX(c, draw_list_exec(l, s));
 }
 
 #if defined(GRAPHICS_OSX)
@@ -1501,9 +5349,6 @@ unsigned long long ticks(void) {
 #endif
 }
 
-static short keycodes[512];
-static bool keycodes_init = false;
-
 void window_set_parent(struct window_t* s, void* p) {
   s->parent = p;
 }
@@ -1538,11 +5383,420 @@ void window_size(struct window_t* s, int* w, int* h) {
     *h = s->h;
 }
 
-#define CBCALL(x, ...) \
-  if (e_window && e_window->x) \
-    e_window->x(e_window->parent, __VA_ARGS__);
+#define CBCALL(x, ...) \
+  if (e_window && e_window->x) \
+    e_window->x(e_window->parent, __VA_ARGS__);
+
+#if defined(GRAPHICS_HEADLESS)
+#if !defined(GRAPHICS_HEADLESS_SCREEN_W)
+#define GRAPHICS_HEADLESS_SCREEN_W 1920
+#endif
+#if !defined(GRAPHICS_HEADLESS_SCREEN_H)
+#define GRAPHICS_HEADLESS_SCREEN_H 1080
+#endif
+
+/* Windows are offscreen framebuffers. flush draws into them the way it would
+ * to a screen, then hands the frame to the callback and/or saves it */
+struct headless_window_t {
+  struct surface_t back;
+  struct scaler_t scaler;
+  enum present_scale scale_mode;
+  struct window_t* parent;
+  int id, frame;
+  bool closed;
+};
+
+LINKEDLIST(window, struct headless_window_t);
+static struct window_node_t* windows = NULL;
+static int headless_next_id = 1, headless_cx = 0, headless_cy = 0;
+static char* headless_fmt = NULL;
+static void(*headless_cb)(struct window_t*, struct surface_t*, int) = NULL;
+
+enum headless_event_type {
+  HEADLESS_KEY,
+  HEADLESS_BUTTON,
+  HEADLESS_MOVE,
+  HEADLESS_SCROLL,
+  HEADLESS_FOCUS,
+  HEADLESS_RESIZE,
+  HEADLESS_CLOSE
+};
+
+/* A scripted event, dispatched by the when'th call to events() */
+struct headless_event_t {
+  int when, id, type, a, b, c;
+  float x, y;
+};
+
+static struct headless_event_t* script = NULL;
+static int script_len = 0, script_pos = 0, script_calls = 0;
+
+static void close_headless_window(struct headless_window_t* w) {
+  if (w->closed)
+    return;
+  w->closed = true;
+  surface_destroy(&w->back);
+  scaler_destroy(&w->scaler);
+}
+
+bool window(struct window_t* s, const char* t, int w, int h, short flags) {
+  if (w <= 0 || h <= 0) {
+    GRAPHICS_ERROR(INVALID_PARAMETERS, "window() failed: invalid window size");
+    return false;
+  }
+
+  struct headless_window_t* win_data = GRAPHICS_MALLOC(sizeof(struct headless_window_t));
+  if (!win_data) {
+    GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+    return false;
+  }
+  memset(win_data, 0, sizeof(struct headless_window_t));
+  if (!surface(&win_data->back, w, h)) {
+    GRAPHICS_FREE(win_data);
+    return false;
+  }
+  struct window_node_t* head = window_push(windows, win_data);
+  if (!head) {
+    GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+    surface_destroy(&win_data->back);
+    GRAPHICS_FREE(win_data);
+    return false;
+  }
+  windows = head;
+  win_data->scale_mode = PRESENT_STRETCH;
+  win_data->id = headless_next_id++;
+  win_data->parent = s;
+
+  s->w = w;
+  s->h = h;
+  s->id = win_data->id;
+  s->window = win_data;
+  return true;
+}
+
+void window_icon(struct window_t* w, struct surface_t* b) {
+  return;
+}
+
+void window_title(struct window_t* w, const char* t) {
+  return;
+}
+
+void window_position(struct window_t* w, int* x, int* y) {
+  if (x)
+    *x = 0;
+  if (y)
+    *y = 0;
+}
+
+void screen_size(struct window_t* s, int* w, int* h) {
+  if (w)
+    *w = GRAPHICS_HEADLESS_SCREEN_W;
+  if (h)
+    *h = GRAPHICS_HEADLESS_SCREEN_H;
+}
+
+void window_destroy(struct window_t* w) {
+  struct headless_window_t* win = (struct headless_window_t*)w->window;
+  if (!win)
+    return;
+  close_headless_window(win);
+  windows = window_pop(windows, win);
+  GRAPHICS_SAFE_FREE(win);
+  w->window = NULL;
+}
+
+bool closed(struct window_t* w) {
+  struct headless_window_t* win = (struct headless_window_t*)w->window;
+  return !win || win->closed;
+}
+
+bool closed_va(int n, ...) {
+  va_list args;
+  va_start(args, n);
+  bool ret = true;
+  for (int i = 0; i < n; ++i) {
+    struct window_t* w = va_arg(args, struct window_t*);
+    if (!closed(w)) {
+      ret = false;
+      break;
+    }
+  }
+  va_end(args);
+  return ret;
+}
+
+bool closed_all() {
+  return windows == NULL;
+}
+
+void cursor_lock(struct window_t* w, bool lock) {
+  return;
+}
+
+void cursor_visible(struct window_t* w, bool visible) {
+  return;
+}
+
+void cursor_icon(struct window_t* w, enum cursor_type type) {
+  return;
+}
+
+void cursor_icon_custom(struct window_t* w, struct surface_t* b) {
+  return;
+}
+
+void cursor_pos(int* x, int* y) {
+  if (x)
+    *x = headless_cx;
+  if (y)
+    *y = headless_cy;
+}
+
+void cursor_set_pos(int x, int y) {
+  headless_cx = x;
+  headless_cy = y;
+}
+
+static struct window_t* event_window(int id) {
+  struct window_node_t* cursor = windows;
+  while (cursor) {
+    if (cursor->data->id == id)
+      return cursor->data->parent;
+    cursor = cursor->next;
+  }
+  return NULL;
+}
+
+void events() {
+  static struct window_t* e_window = NULL;
+  static struct headless_window_t* e_data = NULL;
+  io_dispatch();
+  ++script_calls;
+  while (script_pos < script_len && script[script_pos].when <= script_calls) {
+    struct headless_event_t* e = &script[script_pos++];
+    if (!(e_window = event_window(e->id)))
+      continue;
+    if (!(e_data = (struct headless_window_t*)e_window->window) || e_data->closed)
+      continue;
+    switch (e->type) {
+      case HEADLESS_KEY:
+        CBCALL(keyboard_callback, (enum key_sym)e->a, (enum key_mod)e->b, e->c != 0);
+        break;
+      case HEADLESS_BUTTON:
+        CBCALL(mouse_button_callback, (enum button)e->a, (enum key_mod)e->b, e->c != 0);
+        break;
+      case HEADLESS_MOVE:
+        CBCALL(mouse_move_callback, e->a, e->b, e->a - headless_cx, e->b - headless_cy);
+        headless_cx = e->a;
+        headless_cy = e->b;
+        break;
+      case HEADLESS_SCROLL:
+        CBCALL(scroll_callback, (enum key_mod)e->a, e->x, e->y);
+        break;
+      case HEADLESS_FOCUS:
+        CBCALL(focus_callback, e->a != 0);
+        break;
+      case HEADLESS_RESIZE: {
+        struct surface_t back;
+        if (e_window->w == e->a && e_window->h == e->b)
+          break;
+        if (!surface(&back, e->a, e->b))
+          break;
+        surface_destroy(&e_data->back);
+        e_data->back = back;
+        e_window->w = e->a;
+        e_window->h = e->b;
+        CBCALL(resize_callback, e->a, e->b);
+        break;
+      }
+      case HEADLESS_CLOSE:
+        /* Stays on the list, so window_destroy or release frees it */
+        close_headless_window(e_data);
+        if (e_window && e_window->closed_callback)
+          e_window->closed_callback(e_window->parent);
+        break;
+    }
+  }
+}
+
+static bool headless_parse(const char* line, struct headless_event_t* e) {
+  char name[16];
+  int n = 0;
+  memset(e, 0, sizeof(struct headless_event_t));
+  if (sscanf(line, "%d %d %15s %n", &e->when, &e->id, name, &n) != 3)
+    return false;
+  line += n;
+  if (!strcmp(name, "key")) {
+    e->type = HEADLESS_KEY;
+    return sscanf(line, "%d %d %d", &e->a, &e->b, &e->c) == 3;
+  } else if (!strcmp(name, "button")) {
+    e->type = HEADLESS_BUTTON;
+    return sscanf(line, "%d %d %d", &e->a, &e->b, &e->c) == 3;
+  } else if (!strcmp(name, "move")) {
+    e->type = HEADLESS_MOVE;
+    return sscanf(line, "%d %d", &e->a, &e->b) == 2;
+  } else if (!strcmp(name, "scroll")) {
+    e->type = HEADLESS_SCROLL;
+    return sscanf(line, "%d %f %f", &e->a, &e->x, &e->y) == 3;
+  } else if (!strcmp(name, "focus")) {
+    e->type = HEADLESS_FOCUS;
+    return sscanf(line, "%d", &e->a) == 1;
+  } else if (!strcmp(name, "resize")) {
+    e->type = HEADLESS_RESIZE;
+    return sscanf(line, "%d %d", &e->a, &e->b) == 2 && e->a > 0 && e->b > 0;
+  } else if (!strcmp(name, "close")) {
+    e->type = HEADLESS_CLOSE;
+    return true;
+  }
+  return false;
+}
+
+bool headless_script(const char* path) {
+  GRAPHICS_SAFE_FREE(script);
+  script_len = script_pos = script_calls = 0;
+  if (!path)
+    return true;
+
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    GRAPHICS_ERROR(FILE_OPEN_FAILED, "fopen() failed: %s", path);
+    return false;
+  }
+
+  char line[256];
+  int cap = 0, ln = 0;
+  struct headless_event_t e;
+  while (fgets(line, sizeof(line), fp)) {
+    ++ln;
+    char* p = line;
+    while (isspace((unsigned char)*p))
+      ++p;
+    if (!*p || *p == '#')
+      continue;
+    if (!headless_parse(p, &e)) {
+      GRAPHICS_ERROR(INVALID_PARAMETERS, "headless_script() failed: %s:%d isn't a valid event", path, ln);
+      fclose(fp);
+      GRAPHICS_SAFE_FREE(script);
+      script_len = 0;
+      return false;
+    }
+    if (script_len == cap) {
+      cap = cap ? cap * 2 : 64;
+      struct headless_event_t* tmp = GRAPHICS_REALLOC(script, cap * sizeof(struct headless_event_t));
+      if (!tmp) {
+        GRAPHICS_ERROR(OUT_OF_MEMEORY, "realloc() failed");
+        fclose(fp);
+        GRAPHICS_SAFE_FREE(script);
+        script_len = 0;
+        return false;
+      }
+      script = tmp;
+    }
+    /* Kept in order of when, events for the same call stay in file order */
+    int i = script_len++;
+    for (; i > 0 && script[i - 1].when > e.when; --i)
+      script[i] = script[i - 1];
+    script[i] = e;
+  }
+  fclose(fp);
+  return true;
+}
+
+void headless_output(const char* fmt) {
+  GRAPHICS_SAFE_FREE(headless_fmt);
+  if (!fmt)
+    return;
+  size_t len = strlen(fmt) + 1;
+  if (!(headless_fmt = GRAPHICS_MALLOC(len))) {
+    GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+    return;
+  }
+  memcpy(headless_fmt, fmt, len);
+}
+
+void headless_callback(void(*cb)(struct window_t*, struct surface_t*, int)) {
+  headless_cb = cb;
+}
+
+bool window_surface(struct window_t* w, struct surface_t* s) {
+  struct headless_window_t* tmp = (struct headless_window_t*)w->window;
+  if (!tmp || tmp->closed) {
+    GRAPHICS_ERROR(INVALID_PARAMETERS, "window_surface() failed: window has no back buffer");
+    return false;
+  }
+  return subsurface(&tmp->back, 0, 0, tmp->back.w, tmp->back.h, s);
+}
+
+bool window_present_async(struct window_t* w, int buffers) {
+  struct headless_window_t* tmp = (struct headless_window_t*)w->window;
+  if (!tmp || tmp->closed || buffers < 0 || buffers > 3) {
+    GRAPHICS_ERROR(INVALID_PARAMETERS, "window_present_async() failed: invalid window or buffer count");
+    return false;
+  }
+  /* Nothing to overlap with, frames are always presented in flush */
+  return true;
+}
+
+void window_present_scale(struct window_t* w, enum present_scale mode) {
+  struct headless_window_t* tmp = (struct headless_window_t*)w->window;
+  if (tmp)
+    tmp->scale_mode = mode;
+}
 
-#if defined(GRAPHICS_OSX)
+void flush(struct window_t* w, struct surface_t* b) {
+  if (!w)
+    return;
+  struct headless_window_t* tmp = (struct headless_window_t*)w->window;
+  if (!tmp || tmp->closed)
+    return;
+  struct surface_t* back = &tmp->back;
+  if (surface_root(b) != back) {
+    bool moved;
+    if (b->w != back->w || b->h != back->h) {
+      if (!scaler_update(&tmp->scaler, b->w, b->h, back->w, back->h, tmp->scale_mode, &moved))
+        return;
+      scaler_bars(&tmp->scaler, back);
+      scaler_run(&tmp->scaler, b, back, 0, 0, back->w, back->h);
+    } else if (!b->parent && b->damage) {
+      /* The framebuffer keeps the last frame, only what changed is copied */
+      for (int i = 0; i < b->damage->count; ++i) {
+        struct rect_t* r = &b->damage->rects[i];
+        for (int y = r->y; y < r->y + r->h; ++y)
+          memcpy(&__PIXEL(back, r->x, y), &__PIXEL(b, r->x, y), r->w * sizeof(int));
+      }
+    } else
+      for (int y = 0; y < b->h; ++y)
+        memcpy(__ROW(back, y), __ROW(b, y), b->w * sizeof(int));
+  }
+  surface_damage_clear(b);
+
+  if (headless_cb)
+    headless_cb(w, back, tmp->frame);
+  if (headless_fmt) {
+    char path[1024];
+    snprintf(path, sizeof(path), headless_fmt, tmp->id, tmp->frame);
+    save_bmp(back, path);
+  }
+  tmp->frame++;
+}
+
+void release() {
+  io_destroy();
+  thread_pool_destroy();
+  struct window_node_t *tmp = NULL, *cursor = windows;
+  while (cursor) {
+    tmp = cursor->next;
+    close_headless_window(cursor->data);
+    GRAPHICS_SAFE_FREE(cursor->data);
+    GRAPHICS_SAFE_FREE(cursor);
+    cursor = tmp;
+  }
+  windows = NULL;
+  headless_script(NULL);
+  headless_output(NULL);
+}
+#elif defined(GRAPHICS_OSX)
 #include <Cocoa/Cocoa.h>
 
 #if MAC_OS_X_VERSION_MAX_ALLOWED < MAC_OS_X_VERSION_10_12
@@ -1563,6 +5817,9 @@ void window_size(struct window_t* s, int* w, int* h) {
 #define CGContext graphicsPort
 #endif
 
+static short keycodes[512];
+static bool keycodes_init = false;
+
 static inline int translate_mod(NSUInteger flags) {
   int mods = 0;
   
@@ -1775,8 +6032,8 @@ static inline NSImage* create_cocoa_image(struct surface_t* s) {
   
   CGContextRef ctx = (CGContextRef)[[NSGraphicsContext currentContext] CGContext];
   CGColorSpaceRef s = CGColorSpaceCreateDeviceRGB();
-  CGDataProviderRef p = CGDataProviderCreateWithData(NULL, _buffer->buf, _buffer->w * _buffer->h * 4, NULL);
-  CGImageRef img = CGImageCreate(_buffer->w, _buffer->h, 8, 32, _buffer->w * 4, s, kCGImageAlphaNoneSkipFirst | kCGBitmapByteOrder32Little, p, NULL, 0, kCGRenderingIntentDefault);
+  CGDataProviderRef p = CGDataProviderCreateWithData(NULL, _buffer->buf, ((_buffer->h - 1) * _buffer->pitch + _buffer->w) * 4, NULL);
+  CGImageRef img = CGImageCreate(_buffer->w, _buffer->h, 8, 32, _buffer->pitch * 4, s, kCGImageAlphaNoneSkipFirst | kCGBitmapByteOrder32Little, p, NULL, 0, kCGRenderingIntentDefault);
   /* This line causes Visual Studio to crash if uncommented. I don't know why and I don't want to know.
    Not the whole line though, just the `[self frame]` parts. This has caused me an issue for over a month.
    `CGContextDrawImage(ctx, CGRectMake(0, 0, [self frame].size.width, [self frame].size.height), img);` */
@@ -2219,6 +6476,7 @@ struct window_t* event_delegate(NSInteger window_id) {
 }
 
 void events() {
+  io_dispatch();
   NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
   NSEvent* e = nil;
   while ((e = [NSApp nextEventMatchingMask:NSEventMaskAny
@@ -2266,6 +6524,22 @@ void events() {
   [pool release];
 }
 
+bool window_surface(struct window_t* w, struct surface_t* s) {
+  GRAPHICS_ERROR(UNKNOWN_ERROR, "window_surface() isn't supported on this platform");
+  return false;
+}
+
+bool window_present_async(struct window_t* w, int buffers) {
+  if (buffers < 2)
+    return true;
+  GRAPHICS_ERROR(UNKNOWN_ERROR, "window_present_async() isn't supported on this platform");
+  return false;
+}
+
+void window_present_scale(struct window_t* w, enum present_scale mode) {
+  return;
+}
+
 void flush(struct window_t* s, struct surface_t* b) {
   if (!s)
     return;
@@ -2274,9 +6548,12 @@ void flush(struct window_t* s, struct surface_t* b) {
     return;
   [tmp view].buffer = b;
   [[tmp view] setNeedsDisplay:YES];
+  surface_damage_clear(b);
 }
 
 void release() {
+  io_destroy();
+  thread_pool_destroy();
   struct window_node_t *cursor = windows, *tmp = NULL;
   while (cursor) {
     tmp = cursor->next;
@@ -2292,6 +6569,9 @@ void release() {
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+static short keycodes[512];
+static bool keycodes_init = false;
+
 struct win32_window_t {
   WNDCLASS wnd;
   HWND hwnd;
@@ -2388,7 +6668,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
     case WM_PAINT:
       if (!e_data->buffer)
         break;
-      e_data->bmpinfo->bmiHeader.biWidth = e_data->buffer->w;
+      e_data->bmpinfo->bmiHeader.biWidth = e_data->buffer->pitch;
       e_data->bmpinfo->bmiHeader.biHeight = -e_data->buffer->h;
       StretchDIBits(e_data->hdc, 0, 0, e_window->w, e_window->h, 0, 0, e_data->buffer->w, e_data->buffer->h, e_data->buffer->buf, e_data->bmpinfo, DIB_RGB_COLORS, SRCCOPY);
       ValidateRect(hWnd, NULL);
@@ -2799,11 +7079,22 @@ bool window(struct window_t* s, const char* t, int w, int h, short flags) {
   return true;
 }
 
+static HBITMAP create_win32_bitmap(struct surface_t* b) {
+  if (b->pitch == b->w)
+    return CreateBitmap(b->w, b->h, 1, 32, b->buf);
+  struct surface_t tmp;
+  if (!copy(b, &tmp))
+    return NULL;
+  HBITMAP ret = CreateBitmap(tmp.w, tmp.h, 1, 32, tmp.buf);
+  surface_destroy(&tmp);
+  return ret;
+}
+
 void window_icon(struct window_t* s, struct surface_t* b) {
   struct win32_window_t* win = (struct win32_window_t*)s->window;
   HBITMAP hbmp = NULL, bmp_mask = NULL;
 
-  if (!(hbmp = CreateBitmap(b->w, b->h, 1, 32, b->buf)))
+  if (!(hbmp = create_win32_bitmap(b)))
     goto FAILED;
   if (!(bmp_mask = CreateCompatibleBitmap(GetDC(NULL), b->w / 2, b->h / 2)))
     goto FAILED;
@@ -2951,7 +7242,7 @@ void cursor_icon_custom(struct window_t* s, struct surface_t* b) {
   struct win32_window_t* win = (struct win32_window_t*)s->window;
   HBITMAP hbmp = NULL, bmp_mask = NULL;
 
-  if (!(hbmp = CreateBitmap(b->w, b->h, 1, 32, b->buf)))
+  if (!(hbmp = create_win32_bitmap(b)))
     goto FAILED;
   if (!(bmp_mask = CreateCompatibleBitmap(GetDC(NULL), b->w, b->h)))
     goto FAILED;
@@ -2995,6 +7286,7 @@ void cursor_set_pos(int x, int y) {
 
 void events() {
   static MSG msg;
+  io_dispatch();
   ZeroMemory(&msg, sizeof(MSG));
   if (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
     TranslateMessage(&msg);
@@ -3002,6 +7294,22 @@ void events() {
   }
 }
 
+bool window_surface(struct window_t* w, struct surface_t* s) {
+  GRAPHICS_ERROR(UNKNOWN_ERROR, "window_surface() isn't supported on this platform");
+  return false;
+}
+
+bool window_present_async(struct window_t* w, int buffers) {
+  if (buffers < 2)
+    return true;
+  GRAPHICS_ERROR(UNKNOWN_ERROR, "window_present_async() isn't supported on this platform");
+  return false;
+}
+
+void window_present_scale(struct window_t* w, enum present_scale mode) {
+  return;
+}
+
 void flush(struct window_t* s, struct surface_t* b) {
   if (!s)
     return;
@@ -3011,9 +7319,12 @@ void flush(struct window_t* s, struct surface_t* b) {
   tmp->buffer = b;
   InvalidateRect(tmp->hwnd, NULL, TRUE);
   SendMessage(tmp->hwnd, WM_PAINT, 0, 0);
+  surface_damage_clear(b);
 }
 
 void release() {
+  io_destroy();
+  thread_pool_destroy();
   struct window_node_t *tmp = NULL, *cursor = windows;
   while (cursor) {
     tmp = cursor->next;
@@ -3035,11 +7346,18 @@ void release() {
 #if defined(GRAPHICS_HAS_X11VMEXT)
 #include <X11/extensions/xf86vmode.h>
 #endif
+#if defined(GRAPHICS_HAS_X11SHM)
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
 
 static Display* display = None;
 static int screen = None;
 static Window root_window = None;
 static Cursor empty_cursor = None;
+static short keycodes[512];
+static bool keycodes_init = false;
 
 struct nix_window_t {
   Window window;
@@ -3047,18 +7365,284 @@ struct nix_window_t {
   GC gc;
   XImage* img;
   Cursor cursor;
-  bool mouse_inside, cursor_locked, cursor_vis, closed;
+  bool mouse_inside, cursor_locked, cursor_vis, closed, exposed;
   int depth, cursor_lx, cursor_ly;
-  struct surface_t scaler;
+  /* Window sized buffer, scaled frames are drawn into it. It's only
+   * reallocated when the window grows past back_cap pixels */
+  struct surface_t back;
+  int back_cap;
+  struct scaler_t scaler;
+  enum present_scale scale_mode;
+#if defined(GRAPHICS_HAS_X11SHM)
+  XImage* shm_img;
+  XShmSegmentInfo shm;
+#endif
+  /* Present thread, NULL when flush presents synchronously */
+  struct nix_present_t* present;
   struct window_t* parent;
 };
 
+#if defined(GRAPHICS_HAS_X11SHM)
+/* -1 until the first window checks for the extension */
+static int shm_available = -1;
+static bool shm_failed = false;
+
+static int shm_error_handler(Display* d, XErrorEvent* e) {
+  shm_failed = true;
+  return 0;
+}
+
+/* Put the back buffer in shared memory, false if the server can't attach it
+ * (e.g. a remote display), in which case the caller uses normal memory */
+static bool nix_window_shm(struct nix_window_t* w, int width, int height) {
+  if (shm_available == -1)
+    shm_available = XShmQueryExtension(display);
+  if (!shm_available)
+    return false;
+  if (!(w->shm_img = XShmCreateImage(display, DefaultVisual(display, screen), w->depth, ZPixmap, NULL, &w->shm, width, height)))
+    return false;
+  w->shm.shmid = shmget(IPC_PRIVATE, w->shm_img->bytes_per_line * height, IPC_CREAT | 0600);
+  if (w->shm.shmid == -1) {
+    XDestroyImage(w->shm_img);
+    w->shm_img = NULL;
+    return false;
+  }
+  w->shm.shmaddr = w->shm_img->data = shmat(w->shm.shmid, NULL, 0);
+  w->shm.readOnly = False;
+  shm_failed = false;
+  int (*handler)(Display*, XErrorEvent*) = XSetErrorHandler(shm_error_handler);
+  if (w->shm.shmaddr != (char*)-1)
+    XShmAttach(display, &w->shm);
+  XSync(display, False);
+  XSetErrorHandler(handler);
+  /* Marked for removal now so it goes away with the last detach, even on a crash */
+  shmctl(w->shm.shmid, IPC_RMID, NULL);
+  if (w->shm.shmaddr == (char*)-1 || shm_failed) {
+    if (w->shm.shmaddr != (char*)-1)
+      shmdt(w->shm.shmaddr);
+    w->shm_img->data = NULL;
+    XDestroyImage(w->shm_img);
+    w->shm_img = NULL;
+    shm_available = !shm_failed;
+    return false;
+  }
+  w->back.buf = (int*)w->shm.shmaddr;
+  w->back.w = width;
+  w->back.h = height;
+  w->back.pitch = w->shm_img->bytes_per_line / 4;
+  w->back.parent = NULL;
+  w->back.damage = NULL;
+  return true;
+}
+#endif
+
+static bool nix_window_back(struct nix_window_t* w, int width, int height) {
+#if defined(GRAPHICS_HAS_X11SHM)
+  if (nix_window_shm(w, width, height))
+    return true;
+#endif
+  w->back_cap = width * height;
+  return surface(&w->back, width, height);
+}
+
+static void nix_window_back_destroy(struct nix_window_t* w);
+
+/* Fit the back buffer to the window, on failure the old buffer is kept */
+static bool nix_window_back_resize(struct nix_window_t* w, int width, int height) {
+  struct damage_t* damage = w->back.damage;
+  bool fits = (long long)width * height <= w->back_cap;
+#if defined(GRAPHICS_HAS_X11SHM)
+  if (w->shm_img)
+    fits = width <= w->shm_img->width && height <= w->shm_img->height;
+#endif
+  if (fits) {
+    w->back.w = width;
+    w->back.h = height;
+#if defined(GRAPHICS_HAS_X11SHM)
+    if (!w->shm_img)
+#endif
+      w->back.pitch = width;
+  } else {
+    struct nix_window_t old = *w;
+#if defined(GRAPHICS_HAS_X11SHM)
+    w->shm_img = NULL;
+#endif
+    if (!nix_window_back(w, width, height)) {
+      *w = old;
+      return false;
+    }
+    old.back.damage = NULL;
+    nix_window_back_destroy(&old);
+    w->back.damage = damage;
+  }
+  if (damage)
+    surface_damage_track(&w->back, true);
+  return true;
+}
+
+static void nix_window_back_destroy(struct nix_window_t* w) {
+#if defined(GRAPHICS_HAS_X11SHM)
+  if (w->shm_img) {
+    XShmDetach(display, &w->shm);
+    XSync(display, False);
+    shmdt(w->shm.shmaddr);
+    w->shm_img->data = NULL;
+    XDestroyImage(w->shm_img);
+    w->shm_img = NULL;
+    GRAPHICS_SAFE_FREE(w->back.damage);
+    memset(&w->back, 0, sizeof(struct surface_t));
+    return;
+  }
+#endif
+  if (w->back.buf)
+    surface_destroy(&w->back);
+}
+
+#if !defined(GRAPHICS_NO_THREADS)
+/* Set on the mailbox slot until the present thread takes the frame */
+#define PRESENT_NEW 4
+
+/* Frames rendered by flush are presented on another thread with its own
+ * connection to the display, so the upload overlaps drawing the next frame.
+ * Slots change hands through mailbox by atomic swaps: flush owns back, the
+ * present thread owns front, and mailbox holds the latest finished frame.
+ * With three buffers flush never waits and frames the present thread didn't
+ * get to are dropped. With two there's no front, the present thread reads
+ * the mailbox slot and flush waits for it before handing over the next */
+struct nix_present_t {
+  struct nix_window_t* win;
+  Display* display;
+  GC gc;
+  XImage* img[3];
+  struct surface_t slots[3];
+  int buffers, back, front;
+  volatile int mailbox, quit;
+  unsigned int published, presented;
+  thread_handle_t thread;
+  thread_mutex_t lock;
+  thread_cond_t wake, done;
+};
+
+static void nix_present_thread(void* arg) {
+  struct nix_present_t* p = (struct nix_present_t*)arg;
+  int slot;
+  thread_mutex_lock(&p->lock);
+  for (;;) {
+    while (!p->quit && !(thread_atomic_load(&p->mailbox) & PRESENT_NEW))
+      thread_cond_wait(&p->wake, &p->lock);
+    if (p->quit)
+      break;
+    thread_mutex_unlock(&p->lock);
+    if (p->buffers == 3)
+      slot = p->front = thread_atomic_swap(&p->mailbox, p->front) & ~PRESENT_NEW;
+    else
+      slot = thread_atomic_swap(&p->mailbox, thread_atomic_load(&p->mailbox) & ~PRESENT_NEW) & ~PRESENT_NEW;
+    /* Xlib has written the pixels out once XPutImage returns */
+    XPutImage(p->display, p->win->window, p->gc, p->img[slot], 0, 0, 0, 0, p->slots[slot].w, p->slots[slot].h);
+    XFlush(p->display);
+    thread_mutex_lock(&p->lock);
+    p->presented++;
+    thread_cond_broadcast(&p->done);
+  }
+  thread_mutex_unlock(&p->lock);
+}
+
+static void nix_present_free(struct nix_present_t* p) {
+  for (int i = 0; i < 3; ++i) {
+    if (p->img[i]) {
+      p->img[i]->data = NULL;
+      XDestroyImage(p->img[i]);
+    }
+    if (p->slots[i].buf)
+      surface_destroy(&p->slots[i]);
+  }
+  XFreeGC(p->display, p->gc);
+  XCloseDisplay(p->display);
+  GRAPHICS_FREE(p);
+}
+
+static void nix_present_stop(struct nix_window_t* w) {
+  struct nix_present_t* p = w->present;
+  if (!p)
+    return;
+  thread_mutex_lock(&p->lock);
+  p->quit = true;
+  thread_cond_signal(&p->wake);
+  thread_mutex_unlock(&p->lock);
+  thread_join(p->thread);
+  thread_cond_destroy(&p->wake);
+  thread_cond_destroy(&p->done);
+  thread_mutex_destroy(&p->lock);
+  nix_present_free(p);
+  w->present = NULL;
+}
+
+static bool nix_present_start(struct nix_window_t* w, int buffers, int width, int height) {
+  struct nix_present_t* p = GRAPHICS_MALLOC(sizeof(struct nix_present_t));
+  if (!p) {
+    GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
+    return false;
+  }
+  memset(p, 0, sizeof(struct nix_present_t));
+  if (!(p->display = XOpenDisplay(DisplayString(display)))) {
+    GRAPHICS_FREE(p);
+    GRAPHICS_ERROR(NIX_OPEN_DISPLAY_FAILED, "XOpenDisplay() failed");
+    return false;
+  }
+  p->win = w;
+  p->buffers = buffers;
+  p->gc = XCreateGC(p->display, w->window, 0, NULL);
+  for (int i = 0; i < buffers; ++i) {
+    if (!surface(&p->slots[i], width, height)) {
+      nix_present_free(p);
+      return false;
+    }
+    p->img[i] = XCreateImage(p->display, DefaultVisual(p->display, DefaultScreen(p->display)), w->depth, ZPixmap, 0, (char*)p->slots[i].buf, width, height, 32, width * 4);
+  }
+  p->back = 0;
+  p->mailbox = 1;
+  p->front = 2;
+  thread_mutex_init(&p->lock);
+  thread_cond_init(&p->wake);
+  thread_cond_init(&p->done);
+  if (!thread_create(&p->thread, nix_present_thread, p)) {
+    GRAPHICS_ERROR(UNKNOWN_ERROR, "thread_create() failed");
+    thread_cond_destroy(&p->wake);
+    thread_cond_destroy(&p->done);
+    thread_mutex_destroy(&p->lock);
+    nix_present_free(p);
+    return false;
+  }
+  w->present = p;
+  return true;
+}
+
+/* Hand the back slot to the present thread and take a free one */
+static void nix_present_publish(struct nix_present_t* p) {
+  if (p->buffers == 2) {
+    thread_mutex_lock(&p->lock);
+    while (p->presented != p->published)
+      thread_cond_wait(&p->done, &p->lock);
+    thread_mutex_unlock(&p->lock);
+  }
+  p->published++;
+  int prev = thread_atomic_swap(&p->mailbox, p->back | PRESENT_NEW);
+  p->back = prev & ~PRESENT_NEW;
+  thread_mutex_lock(&p->lock);
+  thread_cond_signal(&p->wake);
+  thread_mutex_unlock(&p->lock);
+}
+#else
+static void nix_present_stop(struct nix_window_t* w) {}
+#endif
+
 static void close_nix_window(struct nix_window_t* w) {
   if (w->closed)
     return;
   w->closed = true;
-  if (w->scaler.buf)
-    surface_destroy(&w->scaler);
+  nix_present_stop(w);
+  nix_window_back_destroy(w);
+  scaler_destroy(&w->scaler);
   w->img->data = NULL;
   XDestroyImage(w->img);
   XDestroyWindow(display, w->window);
@@ -3344,6 +7928,7 @@ bool window(struct window_t* s, const char* t, int w, int h, short flags) {
     GRAPHICS_ERROR(OUT_OF_MEMEORY, "malloc() failed");
     return false;
   }
+  memset(win_data, 0, sizeof(struct nix_window_t));
 
   int screen_w = DisplayWidth(display, screen);
   int screen_h = DisplayHeight(display, screen);
@@ -3364,7 +7949,7 @@ bool window(struct window_t* s, const char* t, int w, int h, short flags) {
   int format_c = 0;
   XPixmapFormatValues* formats = XListPixmapFormats(display, &format_c);
   int depth = DefaultDepth(display, screen);
-  int depth_c;
+  int depth_c = 0;
   for (int i = 0; i < format_c; ++i)
     if (depth == formats[i].depth) {
       depth_c = formats[i].bits_per_pixel;
@@ -3374,7 +7959,7 @@ bool window(struct window_t* s, const char* t, int w, int h, short flags) {
 
   if (depth_c != 32) {
     GRAPHICS_ERROR(NIX_WINDOW_CREATION_FAILED, "Invalid display depth: %d", depth_c);
-    return false;
+    goto FAILED;
   }
 
   XSetWindowAttributes swa;
@@ -3384,7 +7969,7 @@ bool window(struct window_t* s, const char* t, int w, int h, short flags) {
   swa.backing_store = NotUseful;
   if (!(win_data->window = XCreateWindow(display, root_window, x, y, w, h, 0, depth, InputOutput, visual, CWBackPixel | CWBorderPixel | CWBackingStore, &swa))) {
     GRAPHICS_ERROR(NIX_WINDOW_CREATION_FAILED, "XCreateWindow() failed");
-    return false;
+    goto FAILED;
   }
 
   win_data->wm_del = XInternAtom(display, "WM_DELETE_WINDOW", False);
@@ -3451,8 +8036,16 @@ bool window(struct window_t* s, const char* t, int w, int h, short flags) {
   get_cursor_pos(&win_data->cursor_lx, &win_data->cursor_ly);
   win_data->img = XCreateImage(display, CopyFromParent, depth, ZPixmap, 0, NULL, w, h, 32, w * 4);
   win_data->depth = depth;
-  memset(&win_data->scaler, 0, sizeof(struct surface_t));
+#if defined(GRAPHICS_HAS_X11SHM)
+  win_data->shm_img = NULL;
+#endif
+  win_data->present = NULL;
+  memset(&win_data->scaler, 0, sizeof(struct scaler_t));
+  win_data->scale_mode = PRESENT_STRETCH;
+  if (!win_data->img || !nix_window_back(win_data, w, h))
+    goto FAILED;
   win_data->closed = false;
+  win_data->exposed = true;
 
   windows = window_push(windows, win_data);
   s->w = w;
@@ -3462,6 +8055,20 @@ bool window(struct window_t* s, const char* t, int w, int h, short flags) {
   win_data->parent = s;
 
   return true;
+
+FAILED:
+  if (win_data->img) {
+    win_data->img->data = NULL;
+    XDestroyImage(win_data->img);
+  }
+  if (win_data->cursor)
+    XFreeCursor(display, win_data->cursor);
+  if (win_data->window) {
+    XDestroyWindow(display, win_data->window);
+    XFlush(display);
+  }
+  GRAPHICS_FREE(win_data);
+  return false;
 }
 
 void window_icon(struct window_t* w, struct surface_t* b) {
@@ -3561,6 +8168,7 @@ void events() {
   static XEvent e;
   static struct window_t* e_window = NULL;
   static struct nix_window_t* e_data = NULL;
+  io_dispatch();
   while (XPending(display)) {
     XNextEvent(display, &e);
     if (!(e_window = event_window(e.xclient.window)))
@@ -3608,19 +8216,33 @@ void events() {
         h = e.xconfigure.height;
         if (e_window->w == w && e_window->h == h)
           break;
-        CBCALL(resize_callback, w, h);
+        if (!nix_window_back_resize(e_data, w, h)) {
+          /* Keep presenting at the old size, the next ConfigureNotify retries */
+          break;
+        }
         e_window->w = w;
         e_window->h = h;
         if (e_data->img) {
           e_data->img->data = NULL;
           XDestroyImage(e_data->img);
         }
-        if (e_data->scaler.buf)
-          surface_destroy(&e_data->scaler);
         e_data->img = XCreateImage(display, CopyFromParent, e_data->depth, ZPixmap, 0, NULL, w, h, 32, w * 4);
-        surface(&e_data->scaler, w, h);
+#if !defined(GRAPHICS_NO_THREADS)
+        if (e_data->present) {
+          int buffers = e_data->present->buffers;
+          nix_present_stop(e_data);
+          nix_present_start(e_data, buffers, w, h);
+        }
+#endif
+        e_data->exposed = true;
+        /* After the back buffer is replaced, so window_surface works in the callback */
+        CBCALL(resize_callback, w, h);
         break;
       }
+      case Expose:
+        /* The window contents are gone, so the next flush can't rely on damage */
+        e_data->exposed = true;
+        break;
       case EnterNotify:
       case LeaveNotify:
         e_data->mouse_inside = e.type == EnterNotify;
@@ -3650,26 +8272,159 @@ void events() {
   }
 }
 
+bool window_surface(struct window_t* w, struct surface_t* s) {
+  struct nix_window_t* tmp = (struct nix_window_t*)w->window;
+  if (!tmp || tmp->closed || !tmp->back.buf) {
+    GRAPHICS_ERROR(INVALID_PARAMETERS, "window_surface() failed: window has no back buffer");
+    return false;
+  }
+  struct surface_t* back = &tmp->back;
+#if !defined(GRAPHICS_NO_THREADS)
+  if (tmp->present)
+    back = &tmp->present->slots[tmp->present->back];
+#endif
+  return subsurface(back, 0, 0, back->w, back->h, s);
+}
+
+bool window_present_async(struct window_t* w, int buffers) {
+  struct nix_window_t* tmp = (struct nix_window_t*)w->window;
+  if (!tmp || tmp->closed || buffers < 0 || buffers > 3) {
+    GRAPHICS_ERROR(INVALID_PARAMETERS, "window_present_async() failed: invalid window or buffer count");
+    return false;
+  }
+  nix_present_stop(tmp);
+  if (buffers < 2)
+    return true;
+#if defined(GRAPHICS_NO_THREADS)
+  GRAPHICS_ERROR(UNKNOWN_ERROR, "window_present_async() failed: built without threads");
+  return false;
+#else
+  return nix_present_start(tmp, buffers, w->w, w->h);
+#endif
+}
+
+void window_present_scale(struct window_t* w, enum present_scale mode) {
+  struct nix_window_t* tmp = (struct nix_window_t*)w->window;
+  if (tmp)
+    tmp->scale_mode = mode;
+}
+
+/* Upload part of the back buffer, or of b when it can be sent as it is */
+static inline void nix_window_put(struct nix_window_t* w, struct surface_t* b, struct rect_t* r) {
+#if defined(GRAPHICS_HAS_X11SHM)
+  if (w->shm_img) {
+    XShmPutImage(display, w->window, w->gc, w->shm_img, r->x, r->y, r->x, r->y, r->w, r->h, False);
+    return;
+  }
+#endif
+  w->img->data = (char*)b->buf;
+  w->img->bytes_per_line = b->pitch * 4;
+  XPutImage(display, w->window, w->gc, w->img, r->x, r->y, r->x, r->y, r->w, r->h);
+}
+
 void flush(struct window_t* w, struct surface_t* b) {
   if (!w)
     return;
   struct nix_window_t* tmp = (struct nix_window_t*)w->window;
-  if (!tmp || tmp->closed)
+  if (!tmp || tmp->closed || !tmp->back.buf)
     return;
-  if (b->w != w->w || b->h != w->h) {
-    __resize(b, &tmp->scaler);
-    tmp->img->data = (char*)tmp->scaler.buf;
-  } else
-    tmp->img->data = (char*)b->buf;
-  XPutImage(display, tmp->window, tmp->gc, tmp->img, 0, 0, 0, 0, w->w, w->h);
+#if !defined(GRAPHICS_NO_THREADS)
+  if (tmp->present) {
+    /* Frames are presented whole, the slot holds a frame from a few flushes ago */
+    struct surface_t* slot = &tmp->present->slots[tmp->present->back];
+    bool moved;
+    if (surface_root(b) != slot) {
+      if (b->w != slot->w || b->h != slot->h) {
+        if (!scaler_update(&tmp->scaler, b->w, b->h, slot->w, slot->h, tmp->scale_mode, &moved))
+          return;
+        scaler_bars(&tmp->scaler, slot);
+        scaler_run(&tmp->scaler, b, slot, 0, 0, slot->w, slot->h);
+      } else
+        for (int y = 0; y < b->h; ++y)
+          memcpy(__ROW(slot, y), __ROW(b, y), b->w * sizeof(int));
+    }
+    surface_damage_clear(b);
+    nix_present_publish(tmp->present);
+    tmp->exposed = false;
+    return;
+  }
+#endif
+  struct surface_t *back = &tmp->back, *from = surface_root(b) == back ? back : b;
+  bool scaled = from != back && (b->w != w->w || b->h != w->h);
+  struct damage_t* damage = from == back ? back->damage : (b->parent ? NULL : b->damage);
+  struct rect_t rects[GRAPHICS_DAMAGE_RECTS];
+  bool full = tmp->exposed || !damage, moved;
+  int i, n = 1;
+
+  /* Areas of the frame to present */
+  if (full) {
+    rects[0].x = rects[0].y = 0;
+    rects[0].w = from->w;
+    rects[0].h = from->h;
+  } else {
+    n = damage->count;
+    memcpy(rects, damage->rects, n * sizeof(struct rect_t));
+  }
+  if (scaled) {
+    struct rect_t* d = &tmp->scaler.dst;
+    if (!scaler_update(&tmp->scaler, b->w, b->h, w->w, w->h, tmp->scale_mode, &moved))
+      return;
+    if (full || moved) {
+      scaler_bars(&tmp->scaler, back);
+      n = 1;
+      rects[0].x = rects[0].y = 0;
+      rects[0].w = w->w;
+      rects[0].h = w->h;
+    }
+    for (i = 0; i < n; ++i) {
+      /* Widened by a pixel so every window pixel sampling the area is redrawn */
+      struct rect_t* r = &rects[i];
+      if (!full && !moved) {
+        int x0 = d->x + (int)__MAX((long long)r->x * d->w / b->w - 1, 0);
+        int y0 = d->y + (int)__MAX((long long)r->y * d->h / b->h - 1, 0);
+        int x1 = d->x + (int)__MIN(((long long)(r->x + r->w) * d->w + b->w - 1) / b->w + 1, d->w);
+        int y1 = d->y + (int)__MIN(((long long)(r->y + r->h) * d->h + b->h - 1) / b->h + 1, d->h);
+        r->x = x0;
+        r->y = y0;
+        r->w = x1 - x0;
+        r->h = y1 - y0;
+      }
+      scaler_run(&tmp->scaler, b, back, r->x, r->y, r->x + r->w, r->y + r->h);
+    }
+    from = back;
+  }
+#if defined(GRAPHICS_HAS_X11SHM)
+  else if (tmp->shm_img) {
+    /* Into shared memory, a copy here is far cheaper than through the socket */
+    for (i = 0; i < n; ++i)
+      for (int y = rects[i].y; y < rects[i].y + rects[i].h; ++y)
+        memcpy(&__PIXEL(back, rects[i].x, y), &__PIXEL(b, rects[i].x, y), rects[i].w * sizeof(int));
+    from = back;
+  }
+#endif
+  for (i = 0; i < n; ++i)
+    nix_window_put(tmp, from, &rects[i]);
+  tmp->exposed = false;
+  tmp->img->bytes_per_line = w->w * 4;
+  surface_damage_clear(b);
+#if defined(GRAPHICS_HAS_X11SHM)
+  /* The server reads shared memory after the request is handled, so wait for
+   * that before the buffer can be drawn to again */
+  if (tmp->shm_img) {
+    XSync(display, False);
+    return;
+  }
+#endif
   XFlush(display);
 }
 
 void release() {
+  io_destroy();
+  thread_pool_destroy();
   struct window_node_t *tmp = NULL, *cursor = windows;
   while (cursor) {
     tmp = cursor->next;
-    close_nix_window(tmp->data);
+    close_nix_window(cursor->data);
     GRAPHICS_SAFE_FREE(cursor->data);
     GRAPHICS_SAFE_FREE(cursor);
     cursor = tmp;
@@ -3689,6 +8444,7 @@ void release() {
 #include <emscripten.h>
 #include <emscripten/html5.h>
 
+static short keycodes[512];
 static struct window_t *e_window = NULL;
 static int window_w, window_h, canvas_w, canvas_h, canvas_x, canvas_y, cursor_x, cursor_y;
 static bool mouse_in_canvas = true, fullscreen = false;
@@ -4108,6 +8864,7 @@ void cursor_icon_custom(struct window_t* w, struct surface_t* b) {
     var w = $0;
     var h = $1;
     var pixels = $2;
+    var pitch = $3;
     var ctx = canvas.getContext("2d");
     var canvas = document.createElement("canvas");
     canvas.width = w;
@@ -4116,15 +8873,16 @@ void cursor_icon_custom(struct window_t* w, struct surface_t* b) {
     var data = image.data;
     var src = pixels >> 2;
     var dst = 0;
-    var num = data.length;
-    while (dst < num) {
-      var val = HEAP32[src];
-      data[dst  ] = (val >> 16) & 0xFF;
-      data[dst+1] = (val >> 8) & 0xFF;
-      data[dst+2] = val & 0xFF;
-      data[dst+3] = 0xFF;
-      src++;
-      dst += 4;
+    for (var y = 0; y < h; ++y) {
+      for (var x = 0; x < w; ++x) {
+        var val = HEAP32[src + x];
+        data[dst  ] = (val >> 16) & 0xFF;
+        data[dst+1] = (val >> 8) & 0xFF;
+        data[dst+2] = val & 0xFF;
+        data[dst+3] = 0xFF;
+        dst += 4;
+      }
+      src += pitch;
     }
     
     ctx.putImageData(image, 0, 0);
@@ -4133,7 +8891,7 @@ void cursor_icon_custom(struct window_t* w, struct surface_t* b) {
     stringToUTF8(url, url_buf, url.length + 1);
     
     return url_buf;
-  }, b->w, b->h, b->buf);
+  }, b->w, b->h, b->buf, b->pitch);
   if (!cursor) {
     GRAPHICS_ERROR(UNKNOWN_ERROR, "cursor_custom_icon() failed");
     cursor = "default";
@@ -4156,6 +8914,7 @@ void cursor_set_pos(int _, int __) {
 }
 
 void events(void) {
+  io_dispatch();
 #if defined(GRAPHICS_DEBUG) && defined(GRAPHICS_EMCC_HTML)
   EM_ASM({
     stats.begin();
@@ -4163,11 +8922,28 @@ void events(void) {
 #endif
 }
 
+bool window_surface(struct window_t* w, struct surface_t* s) {
+  GRAPHICS_ERROR(UNKNOWN_ERROR, "window_surface() isn't supported on this platform");
+  return false;
+}
+
+bool window_present_async(struct window_t* w, int buffers) {
+  if (buffers < 2)
+    return true;
+  GRAPHICS_ERROR(UNKNOWN_ERROR, "window_present_async() isn't supported on this platform");
+  return false;
+}
+
+void window_present_scale(struct window_t* w, enum present_scale mode) {
+  return;
+}
+
 void flush(struct window_t* _, struct surface_t* b) {
   EM_ASM({
     var w = $0;
     var h = $1;
     var buf = $2;
+    var pitch = $3;
     var src = buf >> 2;
     var canvas = document.getElementById("canvas");
     var ctx = canvas.getContext("2d");
@@ -4175,26 +8951,29 @@ void flush(struct window_t* _, struct surface_t* b) {
     var data = img.data;
     
     var i = 0;
-    var j = data.length;
-    while (i < j) {
-      var val = HEAP32[src];
-      data[i  ] = (val >> 16) & 0xFF;
-      data[i+1] = (val >> 8) & 0xFF;
-      data[i+2] = val & 0xFF;
-      data[i+3] = 0xFF;
-      src++;
-      i += 4;
+    for (var y = 0; y < h; ++y) {
+      for (var x = 0; x < w; ++x) {
+        var val = HEAP32[src + x];
+        data[i  ] = (val >> 16) & 0xFF;
+        data[i+1] = (val >> 8) & 0xFF;
+        data[i+2] = val & 0xFF;
+        data[i+3] = 0xFF;
+        i += 4;
+      }
+      src += pitch;
     }
 
     ctx.putImageData(img, 0, 0);
 #if defined(GRAPHICS_DEBUG) && defined(GRAPHICS_EMCC_HTML)
     stats.end();
 #endif
-  }, b->w, b->h, b->buf);
+  }, b->w, b->h, b->buf, b->pitch);
+  surface_damage_clear(b);
 }
 
 void release(void) {
-  return;
+  io_destroy();
+  thread_pool_destroy();
 }
 #elif defined(GRAPHICS_SIXEL)
 bool window(struct window_t* a, const char* b, int c, int d, short e) {
@@ -4263,87 +9042,28 @@ void cursor_set_pos(int a, int b) {
 }
 
 void events() {
-  return;
-}
-
-void flush(struct window_t* a, struct surface_t* b) {
-  return;
-}
-
-void release() {
-  return;
-}
-#else // dummy
-bool window(struct window_t* a, const char* b, int c, int d, short e) {
-  return true;
-}
-
-void window_icon(struct window_t* a, struct surface_t* b) {
-  return;
-}
-
-void window_title(struct window_t* a, const char* b) {
-  return;
-}
-
-void window_position(struct window_t* a, int* b, int*  c) {
-  return;
-}
-
-void screen_size(struct window_t* a, int* b, int* c) {
-  return;
-}
-
-void window_destroy(struct window_t* a) {
-  return;
-}
-
-bool closed(struct window_t* a) {
-  return false;
+  io_dispatch();
 }
 
-bool closed_va(int n, ...) {
-  return false;
-}
-
-bool closed_all() {
+bool window_surface(struct window_t* a, struct surface_t* b) {
   return false;
 }
 
-void cursor_lock(struct window_t* s, bool a) {
-  return;
-}
-
-void cursor_visible(struct window_t* s, bool a) {
-  return;
-}
-
-void cursor_icon(struct window_t* a, enum cursor_type b) {
-  return;
-}
-
-void cursor_custom_icon(struct window_t* a, struct surface_t* b) {
-  return;
-}
-
-void cursor_pos(int* a, int* b) {
-  return;
-}
-
-void cursor_set_pos(int a, int b) {
-  return;
+bool window_present_async(struct window_t* a, int b) {
+  return b < 2;
 }
 
-void events() {
+void window_present_scale(struct window_t* a, enum present_scale b) {
   return;
 }
 
 void flush(struct window_t* a, struct surface_t* b) {
-  return;
+  surface_damage_clear(b);
 }
 
 void release() {
-  return;
+  io_destroy();
+  thread_pool_destroy();
 }
 #endif
 
@@ -4354,17 +9074,21 @@ void graphics_error_callback(void(*cb)(enum graphics_error, const char*, const c
 }
 
 void graphics_error(enum graphics_error type, const char* file, const char* func, int line, const char* msg, ...) {
+  struct graphics_ctx_t* c = __ctx();
   va_list args;
   va_start(args, msg);
-  static char error[1024];
-  vsprintf((char*)error, msg, args);
+  vsnprintf(c->error, sizeof(c->error), msg, args);
   va_end(args);
   
 #if defined(GRAPHICS_DEBUG)
-  fprintf(stderr, "[%d] from %s in %s() at %d -- %s\n", type, file, func, line, error);
+  fprintf(stderr, "[%d] from %s in %s() at %d -- %s\n", type, file, func, line, c->error);
 #endif
+  if (c->error_callback) {
+    c->error_callback(type, (const char*)c->error, file, func, line);
+    return;
+  }
   if (__error_callback) {
-    __error_callback(type, (const char*)error, __FILE__, __FUNCTION__, __LINE__);
+    __error_callback(type, (const char*)c->error, file, func, line);
     return;
   }
   abort();
@@ -46,6 +46,10 @@ extern "C" {
 #define GRAPHICS_NO_WINDOW
 #endif
 
+#if defined(GRAPHICS_NO_WINDOW) && !defined(GRAPHICS_EMCC) && !defined(GRAPHICS_SIXEL) && !defined(GRAPHICS_HEADLESS)
+#define GRAPHICS_HEADLESS
+#endif
+
 #if defined(GRAPHICS_MALLOC) && defined(GRAPHICS_FREE) && (defined(GRAPHICS_REALLOC) || defined(GRAPHICS_REALLOC_SIZED))
 #elif !defined(GRAPHICS_MALLOC) && !defined(GRAPHICS_FREE) && !defined(GRAPHICS_REALLOC) && !defined(GRAPHICS_REALLOC_SIZED)
 #else
@@ -75,6 +79,7 @@ if ((x)) { \
 #include <stdbool.h>
 #endif
 #include <stdarg.h>
+#include <stddef.h>
 
 // Taken from: https://stackoverflow.com/a/1911632
 #if _MSC_VER
@@ -319,11 +324,42 @@ if ((x)) { \
    * @constant buf Buffer holding pixel data
    * @constant w Width of image
    * @constant h Height of image
+   * @constant pitch Number of pixels from the start of one row to the next
+   * @constant parent Surface the pixel data is borrowed from, NULL if the surface owns buf
+   * @constant damage Areas drawn to since the last flush, NULL unless enabled with surface_damage_track
    */
   struct surface_t {
-    int *buf, w, h;
+    int *buf, w, h, pitch;
+    struct surface_t* parent;
+    struct damage_t* damage;
   };
   
+  /*!
+   * @typedef rect_t
+   * @brief A rectangle
+   * @constant x X position
+   * @constant y Y position
+   * @constant w Width of rectangle
+   * @constant h Height of rectangle
+   */
+  struct rect_t {
+    int x, y, w, h;
+  };
+
+  /*!
+   * @typedef damage_t
+   * @brief Areas of a surface that have changed. Overlapping or nearby areas are merged when one larger area is cheaper to present than both
+   * @constant rects Changed areas, they may overlap
+   * @constant count Number of rects in use
+   */
+#if !defined(GRAPHICS_DAMAGE_RECTS)
+#define GRAPHICS_DAMAGE_RECTS 16
+#endif
+  struct damage_t {
+    struct rect_t rects[GRAPHICS_DAMAGE_RECTS];
+    int count;
+  };
+
   /*!
    * @discussion Create a new surface
    * @param s Pointer to surface object to create
@@ -337,6 +373,38 @@ if ((x)) { \
    * @param s Pointer to pointer to surface object
    */
   void surface_destroy(struct surface_t* s);
+  /*!
+   * @discussion Create a view into a region of another surface. No pixels are copied, drawing to the view draws to the original. The view must not outlive the original surface
+   * @param a Original surface object
+   * @param x Region X position
+   * @param y Region Y position
+   * @param w Region width
+   * @param h Region height
+   * @param b Surface object to become the view
+   * @return Boolean of success
+   */
+  bool subsurface(struct surface_t* a, int x, int y, int w, int h, struct surface_t* b);
+  /*!
+   * @discussion Track which areas of a surface are drawn to, so flush only has to present those. Drawing to a view of the surface is tracked on the original. Starts with the whole surface damaged
+   * @param s Surface object, if it is a view the original is tracked
+   * @param enable Start or stop tracking
+   * @return Boolean for success
+   */
+  bool surface_damage_track(struct surface_t* s, bool enable);
+  /*!
+   * @discussion Mark an area of a surface as changed, for when buf is written to directly. Does nothing if the surface isn't tracked
+   * @param s Surface object
+   * @param x Area X position
+   * @param y Area Y position
+   * @param w Area width
+   * @param h Area height
+   */
+  void surface_damage(struct surface_t* s, int x, int y, int w, int h);
+  /*!
+   * @discussion Forget the damaged areas of a surface, flush does this after presenting it
+   * @param s Surface object
+   */
+  void surface_damage_clear(struct surface_t* s);
   
   /*!
    * @typedef draw_mode
@@ -349,10 +417,92 @@ if ((x)) { \
   };
   
   /*!
-   * @discussion Set draw mode
+   * @discussion Set the draw mode of the current context, see graphics_ctx_t
    * @param m Which mode to use
    */
   void graphics_draw_mode(enum draw_mode m);
+
+  /*!
+   * @typedef graphics_error
+   * @brief A list of different error types the library can generate
+   */
+  enum graphics_error {
+    UNKNOWN_ERROR,
+    OUT_OF_MEMEORY,
+    FILE_OPEN_FAILED,
+    INVALID_BMP,
+    UNSUPPORTED_BMP,
+    INVALID_PARAMETERS,
+    CURSOR_MOD_FAILED,
+    OSX_WINDOW_CREATION_FAILED,
+    OSX_APPDEL_CREATION_FAILED,
+    OSX_FULLSCREEN_FAILED,
+    WIN_WINDOW_CREATION_FAILED,
+    WIN_FULLSCREEN_FAILED,
+    NIX_CURSOR_PIXMAP_ERROR,
+    NIX_OPEN_DISPLAY_FAILED,
+    NIX_WINDOW_CREATION_FAILED,
+    WINDOW_ICON_FAILED,
+    CUSTOM_CURSOR_NOT_CREATED
+  };
+  
+  /*!
+   * @typedef graphics_ctx_t
+   * @brief Rendering state. Every thread draws with its own context, unless another context is bound to it with graphics_ctx_bind
+   * @constant mode Draw mode, see graphics_draw_mode
+   * @constant clip Area of the target surface drawing is restricted to when clipping is set
+   * @constant clipping Restrict drawing to clip
+   * @constant error_callback Callback for errors raised while the context is bound, NULL to use graphics_error_callback
+   * @constant error Message of the last error raised while the context was bound
+   * @constant clip_stack Clip state saved by graphics_clip_push
+   * @constant clip_depth Number of entries on clip_stack
+   */
+#if !defined(GRAPHICS_CLIP_STACK_SIZE)
+#define GRAPHICS_CLIP_STACK_SIZE 32
+#endif
+  struct graphics_ctx_t {
+    enum draw_mode mode;
+    struct rect_t clip;
+    bool clipping;
+    void(*error_callback)(enum graphics_error, const char*, const char*, const char*, int);
+    char error[1024];
+    struct {
+      struct rect_t clip;
+      bool clipping;
+    } clip_stack[GRAPHICS_CLIP_STACK_SIZE];
+    int clip_depth;
+  };
+
+  /*!
+   * @discussion Initialize a context with the default state, normal draw mode and no clipping
+   * @param c Context object to initialize
+   */
+  void graphics_ctx(struct graphics_ctx_t* c);
+  /*!
+   * @discussion Draw with a context on the calling thread. A context must only be bound to one thread at a time
+   * @param c Context to bind, NULL to go back to the thread's own context
+   * @return The previously bound context, NULL if it was the thread's own
+   */
+  struct graphics_ctx_t* graphics_ctx_bind(struct graphics_ctx_t* c);
+  /*!
+   * @discussion Get the context the calling thread is drawing with
+   * @return The bound context, or the thread's own context
+   */
+  struct graphics_ctx_t* graphics_ctx_current(void);
+  /*!
+   * @discussion Save the current clip state and restrict drawing to where it overlaps a rectangle, so nested areas never draw outside of their parent. Draw lists record the clip along with each command
+   * @param x Position X of the rectangle
+   * @param y Position Y of the rectangle
+   * @param w Width of the rectangle
+   * @param h Height of the rectangle
+   * @return Boolean for success, fails if the stack already holds GRAPHICS_CLIP_STACK_SIZE entries
+   */
+  bool graphics_clip_push(int x, int y, int w, int h);
+  /*!
+   * @discussion Restore the clip state saved by the matching graphics_clip_push
+   * @return Boolean for success, fails if the stack is empty
+   */
+  bool graphics_clip_pop(void);
   
   /*!
    * @discussion Fill a surface with a given colour
@@ -368,6 +518,17 @@ if ((x)) { \
    * @param col Colour to set
    */
   void flood(struct surface_t* s, int x, int y, int col);
+  /*!
+   * @discussion Flood portion of surface with given colour, matching pixels within a tolerance of the starting pixel. Like fill, flood ignores the draw mode
+   * @param s Surface object
+   * @param x X position
+   * @param y Y position
+   * @param col Colour to set
+   * @param tolerance Maximum difference per channel (0-255) for a pixel to be filled, 0 for exact matches only
+   * @param bounds Optional rect to set to the bounding box of the filled pixels (zero size if nothing was filled)
+   * @return Boolean of success
+   */
+  bool flood_ex(struct surface_t* s, int x, int y, int col, int tolerance, struct rect_t* bounds);
   /*!
    * @discussion Clear a surface, zero the buffer
    * @param s Surface object
@@ -441,14 +602,172 @@ if ((x)) { \
    * @return Boolean of success
    */
   bool resize(struct surface_t* a, int nw, int nh, struct surface_t* b);
+  
+  /*!
+   * @typedef resize_filter
+   * @brief Filters for resize_ex and resampler, from fastest to sharpest. Box averages every source pixel under a destination pixel
+   */
+  enum resize_filter {
+    RESIZE_NEAREST,
+    RESIZE_BILINEAR,
+    RESIZE_BICUBIC,
+    RESIZE_LANCZOS3,
+    RESIZE_BOX
+  };
+  
+  /*!
+   * @typedef resampler_t
+   * @brief Precomputed filter weights for resizing sw x sh surfaces to dw x dh, reusable for any number of surfaces of that size
+   * @constant sw Source width
+   * @constant sh Source height
+   * @constant dw Destination width
+   * @constant dh Destination height
+   * @constant filter Filter the weights were built for
+   * @constant xtaps Number of weights per destination column
+   * @constant ytaps Number of weights per destination row
+   * @constant xbounds First source column and number of columns read for every destination column
+   * @constant ybounds First source row and number of rows read for every destination row
+   * @constant xweights Fixed point column weights
+   * @constant yweights Fixed point row weights
+   * @constant buf Intermediate buffer, allocated on first use
+   */
+  struct resampler_t {
+    int sw, sh, dw, dh;
+    enum resize_filter filter;
+    int xtaps, ytaps;
+    int *xbounds, *ybounds;
+    short *xweights, *yweights;
+    int* buf;
+  };
+  
+  /*!
+   * @discussion Build the weights for resizing sw x sh surfaces to dw x dh
+   * @param r Resampler object to create
+   * @param sw Source width
+   * @param sh Source height
+   * @param dw Destination width
+   * @param dh Destination height
+   * @param filter Filter to use
+   * @return Boolean of success
+   */
+  bool resampler(struct resampler_t* r, int sw, int sh, int dw, int dh, enum resize_filter filter);
+  /*!
+   * @discussion Destroy a resampler
+   * @param r Resampler object
+   */
+  void resampler_destroy(struct resampler_t* r);
+  /*!
+   * @discussion Resize a surface into another with a resampler, the filter is applied to each axis in turn
+   * @param r Resampler object
+   * @param src Surface to resize, must be sw x sh
+   * @param dst Surface to write to, must be dw x dh
+   * @return Boolean of success
+   */
+  bool resample(struct resampler_t* r, struct surface_t* src, struct surface_t* dst);
+  /*!
+   * @discussion Resize (and scale) surface to given size with a filter, see resampler to resize many surfaces of the same size
+   * @param a Original surface object
+   * @param nw New width
+   * @param nh New height
+   * @param filter Filter to use
+   * @param b New surface object to be allocated
+   * @return Boolean of success
+   */
+  bool resize_ex(struct surface_t* a, int nw, int nh, enum resize_filter filter, struct surface_t* b);
   /*!
-   * @discussion Rotate a surface by a given degree
+   * @discussion Rotate a surface by a given degree, clockwise, sampling the nearest pixel. See rotate_ex
    * @param a Original surface object
    * @param angle Angle to rotate by
    * @param b New surface object to be allocated
    * @return Boolean of success
    */
   bool rotate(struct surface_t* a, float angle, struct surface_t* b);
+  /*!
+   * @discussion Rotate a surface by a given degree, clockwise. The new surface is just big enough to hold the rotated surface, uncovered pixels are left transparent. Multiples of 90 degrees are exact, see rotate90
+   * @param a Original surface object
+   * @param angle Angle to rotate by
+   * @param filter RESIZE_NEAREST or RESIZE_BILINEAR, any other filter is treated as bilinear
+   * @param b New surface object to be allocated
+   * @return Boolean of success
+   */
+  bool rotate_ex(struct surface_t* a, float angle, enum resize_filter filter, struct surface_t* b);
+  /*!
+   * @discussion Rotate a surface clockwise by a number of right angles
+   * @param a Original surface object
+   * @param turns Number of quarter turns, negative turns go anti-clockwise
+   * @param b New surface object to be allocated
+   * @return Boolean of success
+   */
+  bool rotate90(struct surface_t* a, int turns, struct surface_t* b);
+  
+  /*!
+   * @typedef flip_flags
+   * @brief Flags for flip, combine with |
+   */
+  enum flip_flags {
+    FLIP_HORIZONTAL = 0x01,
+    FLIP_VERTICAL = 0x02
+  };
+  
+  /*!
+   * @discussion Mirror a surface
+   * @param a Original surface object
+   * @param flags Combination of flip_flags, flipping both ways is the same as rotating 180 degrees
+   * @param b New surface object to be allocated
+   * @return Boolean of success
+   */
+  bool flip(struct surface_t* a, int flags, struct surface_t* b);
+  
+  /*!
+   * @typedef transform_t
+   * @brief 2D affine transform, a point x, y maps to a * x + c * y + tx, b * x + d * y + ty
+   * @constant a X scale
+   * @constant b Y shear
+   * @constant c X shear
+   * @constant d Y scale
+   * @constant tx X translation
+   * @constant ty Y translation
+   */
+  struct transform_t {
+    float a, b, c, d, tx, ty;
+  };
+  
+  /*!
+   * @discussion Set a transform to the identity
+   * @param t Transform object
+   */
+  void transform(struct transform_t* t);
+  /*!
+   * @discussion Translate a transform. Transforms map source points to the destination, and like the other transform functions this applies to a source point before the transform's existing operations. So the last call happens first: to draw a w by h surface rotated about its centre at x, y, translate by x, y, rotate, then translate by -w / 2, -h / 2
+   * @param t Transform object
+   * @param x X offset
+   * @param y Y offset
+   */
+  void transform_translate(struct transform_t* t, float x, float y);
+  /*!
+   * @discussion Scale a transform
+   * @param t Transform object
+   * @param x X scale, negative values mirror
+   * @param y Y scale, negative values mirror
+   */
+  void transform_scale(struct transform_t* t, float x, float y);
+  /*!
+   * @discussion Rotate a transform clockwise, the same direction as rotate
+   * @param t Transform object
+   * @param angle Angle to rotate by in degrees
+   */
+  void transform_rotate(struct transform_t* t, float angle);
+  /*!
+   * @discussion Draw a transformed surface straight onto another using the current draw mode, without any intermediate surfaces. The source rect is flipped within itself, then transformed with its top left corner at 0, 0
+   * @param dst Surface to draw to
+   * @param src Surface to draw
+   * @param t Transform from the source rect into dst
+   * @param rect Area of src to draw, NULL for all of it
+   * @param flags Combination of flip_flags
+   * @param filter RESIZE_NEAREST or RESIZE_BILINEAR, any other filter is treated as bilinear
+   * @return Boolean of success
+   */
+  bool paste_ex(struct surface_t* dst, struct surface_t* src, struct transform_t* t, struct rect_t* rect, int flags, enum resize_filter filter);
 
   /*!
    * @discussion Simple Bresenham line
@@ -471,7 +790,8 @@ if ((x)) { \
    */
   void circle(struct surface_t* s, int xc, int yc, int r, int col, bool fill);
   /*!
-   * @discussion Draw a rectangle
+   * @discussion Draw a rectangle covering exactly w by h pixels, from x, y to x + w - 1, y + h - 1. The outline is the border of that area and touches each pixel once. Nothing is drawn when w or h is 0 or less
+   * @param s Surface object
    * @param x X position
    * @param y Y position
    * @param w Rectangle width
@@ -481,7 +801,12 @@ if ((x)) { \
    */
   void rect(struct surface_t* s, int x, int y, int w, int h, int col, bool fill);
   /*!
-   * @discussion Draw a triangle
+   * @define GRAPHICS_SUBPIXEL_ONE
+   * @brief One pixel in the fixed point coordinates tri_fixed takes
+   */
+#define GRAPHICS_SUBPIXEL_ONE 16
+  /*!
+   * @discussion Draw a triangle. Vertices are whole pixels, see tri_fixed for subpixel ones
    * @param s Surface object
    * @param x0 Vector A X position
    * @param y0 Vector A Y position
@@ -493,22 +818,169 @@ if ((x)) { \
    * @param fill Fill triangle boolean
    */
   void tri(struct surface_t* s, int x0, int y0, int x1, int y1, int x2, int y2, int col, bool fill);
+  /*!
+   * @discussion Fill a triangle with subpixel vertices, in 28.4 fixed point (pixel coordinates times GRAPHICS_SUBPIXEL_ONE). tri rounds its vertices to whole pixels, this keeps the fraction, so meshes with fractional vertices are covered exactly and neighbouring triangles never overlap. Pixel centres are at whole coordinates
+   * @param s Surface object
+   * @param x0 Vector A X position, fixed point
+   * @param y0 Vector A Y position, fixed point
+   * @param x1 Vector B X position, fixed point
+   * @param y1 Vector B Y position, fixed point
+   * @param x2 Vector C X position, fixed point
+   * @param y2 Vector C Y position, fixed point
+   * @param col Colour of triangle
+   */
+  void tri_fixed(struct surface_t* s, int x0, int y0, int x1, int y1, int x2, int y2, int col);
 
   /*!
-   * @discussion Load BMP file from path
+   * @discussion Load BMP file from path. Handles 1, 2, 4, 8, 16, 24 and 32 BPP, RLE4, RLE8, BITFIELDS and ALPHABITFIELDS, top-down images and OS/2 headers. The file is streamed through a buffer of GRAPHICS_BMP_BUFFER bytes (64KB by default) and converted a row at a time
    * @param s Surface object to allocate
    * @param path Path to BMP file
    * @return Boolean of success
    */
   bool bmp(struct surface_t* s, const char* path);
+  /*!
+   * @discussion Get the size of a BMP file without loading it
+   * @param path Path to BMP file
+   * @param w Pointer to int to set width
+   * @param h Pointer to int to set height
+   * @return Boolean of success
+   */
+  bool bmp_size(const char* path, int* w, int* h);
+  /*!
+   * @discussion Load part of a BMP file, optionally keeping only every reduce-th pixel of every reduce-th row. Only the rows needed are read from uncompressed files, so parts of huge images can be opened quickly
+   * @param s Surface object to allocate
+   * @param path Path to BMP file
+   * @param x X position of region
+   * @param y Y position of region
+   * @param w Width of region
+   * @param h Height of region
+   * @param reduce Power of two to shrink the region by, 1 to keep it full size
+   * @return Boolean of success
+   */
+  bool bmp_region(struct surface_t* s, const char* path, int x, int y, int w, int h, int reduce);
 
   /*!
-   * @discussion Save surface to BMP file
+   * @discussion Save surface to a 24-bit BMP file, same as save_bmp_ex with no flags
    * @params s Surface object to save
    * @param path Path to save BMP file to
    * @return Boolean of success
    */
   bool save_bmp(struct surface_t* s, const char* path);
+  /*!
+   * @typedef bmp_flags
+   * @brief Flags for save_bmp_ex, combine with |. BMP_ALPHA writes 32-bit BGRA with a BITMAPV4 header instead of 24-bit BGR, BMP_TOP_DOWN stores the rows top to bottom. Both together make the file a straight copy of the surface
+   */
+  enum bmp_flags {
+    BMP_ALPHA = 0x01,
+    BMP_TOP_DOWN = 0x02
+  };
+  /*!
+   * @discussion Save surface to BMP file
+   * @params s Surface object to save
+   * @param path Path to save BMP file to
+   * @param flags Combination of bmp_flags
+   * @return Boolean of success
+   */
+  bool save_bmp_ex(struct surface_t* s, const char* path, int flags);
+
+  /*!
+   * @discussion Save surface to a PNG file at compression level 6, same as save_png_ex with no flags
+   * @param s Surface object to save
+   * @param path Path to save PNG file to
+   * @return Boolean of success
+   */
+  bool save_png(struct surface_t* s, const char* path);
+  /*!
+   * @typedef png_flags
+   * @brief Flags for save_png_ex, combine with |. PNG_ALPHA writes 8-bit RGBA instead of RGB
+   */
+  enum png_flags {
+    PNG_ALPHA = 0x01
+  };
+  /*!
+   * @discussion Save surface to a PNG file. Each row gets the filter that suits it best and is compressed with a built-in deflate, no libraries needed. Images are split into bands of about GRAPHICS_PNG_BAND bytes (256KB by default) that are compressed in parallel on the thread pool
+   * @param s Surface object to save
+   * @param path Path to save PNG file to
+   * @param level Compression level, 0 (stored, fastest) to 9 (smallest)
+   * @param flags Combination of png_flags
+   * @return Boolean of success
+   */
+  bool save_png_ex(struct surface_t* s, const char* path, int level, int flags);
+
+  /*!
+   * @struct io_job_t
+   * @abstract Handle to an image being loaded or saved in the background
+   */
+  struct io_job_t;
+  /*!
+   * @typedef io_status
+   * @brief State of a background job. IO_PENDING until it has run, then IO_DONE or IO_FAILED
+   */
+  enum io_status {
+    IO_PENDING = 0,
+    IO_DONE,
+    IO_FAILED
+  };
+  /*!
+   * @discussion Load a BMP file on a background thread, like bmp. Jobs go to GRAPHICS_IO_THREADS workers (2 by default) through a queue of GRAPHICS_IO_QUEUE entries (64 by default), submitting only blocks if the queue is full. Leave the surface alone until the job is finished. If cb isn't NULL it is called by io_dispatch (and so by events) on the thread that calls it, and the handle is freed after. Otherwise pass the handle to io_wait once. Errors are raised on the thread that collects the result, like the synchronous call would
+   * @param s Surface object to allocate
+   * @param path Path to BMP file
+   * @param cb Callback given userdata and if the load succeeded, or NULL
+   * @param userdata Passed to cb
+   * @return Job handle, NULL if it couldn't be queued
+   */
+  struct io_job_t* bmp_async(struct surface_t* s, const char* path, void(*cb)(void*, bool), void* userdata);
+  /*!
+   * @discussion Load part of a BMP file on a background thread, like bmp_region. See bmp_async
+   * @param s Surface object to allocate
+   * @param path Path to BMP file
+   * @param x X position of region
+   * @param y Y position of region
+   * @param w Width of region
+   * @param h Height of region
+   * @param reduce Power of two to shrink the region by, 1 to keep it full size
+   * @param cb Callback given userdata and if the load succeeded, or NULL
+   * @param userdata Passed to cb
+   * @return Job handle, NULL if it couldn't be queued
+   */
+  struct io_job_t* bmp_region_async(struct surface_t* s, const char* path, int x, int y, int w, int h, int reduce, void(*cb)(void*, bool), void* userdata);
+  /*!
+   * @discussion Save surface to a BMP file on a background thread, like save_bmp_ex. The surface is copied first, so it can be drawn to again straight away - e.g. screenshots without dropping a frame. See bmp_async
+   * @param s Surface object to save
+   * @param path Path to save BMP file to
+   * @param flags Combination of bmp_flags
+   * @param cb Callback given userdata and if the save succeeded, or NULL
+   * @param userdata Passed to cb
+   * @return Job handle, NULL if it couldn't be queued
+   */
+  struct io_job_t* save_bmp_async(struct surface_t* s, const char* path, int flags, void(*cb)(void*, bool), void* userdata);
+  /*!
+   * @discussion Save surface to a PNG file on a background thread, like save_png_ex. The surface is copied first, and the file is compressed on the worker alone so drawing keeps the thread pool. See bmp_async
+   * @param s Surface object to save
+   * @param path Path to save PNG file to
+   * @param level Compression level, 0 to 9
+   * @param flags Combination of png_flags
+   * @param cb Callback given userdata and if the save succeeded, or NULL
+   * @param userdata Passed to cb
+   * @return Job handle, NULL if it couldn't be queued
+   */
+  struct io_job_t* save_png_async(struct surface_t* s, const char* path, int level, int flags, void(*cb)(void*, bool), void* userdata);
+  /*!
+   * @discussion Check on a background job without blocking. Jobs with a callback can be polled until the callback has run
+   * @param job Job handle
+   * @return State of the job
+   */
+  enum io_status io_poll(struct io_job_t* job);
+  /*!
+   * @discussion Block until a background job has finished. Jobs without a callback are freed and their errors raised here, the handle can't be used after
+   * @param job Job handle
+   * @return Boolean of success
+   */
+  bool io_wait(struct io_job_t* job);
+  /*!
+   * @discussion Call the callbacks of finished background jobs and free them. events does this every time, only needed when there is no window
+   */
+  void io_dispatch(void);
 
   /*!
    * @discussion Draw a character from ASCII value using default in-built font
@@ -568,6 +1040,256 @@ if ((x)) { \
    */
   void stringf(struct surface_t* s, int fg, int bg, const char* fmt, ...);
   
+  /*!
+   * @typedef draw_list_t
+   * @brief A list of recorded draw commands that can be replayed with draw_list_exec
+   * @constant data Arena holding the recorded commands
+   * @constant size Number of bytes of the arena in use
+   * @constant capacity Number of bytes allocated for the arena
+   * @constant count Number of recorded commands
+   */
+  struct draw_list_t {
+    unsigned char* data;
+    size_t size, capacity;
+    int count;
+  };
+
+  /*!
+   * @discussion Create a new, empty draw list
+   * @param l Draw list object to create
+   * @return Boolean for success
+   */
+  bool draw_list(struct draw_list_t* l);
+  /*!
+   * @discussion Destroy a draw list and free its arena
+   * @param l Draw list object
+   */
+  void draw_list_destroy(struct draw_list_t* l);
+  /*!
+   * @discussion Remove all commands from a draw list, keeping the arena for reuse
+   * @param l Draw list object
+   */
+  void draw_list_clear(struct draw_list_t* l);
+  /*!
+   * @discussion Record a line, see line. The current draw mode is recorded with every command
+   * @param l Draw list object
+   * @param x0 Vector A X position
+   * @param y0 Vector A Y position
+   * @param x1 Vector B X position
+   * @param y1 Vector B Y position
+   * @param col Colour of line
+   * @return Boolean for success
+   */
+  bool draw_list_line(struct draw_list_t* l, int x0, int y0, int x1, int y1, int col);
+  /*!
+   * @discussion Record a circle, see circle
+   * @param l Draw list object
+   * @param xc Centre X position
+   * @param yc Centre Y position
+   * @param r Circle radius
+   * @param col Colour of cricle
+   * @param fill Fill circle boolean
+   * @return Boolean for success
+   */
+  bool draw_list_circle(struct draw_list_t* l, int xc, int yc, int r, int col, bool fill);
+  /*!
+   * @discussion Record a rectangle, see rect
+   * @param l Draw list object
+   * @param x X position
+   * @param y Y position
+   * @param w Rectangle width
+   * @param h Rectangle height
+   * @param col Colour of rectangle
+   * @param fill Fill rectangle boolean
+   * @return Boolean for success
+   */
+  bool draw_list_rect(struct draw_list_t* l, int x, int y, int w, int h, int col, bool fill);
+  /*!
+   * @discussion Record a triangle, see tri
+   * @param l Draw list object
+   * @param x0 Vector A X position
+   * @param y0 Vector A Y position
+   * @param x1 Vector B X position
+   * @param y1 Vector B Y position
+   * @param x2 Vector C X position
+   * @param y2 Vector C Y position
+   * @param col Colour of triangle
+   * @param fill Fill triangle boolean
+   * @return Boolean for success
+   */
+  bool draw_list_tri(struct draw_list_t* l, int x0, int y0, int x1, int y1, int x2, int y2, int col, bool fill);
+  /*!
+   * @discussion Record a filled triangle with subpixel vertices, see tri_fixed
+   * @param l Draw list object
+   * @param x0 Vector A X position, fixed point
+   * @param y0 Vector A Y position, fixed point
+   * @param x1 Vector B X position, fixed point
+   * @param y1 Vector B Y position, fixed point
+   * @param x2 Vector C X position, fixed point
+   * @param y2 Vector C Y position, fixed point
+   * @param col Colour of triangle
+   * @return Boolean for success
+   */
+  bool draw_list_tri_fixed(struct draw_list_t* l, int x0, int y0, int x1, int y1, int x2, int y2, int col);
+  /*!
+   * @discussion Record a blit, see paste. Only a pointer to src is recorded, it must stay valid until the list is executed
+   * @param l Draw list object
+   * @param src Surface to blit
+   * @param x X position
+   * @param y Y position
+   * @return Boolean for success
+   */
+  bool draw_list_paste(struct draw_list_t* l, struct surface_t* src, int x, int y);
+  /*!
+   * @discussion Record a blit with clipping rect, see clip_paste. Only a pointer to src is recorded, it must stay valid until the list is executed
+   * @param l Draw list object
+   * @param src Surface to blit
+   * @param x X position
+   * @param y Y position
+   * @param rx Clip rect X
+   * @param ry Clip rect Y
+   * @param rw Clip rect width
+   * @param rh Clip rect height
+   * @return Boolean for success
+   */
+  bool draw_list_clip_paste(struct draw_list_t* l, struct surface_t* src, int x, int y, int rx, int ry, int rw, int rh);
+  /*!
+   * @discussion Record a string using default in-built font, see writeln. The string is copied into the list
+   * @param l Draw list object
+   * @param x X position
+   * @param y Y position
+   * @param fg Foreground colour
+   * @param bg Background colour
+   * @param str String to write
+   * @return Boolean for success
+   */
+  bool draw_list_writeln(struct draw_list_t* l, int x, int y, int fg, int bg, const char* str);
+  /*!
+   * @discussion Execute every command in a draw list against a surface, in the order they were recorded. Commands entirely outside the surface are skipped. The list is left intact so it can be replayed
+   * @param l Draw list object
+   * @param s Surface object to draw to
+   */
+  void draw_list_exec(struct draw_list_t* l, struct surface_t* s);
+  /*!
+   * @discussion Replay a draw list into a surface on several threads. The surface is split into tiles of GRAPHICS_TILE_SIZE pixels, every command is binned into the tiles its bounds touch and tiles are drawn in parallel. The result is identical to draw_list_exec. Lists that paste from the surface being drawn to are replayed serially
+   * @param l Draw list object
+   * @param s Surface to draw to
+   * @param threads Maximum number of threads to use, 0 or less to use one per CPU
+   */
+  void draw_list_exec_mt(struct draw_list_t* l, struct surface_t* s, int threads);
+  
+  /*!
+   * @discussion Draw a pixel with a context instead of the calling thread's current one, see pset
+   * @param c Context to draw with
+   * @param s Surface to draw to
+   * @param x X position
+   * @param y Y position
+   * @param col Colour of pixel
+   */
+  void pset_ctx(struct graphics_ctx_t* c, struct surface_t* s, int x, int y, int col);
+  /*!
+   * @discussion Draw a line with a context, see line
+   * @param c Context to draw with
+   * @param s Surface to draw to
+   * @param x0 Vector A X position
+   * @param y0 Vector A Y position
+   * @param x1 Vector B X position
+   * @param y1 Vector B Y position
+   * @param col Colour of line
+   */
+  void line_ctx(struct graphics_ctx_t* c, struct surface_t* s, int x0, int y0, int x1, int y1, int col);
+  /*!
+   * @discussion Draw a circle with a context, see circle
+   * @param c Context to draw with
+   * @param s Surface to draw to
+   * @param xc Centre X position
+   * @param yc Centre Y position
+   * @param r Circle radius
+   * @param col Colour of circle
+   * @param fill Fill circle boolean
+   */
+  void circle_ctx(struct graphics_ctx_t* c, struct surface_t* s, int xc, int yc, int r, int col, bool fill);
+  /*!
+   * @discussion Draw a rectangle with a context, see rect
+   * @param c Context to draw with
+   * @param s Surface to draw to
+   * @param x X position
+   * @param y Y position
+   * @param w Rectangle width
+   * @param h Rectangle height
+   * @param col Colour of rectangle
+   * @param fill Fill rectangle boolean
+   */
+  void rect_ctx(struct graphics_ctx_t* c, struct surface_t* s, int x, int y, int w, int h, int col, bool fill);
+  /*!
+   * @discussion Draw a triangle with a context, see tri
+   * @param c Context to draw with
+   * @param s Surface to draw to
+   * @param x0 Vector A X position
+   * @param y0 Vector A Y position
+   * @param x1 Vector B X position
+   * @param y1 Vector B Y position
+   * @param x2 Vector C X position
+   * @param y2 Vector C Y position
+   * @param col Colour of triangle
+   * @param fill Fill triangle boolean
+   */
+  void tri_ctx(struct graphics_ctx_t* c, struct surface_t* s, int x0, int y0, int x1, int y1, int x2, int y2, int col, bool fill);
+  /*!
+   * @discussion Flood fill with a context, see flood_ex
+   * @param c Context to draw with
+   * @param s Surface to fill
+   * @param x X position to start from
+   * @param y Y position to start from
+   * @param col Colour to fill with
+   * @param tolerance Per channel colour distance still treated as part of the region
+   * @param bounds Optional rect that receives the bounding box of the filled pixels
+   * @return Boolean for success
+   */
+  bool flood_ctx(struct graphics_ctx_t* c, struct surface_t* s, int x, int y, int col, int tolerance, struct rect_t* bounds);
+  /*!
+   * @discussion Paste a surface with a context, see paste
+   * @param c Context to draw with
+   * @param dst Surface to paste to
+   * @param src Surface to paste
+   * @param x X position
+   * @param y Y position
+   * @return Boolean for success
+   */
+  bool paste_ctx(struct graphics_ctx_t* c, struct surface_t* dst, struct surface_t* src, int x, int y);
+  /*!
+   * @discussion Paste part of a surface with a context, see clip_paste
+   * @param c Context to draw with
+   * @param dst Surface to paste to
+   * @param src Surface to paste
+   * @param x X position
+   * @param y Y position
+   * @param rx Clip rect X
+   * @param ry Clip rect Y
+   * @param rw Clip rect width
+   * @param rh Clip rect height
+   * @return Boolean for success
+   */
+  bool clip_paste_ctx(struct graphics_ctx_t* c, struct surface_t* dst, struct surface_t* src, int x, int y, int rx, int ry, int rw, int rh);
+  /*!
+   * @discussion Draw a string with a context, see writeln
+   * @param c Context to draw with
+   * @param s Surface to draw to
+   * @param x X position
+   * @param y Y position
+   * @param fg Foreground colour
+   * @param bg Background colour
+   * @param str String to draw
+   */
+  void writeln_ctx(struct graphics_ctx_t* c, struct surface_t* s, int x, int y, int fg, int bg, const char* str);
+  /*!
+   * @discussion Replay a draw list with a context, see draw_list_exec
+   * @param c Context to draw with
+   * @param l Draw list object
+   * @param s Surface to draw to
+   */
+  void draw_list_exec_ctx(struct graphics_ctx_t* c, struct draw_list_t* l, struct surface_t* s);
+
   /*!
    * @discussion High precision timer
    * @return Number of CPU ticks
@@ -933,11 +1655,59 @@ if ((x)) { \
    */
   void events(void);
   /*!
-   * @discussion Draw surface object to window
+   * @discussion Get a surface that draws straight into a window's back buffer, so flushing it presents without a copy. With GRAPHICS_HAS_X11SHM the buffer is shared with the X server when it allows. The buffer is replaced when the window is resized, get it again then. Only supported on X11 and headless for now
+   * @param w Window object
+   * @param s Surface object to become a view of the back buffer
+   * @return Boolean for success
+   */
+  bool window_surface(struct window_t* w, struct surface_t* s);
+  /*!
+   * @discussion Present on a separate thread, so flush only copies the frame and uploading it overlaps drawing the next one. With double buffering flush waits until the previous frame is on screen, with triple buffering it never waits and frames are dropped if they come faster than they can be presented. Get window_surface again after every flush, each frame is drawn into a different buffer. Only supported on X11 for now, headless accepts it and always presents synchronously
+   * @param w Window object
+   * @param buffers 2 or 3 to present asynchronously with double or triple buffering, 0 to present synchronously in flush
+   * @return Boolean for success
+   */
+  bool window_present_async(struct window_t* w, int buffers);
+  /*!
+   * @typedef present_scale
+   * @brief How flush fits a surface that isn't the size of the window. Stretch fills the window, aspect keeps the surface's aspect ratio, integer scales by the largest whole multiple that fits (or as aspect when the window is smaller). Both leave black bars around the frame
+   */
+  enum present_scale {
+    PRESENT_STRETCH,
+    PRESENT_ASPECT,
+    PRESENT_INTEGER
+  };
+  /*!
+   * @discussion Set how flush scales surfaces that aren't the size of the window, the default is PRESENT_STRETCH. Only supported on X11 and headless for now
+   * @param w Window object
+   * @param mode Scaling mode
+   */
+  void window_present_scale(struct window_t* w, enum present_scale mode);
+  /*!
+   * @discussion Draw surface object to window. If b is tracking damage only the damaged areas are presented where the platform allows it, and the damage is cleared
    * @param s Window object
    * @param b Surface object
    */
   void flush(struct window_t* s, struct surface_t* b);
+
+#if defined(GRAPHICS_HEADLESS)
+  /*!
+   * @discussion Headless only, save every flushed frame as a BMP. The path is a printf format given the window id then the frame number, e.g. "frames/%d_%05d.bmp". Windows are numbered from 1 in the order they're created
+   * @param fmt Path format, NULL to stop saving frames
+   */
+  void headless_output(const char* fmt);
+  /*!
+   * @discussion Headless only, call a function with every flushed frame. The surface is the window's framebuffer, it is only valid until the callback returns
+   * @param cb Callback, NULL to remove it
+   */
+  void headless_callback(void(*cb)(struct window_t*, struct surface_t*, int));
+  /*!
+   * @discussion Headless only, replay events from a text file. Each line is the number of events() calls to wait for, a window id and an event: "key SYM MOD DOWN", "button BTN MOD DOWN", "move X Y", "scroll MOD DX DY", "focus IN", "resize W H" or "close". SYM, MOD and BTN are enum key_sym, key_mod and button values. Lines starting with # are ignored, e.g. "3 1 key 65 0 1" presses A in window 1 on the third call. Replaces any script already loaded
+   * @param path Path to script file, NULL to clear the script
+   * @return Boolean for success
+   */
+  bool headless_script(const char* path);
+#endif
   /*!
    * @discussion Release anything allocated by this library
    */
@@ -946,31 +1716,7 @@ if ((x)) { \
 #define GRAPHICS_ERROR(A, ...) graphics_error((A), __FILE__, __FUNCTION__, __LINE__, __VA_ARGS__)
   
   /*!
-   * @typedef graphics_error
-   * @brief A list of different error types the library can generate
-   */
-  enum graphics_error {
-    UNKNOWN_ERROR,
-    OUT_OF_MEMEORY,
-    FILE_OPEN_FAILED,
-    INVALID_BMP,
-    UNSUPPORTED_BMP,
-    INVALID_PARAMETERS,
-    CURSOR_MOD_FAILED,
-    OSX_WINDOW_CREATION_FAILED,
-    OSX_APPDEL_CREATION_FAILED,
-    OSX_FULLSCREEN_FAILED,
-    WIN_WINDOW_CREATION_FAILED,
-    WIN_FULLSCREEN_FAILED,
-    NIX_CURSOR_PIXMAP_ERROR,
-    NIX_OPEN_DISPLAY_FAILED,
-    NIX_WINDOW_CREATION_FAILED,
-    WINDOW_ICON_FAILED,
-    CUSTOM_CURSOR_NOT_CREATED
-  };
-  
-  /*!
-   * @discussion Callback for errors inside library
+   * @discussion Callback for errors inside library, used when the current context has no error_callback of its own
    * @param cb Function pointer to callback
    */
   void graphics_error_callback(void(*cb)(enum graphics_error, const char*, const char*, const char*, int));
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include "../graphics/graphics.c"
+
+/* Checks the ALPHA blend against the original per-channel formula for every
+ * source channel, destination channel, source alpha and destination alpha.
+ *
+ *   blend
+ *
+ * Colour channels must never come out above the old integer formula and at
+ * most 1 below it, alpha must be a + floor(b * (255 - a) / 255). The SSE2 and
+ * AVX2 kernels (whichever are compiled in, build with -mavx2 for the latter)
+ * must match the scalar one bit for bit. Exits with 1 on any mismatch */
+
+/* The blend pset() used before the span kernels */
+#define OLD_BLEND(c0, c1, a0, a1) (c0 * a0 / 255) + (c1 * a1 * (255 - a0) / 65025)
+
+#define MAX_REPORTS 8
+
+static long long errors = 0;
+
+static void report(const char* what, int p, int c, int got, int want) {
+  if (errors++ < MAX_REPORTS)
+    fprintf(stderr, "%s: dst %08X src %08X: got %08X, want %08X\n", what, p, c, got, want);
+}
+
+/* Every channel of src and dst sweeps all 256 values as c and q do */
+static inline int src_pixel(int a, int c) {
+  return (a << 24) | (c << 16) | ((255 - c) << 8) | ((c * 7) & 255);
+}
+
+static inline int dst_pixel(int b, int q) {
+  return (b << 24) | (q << 16) | ((q ^ 0x5A) << 8) | (255 - q);
+}
+
+static void check_scalar(int a, int b, int c, int q) {
+  int s = src_pixel(a, c), d = dst_pixel(b, q);
+  int r = __blend(d, s);
+  if (a == 255 || !b) {
+    if (r != s)
+      report("scalar", d, s, r, s);
+    return;
+  }
+  int want = a + b * (255 - a) / 255;
+  bool bad = ((unsigned int)r >> 24) != (unsigned int)want;
+  for (int shift = 0; shift < 24; shift += 8) {
+    int old = OLD_BLEND(((s >> shift) & 255), ((d >> shift) & 255), a, b);
+    int got = (r >> shift) & 255;
+    bad |= got > old || got < old - 1;
+  }
+  if (bad)
+    report("scalar", d, s, r, -1);
+}
+
+int main(void) {
+  for (int a = 0; a < 256; ++a) {
+    for (int b = 0; b < 256; ++b) {
+      for (int c = 0; c < 256; ++c) {
+        int src[8], dst[8];
+        for (int q = 0; q < 256; ++q)
+          check_scalar(a, b, c, q);
+        for (int q = 0; q < 256; q += 8) {
+          for (int i = 0; i < 8; ++i) {
+            src[i] = src_pixel(a, c);
+            dst[i] = dst_pixel(b, q + i);
+          }
+#if defined(GRAPHICS_SSE2)
+          for (int h = 0; h < 8; h += 4) {
+            int out[4];
+            _mm_storeu_si128((__m128i*)out, __blend4(_mm_loadu_si128((const __m128i*)(dst + h)), _mm_loadu_si128((const __m128i*)(src + h))));
+            for (int i = 0; i < 4; ++i)
+              if (out[i] != __blend(dst[h + i], src[h + i]))
+                report("sse2", dst[h + i], src[h + i], out[i], __blend(dst[h + i], src[h + i]));
+          }
+#endif
+#if defined(GRAPHICS_AVX2)
+          int out[8];
+          _mm256_storeu_si256((__m256i*)out, __blend8(_mm256_loadu_si256((const __m256i*)dst), _mm256_loadu_si256((const __m256i*)src)));
+          for (int i = 0; i < 8; ++i)
+            if (out[i] != __blend(dst[i], src[i]))
+              report("avx2", dst[i], src[i], out[i], __blend(dst[i], src[i]));
+#endif
+        }
+      }
+    }
+  }
+#if defined(GRAPHICS_AVX2)
+  const char* simd = "scalar, sse2, avx2";
+#elif defined(GRAPHICS_SSE2)
+  const char* simd = "scalar, sse2";
+#else
+  const char* simd = "scalar";
+#endif
+  printf("blend (%s): %lld mismatch%s\n", simd, errors, errors == 1 ? "" : "es");
+  return errors ? 1 : 0;
+}
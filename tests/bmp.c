@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include "../graphics/graphics.h"
+#if !defined(_WIN32)
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+/* Decodes every file in the BMP suite.
+ *
+ *   bmp [dir]
+ *
+ * Files in g/ must load, match the size bmp_size reports and decode to the
+ * expected pixels: the full colour variants exactly as g/rgb24.bmp, the rest
+ * to a stored checksum. Files in b/, q/ and regress/ (our own regression
+ * fixtures, the others are the BMP Suite) may be rejected but must not crash
+ * or hang. dir defaults to tests/bmp, exits with 1 if anything fails */
+
+#define TIMEOUT 10
+
+/* Expected pixels of each file in g/, either those of another file or an
+ * FNV-1a hash of the decoded rows. The hashes were checked against an
+ * independent decoder, apart from the 16 bpp files (which round 5 and 6 bit
+ * channels differently, by at most 1) and pal4rle.bmp (checked equal to
+ * pal4.bmp instead) */
+static const struct {
+  const char* name;
+  const char* same_as;
+  unsigned int hash;
+} expected[] = {
+  { "pal1.bmp", NULL, 0xB2A749C5 },
+  { "pal1bg.bmp", NULL, 0xFC5EDC05 },
+  { "pal1wb.bmp", NULL, 0xB2A749C5 },
+  { "pal4.bmp", NULL, 0x23603DA5 },
+  { "pal4gs.bmp", NULL, 0xD926F986 },
+  { "pal4rle.bmp", NULL, 0x23603DA5 },
+  { "pal8-0.bmp", NULL, 0x06235F50 },
+  { "pal8.bmp", NULL, 0x06235F50 },
+  { "pal8gs.bmp", NULL, 0x29B6D3BB },
+  { "pal8nonsquare.bmp", NULL, 0x2E50DE20 },
+  { "pal8os2.bmp", NULL, 0x06235F50 },
+  { "pal8rle.bmp", NULL, 0x06235F50 },
+  { "pal8topdown.bmp", NULL, 0x06235F50 },
+  { "pal8v4.bmp", NULL, 0x06235F50 },
+  { "pal8v5.bmp", NULL, 0x06235F50 },
+  { "pal8w124.bmp", NULL, 0x84FB78C1 },
+  { "pal8w125.bmp", NULL, 0xDD92F5D3 },
+  { "pal8w126.bmp", NULL, 0x4DAD15C1 },
+  { "rgb16-565.bmp", NULL, 0x427B1AB2 },
+  { "rgb16-565pal.bmp", NULL, 0x427B1AB2 },
+  { "rgb16.bmp", NULL, 0x065B316E },
+  { "rgb16bfdef.bmp", NULL, 0x065B316E },
+  { "rgb24.bmp", NULL, 0x966756B3 },
+  { "rgb24pal.bmp", "rgb24.bmp", 0 },
+  { "rgb32.bmp", "rgb24.bmp", 0 },
+  { "rgb32bf.bmp", "rgb24.bmp", 0 },
+  { "rgb32bfdef.bmp", "rgb24.bmp", 0 }
+};
+
+static char current[1024];
+static bool failed = false;
+
+static void on_error(enum graphics_error type, const char* msg, const char* file, const char* func, int line) {
+  failed = true;
+}
+
+#if !defined(_WIN32)
+static void on_timeout(int sig) {
+  fprintf(stderr, "%s: timed out after %ds\n", current, TIMEOUT);
+  _exit(1);
+}
+#endif
+
+static unsigned int hash(struct surface_t* s) {
+  unsigned int h = 0x811C9DC5;
+  for (int y = 0; y < s->h; ++y)
+    for (int x = 0; x < s->w; ++x) {
+      unsigned int c = s->buf[y * s->pitch + x];
+      for (int i = 0; i < 32; i += 8)
+        h = (h ^ ((c >> i) & 0xFF)) * 0x01000193;
+    }
+  return h;
+}
+
+/* Compare a decoded g/ file against its expected pixels */
+static bool check(const char* dir, const char* name, struct surface_t* s) {
+  char path[1024];
+  for (int i = 0; i < (int)(sizeof(expected) / sizeof(expected[0])); ++i) {
+    if (strcmp(expected[i].name, name))
+      continue;
+    if (!expected[i].same_as) {
+      unsigned int h = hash(s);
+      if (h != expected[i].hash)
+        fprintf(stderr, "%s/g/%s: pixel hash %08X, expected %08X\n", dir, name, h, expected[i].hash);
+      return h == expected[i].hash;
+    }
+    struct surface_t ref;
+    bool same = false;
+    snprintf(path, sizeof(path), "%s/g/%s", dir, expected[i].same_as);
+    if (!bmp(&ref, path)) {
+      fprintf(stderr, "%s: can't load reference\n", path);
+      return false;
+    }
+    if (ref.w == s->w && ref.h == s->h) {
+      same = true;
+      for (int y = 0; y < s->h && same; ++y)
+        same = !memcmp(&ref.buf[y * ref.pitch], &s->buf[y * s->pitch], s->w * sizeof(int));
+    }
+    if (!same)
+      fprintf(stderr, "%s/g/%s: pixels differ from %s\n", dir, name, expected[i].same_as);
+    surface_destroy(&ref);
+    return same;
+  }
+  fprintf(stderr, "%s/g/%s: no expected pixels, add it to expected[]\n", dir, name);
+  return false;
+}
+
+static int run(const char* dir, const char* set, bool must_load) {
+  char path[1024];
+  struct dirent* e;
+  int errors = 0, loaded = 0, total = 0;
+  snprintf(path, sizeof(path), "%s/%s", dir, set);
+  DIR* d = opendir(path);
+  if (!d) {
+    fprintf(stderr, "%s: can't open\n", path);
+    return 1;
+  }
+  while ((e = readdir(d))) {
+    size_t n = strlen(e->d_name);
+    if (n < 4 || strcmp(e->d_name + n - 4, ".bmp"))
+      continue;
+    snprintf(current, sizeof(current), "%s/%s", path, e->d_name);
+    struct surface_t s;
+    int w = 0, h = 0;
+    failed = false;
+#if !defined(_WIN32)
+    alarm(TIMEOUT);
+#endif
+    bool ok = bmp(&s, current) && !failed;
+#if !defined(_WIN32)
+    alarm(0);
+#endif
+    total++;
+    if (ok) {
+      loaded++;
+      if (!bmp_size(current, &w, &h) || w != s.w || h != s.h) {
+        fprintf(stderr, "%s: decoded %dx%d, header says %dx%d\n", current, s.w, s.h, w, h);
+        errors++;
+      } else if (must_load && !check(dir, e->d_name, &s))
+        errors++;
+      surface_destroy(&s);
+    } else if (must_load) {
+      fprintf(stderr, "%s: failed: %s\n", current, graphics_ctx_current()->error);
+      errors++;
+    }
+  }
+  closedir(d);
+  printf("%s: %d/%d loaded, %d error%s\n", set, loaded, total, errors, errors == 1 ? "" : "s");
+  fflush(stdout);
+  return errors;
+}
+
+int main(int argc, const char* argv[]) {
+  const char* dir = argc > 1 ? argv[1] : "tests/bmp";
+  graphics_error_callback(on_error);
+#if !defined(_WIN32)
+  signal(SIGALRM, on_timeout);
+#endif
+  int errors = run(dir, "g", true) + run(dir, "b", false) + run(dir, "q", false) + run(dir, "regress", false);
+  return errors ? 1 : 0;
+}